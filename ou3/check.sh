@@ -0,0 +1,227 @@
+#!/bin/bash
+
+ # @file check.sh
+ # @brief Checks that "./mdu" prints the same totals as "du" on generated trees.
+ # @author Bran Mjöberg Quanne
+ # @date 2025-11-19
+ #
+ # Usage: check.sh [executable ...]
+ #
+ # Every case runs each executable (./mdu by default; make check adds one
+ # built with QUEUE=ring) with some options on some paths, with one and
+ # with several threads and with both engines, and compares its output
+ # with that of du -s in 512-byte blocks on the same paths. Exits with a
+ # failure status if any case differs.
+ #
+ # The -x cases need a file system mounted inside a tree, so they only
+ # run as root; otherwise they are skipped with a note.
+
+
+EXECUTABLES=()
+for EXECUTABLE in "${@:-./mdu}"; do
+    EXECUTABLES+=("$(realpath "$EXECUTABLE")")
+done
+
+THREADS="1 4"
+
+ENGINES="queue steal"
+
+WORK_DIR=$(mktemp -d)
+MOUNTED=""
+trap '[ -n "$MOUNTED" ] && umount "$MOUNTED"; rm -rf "$WORK_DIR"' EXIT
+
+FAILURES=0
+CASES=0
+
+# Writes a file of the given number of KiB.
+make_file() {
+    head -c "$(($2 * 1024))" /dev/zero > "$1"
+}
+
+# Builds the trees the cases run on.
+make_trees() {
+    local dir i j
+
+    # links: hard links shared within and across the arguments.
+    mkdir -p "$WORK_DIR/links/r0/x/y/z" "$WORK_DIR/links/r1" "$WORK_DIR/links/a/b/c"
+    make_file "$WORK_DIR/links/r1/file" 100
+    ln "$WORK_DIR/links/r1/file" "$WORK_DIR/links/r0/x/y/z/link"
+    for i in $(seq 3000); do
+        : > "$WORK_DIR/links/r0/e$i"
+    done
+    make_file "$WORK_DIR/links/a/b/c/f" 100
+    make_file "$WORK_DIR/links/a/g" 1
+    ln "$WORK_DIR/links/a/b/c/f" "$WORK_DIR/links/a/h"
+    ln "$WORK_DIR/links/a/b/c/f" "$WORK_DIR/links/a/b/c/f2"
+    mkdir -p "$WORK_DIR/links/m"
+    make_file "$WORK_DIR/links/m/file" 50
+    for i in $(seq 8); do
+        mkdir -p "$WORK_DIR/links/m/d$i/sub"
+        make_file "$WORK_DIR/links/m/d$i/own" "$i"
+        ln "$WORK_DIR/links/m/file" "$WORK_DIR/links/m/d$i/sub/link"
+    done
+
+    # tree: nested directories with files of many sizes, sparse files,
+    # symlinks, names to exclude and one directory large enough to have
+    # its listing split between workers. No hard links, so that the
+    # totals of subdirectories do not depend on the order of traversal.
+    for i in 1 2 3 4; do
+        dir="$WORK_DIR/tree/d$i"
+        for j in 1 2 3; do
+            mkdir -p "$dir/s$j/deep/er/still"
+            make_file "$dir/s$j/file" $((i * j))
+            make_file "$dir/s$j/deep/er/still/leaf" $((i * 7 + j))
+            make_file "$dir/s$j/trace.log" 40
+            mkdir -p "$dir/s$j/cache"
+            make_file "$dir/s$j/cache/blob" 64
+        done
+        truncate -s 10M "$dir/sparse"
+        ln -s "../d$i/s1/file" "$dir/link"
+        mkdir -p "$dir/empty"
+    done
+    mkdir -p "$WORK_DIR/tree/wide"
+    for i in $(seq 2500); do
+        make_file "$WORK_DIR/tree/wide/some-longer-file-name-$i" $((i % 3))
+    done
+
+    # xdev: a tree with another file system mounted inside it.
+    mkdir -p "$WORK_DIR/xdev/mnt/sub"
+    make_file "$WORK_DIR/xdev/own" 30
+    if [ "$(id -u)" -eq 0 ] && mount -t tmpfs mdu-check "$WORK_DIR/xdev/mnt" 2>/dev/null; then
+        MOUNTED="$WORK_DIR/xdev/mnt"
+        mkdir -p "$WORK_DIR/xdev/mnt/sub"
+        make_file "$WORK_DIR/xdev/mnt/sub/other" 50
+    fi
+}
+
+# Changes the tree between runs that share a scan cache.
+change_tree() {
+    make_file "$WORK_DIR/tree/d1/s1/new" 12
+    rm -f "$WORK_DIR/tree/d2/s2/file"
+    mkdir -p "$WORK_DIR/tree/d3/fresh"
+    make_file "$WORK_DIR/tree/d3/fresh/file" 3
+}
+
+# Compares mdu with the options in $2 and du with those in $3 on the paths that follow, relative to $WORK_DIR.
+# du gets -s unless $3 sets a depth. If $1 is "sorted", the lines are compared in any order, as for -d, which
+# prints directories as they finish.
+compare() {
+    local order=$1
+    local mdu_options=$2
+    local du_options=$3
+    shift 3
+    local executable expected actual
+    [[ $du_options == *--max-depth* ]] || du_options="-s $du_options"
+    expected=$(cd "$WORK_DIR" && du -B512 $du_options "$@" 2>&1)
+    for executable in "${EXECUTABLES[@]}"; do
+        actual=$(cd "$WORK_DIR" && "$executable" $mdu_options "$@" 2>&1)
+        if [ "$order" = sorted ]; then
+            expected=$(sort <<< "$expected")
+            actual=$(sort <<< "$actual")
+        fi
+        CASES=$((CASES + 1))
+        if [ "$actual" != "$expected" ]; then
+            FAILURES=$((FAILURES + 1))
+            echo "FAIL: $executable $mdu_options $*"
+            echo "  du:  $(echo $expected)"
+            echo "  mdu: $(echo $actual)"
+        fi
+    done
+}
+
+# Compares mdu --top with $1 on the paths that follow, relative to $WORK_DIR, with what du -a lists on them: all
+# files and all directories but the paths themselves, as the trees are small. Entries of 0 blocks are left out like
+# mdu does, and the lines of each section are compared in any order.
+compare_top() {
+    local mdu_options=$1
+    shift
+    local executable expected actual
+    expected=$(cd "$WORK_DIR" && {
+        du -B512 -s "$@"
+        echo "Largest files:"
+        du -B512 -a "$@" | while IFS=$'\t' read -r size path; do
+            [ "$size" != 0 ] && [ ! -d "$path" ] && printf '%s\t%s\n' "$size" "$path"
+        done
+        echo "Largest directories:"
+        du -B512 "$@" | while IFS=$'\t' read -r size path; do
+            [[ " $* " == *" $path "* ]] || printf '%s\t%s\n' "$size" "$path"
+        done
+    } 2>&1 | awk '/^Largest/ { section = $0; next } { print section "|" $0 }' | sort)
+    for executable in "${EXECUTABLES[@]}"; do
+        actual=$(cd "$WORK_DIR" && "$executable" $mdu_options --top=100 "$@" 2>&1 |
+            awk '/^Largest/ { section = $0; next } { print section "|" $0 }' | sort)
+        CASES=$((CASES + 1))
+        if [ "$actual" != "$expected" ]; then
+            FAILURES=$((FAILURES + 1))
+            echo "FAIL: $executable $mdu_options --top=100 $*"
+            echo "  du:  $(echo $expected)"
+            echo "  mdu: $(echo $actual)"
+        fi
+    done
+}
+
+# Runs a case with every number of threads and engine.
+compare_all() {
+    local threads engine
+    for threads in $THREADS; do
+        for engine in $ENGINES; do
+            compare "$1" "-j $threads -e $engine $2" "$3" "${@:4}"
+        done
+    done
+}
+
+make_trees
+
+# Hard links shared across arguments count for the first argument, and an
+# argument below or equal to an earlier one is counted with it.
+compare_all lines "" "" links/r0 links/r1
+compare_all lines "" "" links/r1 links/r0
+compare_all lines "" "" links/a/b links/a
+compare_all lines "" "" links/a links/a/b
+compare_all lines "" "" links/a links/a
+compare_all lines "" "" links/a/h links/a/b links/a/b/c/f
+compare_all lines "-u" "" links/r0 links/r1 links/a
+compare_all lines "-l" "-l" links/r0 links/r1 links/a/b links/a
+
+# Directory totals and the largest files credit a hard-linked file to the
+# directory of the link du counts, whichever worker finds a link first.
+compare_all sorted "-d 2" "--max-depth=2" links/m links/a
+compare_all sorted "-d 1" "--max-depth=1" links/r1 links/r0
+compare_all sorted "-d 3 -u" "--max-depth=3" links/a links/m
+for threads in $THREADS; do
+    for engine in $ENGINES; do
+        compare_top "-j $threads -e $engine" links/m links/a
+        compare_top "-j $threads -e $engine" links/r1 links/r0/x
+    done
+done
+
+# Plain totals, io_uring, filters and directory totals.
+compare_all lines "" "" tree
+compare_all lines "-u" "" tree tree/d1 tree/wide
+compare_all lines "-l" "-l" tree links
+compare_all lines "--exclude=*.log --exclude=cache" "--exclude=*.log --exclude=cache" tree
+compare_all sorted "-d 2" "--max-depth=2" tree
+compare_all sorted "-d 1 --exclude=cache" "--max-depth=1 --exclude=cache" tree
+
+# One file system.
+if [ -n "$MOUNTED" ]; then
+    compare_all lines "" "" xdev
+    compare_all lines "-x" "-x" xdev
+    compare_all lines "-x -u" "-x" xdev xdev/mnt
+else
+    echo "skipped the -x cases, which need root to mount a file system"
+fi
+
+# Rescans through a scan cache, before and after the tree changes.
+for threads in $THREADS; do
+    rm -f "$WORK_DIR/cache"
+    compare lines "-j $threads -c cache" "" tree links/a
+    compare lines "-j $threads -c cache" "" tree links/a
+    compare lines "-j $threads -c cache" "" tree/d1 tree
+    change_tree
+    compare lines "-j $threads -c cache" "" tree links/a
+    compare lines "-j $threads -c cache -C verify" "" tree links/a
+done
+
+echo "$CASES cases, $FAILURES failed"
+[ $FAILURES -eq 0 ]
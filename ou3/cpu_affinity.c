@@ -0,0 +1,203 @@
+/**
+ * @file cpu_affinity.c
+ * @brief Implementation of worker placement on CPUs and NUMA nodes.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * The CPUs the process may run on are taken from its affinity mask, and
+ * their NUMA nodes from the cpulist files in sysfs. Nodes are numbered in
+ * the order of their sysfs numbers, counting only those with a CPU the
+ * process may use, so that a placement inside a cpuset still yields
+ * nodes 0 to n-1. Without NUMA information in sysfs, every CPU is taken
+ * to be on one node.
+ */
+
+#define _GNU_SOURCE
+#include "cpu_affinity.h"
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/** Directory with a nodeN subdirectory per NUMA node, each listing its CPUs in a cpulist file. */
+#define NODE_DIR "/sys/devices/system/node"
+
+/**
+ * @brief Sets node_of[cpu] to node for every CPU of a list like "0-3,8-11".
+ * CPUs at or above CPU_SETSIZE are ignored.
+ */
+static void parse_cpu_list(const char *list, int node, int *node_of) {
+    const char *p = list;
+    for (;;) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return;
+            }
+        }
+        for (long cpu = first < 0 ? 0 : first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            node_of[cpu] = node;
+        }
+        if (*end != ',') {
+            return;
+        }
+        p = end + 1;
+    }
+}
+
+/**
+ * @brief Reads the NUMA node of every CPU from sysfs into node_of.
+ * CPUs that no node lists, which is all of them without NUMA information
+ * in sysfs, are left at -1.
+ */
+static void read_cpu_nodes(int *node_of) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        node_of[cpu] = -1;
+    }
+    DIR *dir = opendir(NODE_DIR);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        char rest;
+        if (sscanf(entry->d_name, "node%d%c", &node, &rest) != 1 || node < 0) {
+            continue;
+        }
+        char path[sizeof(NODE_DIR) + sizeof(entry->d_name) + sizeof("/cpulist")];
+        snprintf(path, sizeof(path), "%s/%s/cpulist", NODE_DIR, entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+        char list[4096];
+        if (fgets(list, sizeof(list), file)) {
+            parse_cpu_list(list, node, node_of);
+        }
+        fclose(file);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Compares two longs for qsort.
+ */
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Chooses a CPU and NUMA node for each of num_workers workers.
+ *
+ * The usable CPUs are ordered by node and then by number. With
+ * AFFINITY_COMPACT, worker i gets the i-th of them, so the workers fill
+ * one node before they spill onto the next; as Linux numbers the second
+ * hardware thread of a core after the first threads of all cores, a node's
+ * cores are filled before their siblings. With AFFINITY_SCATTER, worker i
+ * goes to node i modulo the number of nodes, onto the next CPU of that
+ * node, so every node gets workers from the start. Either way the
+ * workers wrap around when there are more of them than CPUs. With
+ * AFFINITY_NONE, no worker is pinned and all are on node 0.
+ * Returns the number of nodes the workers were placed on, or -1 with
+ * errno set if the process's affinity mask cannot be read.
+ */
+int affinity_place(affinity_t affinity, int num_workers, cpu_place_t *places) {
+    if (affinity == AFFINITY_NONE) {
+        for (int i = 0; i < num_workers; i++) {
+            places[i] = (cpu_place_t){.cpu = -1, .node = 0};
+        }
+        return 1;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return -1;
+    }
+    int *node_of = malloc(CPU_SETSIZE * sizeof(int));
+    long *keys = malloc(CPU_SETSIZE * sizeof(long));
+    int *start = malloc((CPU_SETSIZE + 1) * sizeof(int));
+    if (!node_of || !keys || !start) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    read_cpu_nodes(node_of);
+
+    int num_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            keys[num_cpus++] = (long)(node_of[cpu] + 1) * CPU_SETSIZE + cpu;
+        }
+    }
+    qsort(keys, num_cpus, sizeof(long), compare_long);
+    int num_nodes = 0;
+    for (int i = 0; i < num_cpus; i++) {
+        if (i == 0 || keys[i] / CPU_SETSIZE != keys[i - 1] / CPU_SETSIZE) {
+            start[num_nodes++] = i;
+        }
+    }
+    start[num_nodes] = num_cpus;
+
+    int used = 0;
+    for (int i = 0; i < num_workers && num_cpus > 0; i++) {
+        int node = 0;
+        int index;
+        if (affinity == AFFINITY_COMPACT) {
+            index = i % num_cpus;
+            while (start[node + 1] <= index) {
+                node++;
+            }
+        } else {
+            node = i % num_nodes;
+            index = start[node] + i / num_nodes % (start[node + 1] - start[node]);
+        }
+        places[i] = (cpu_place_t){.cpu = (int)(keys[index] % CPU_SETSIZE), .node = node};
+        used = node + 1 > used ? node + 1 : used;
+    }
+
+    free(node_of);
+    free(keys);
+    free(start);
+    if (num_cpus == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return used;
+}
+
+/**
+ * @brief Initializes thread attributes that start a thread pinned to cpu.
+ * Pinning at creation, rather than from inside the thread, has the
+ * thread's first allocations land on its own node. Returns 0, or an
+ * error number like the pthread functions, in which case attr is left
+ * destroyed.
+ */
+int affinity_attr_init(pthread_attr_t *attr, int cpu) {
+    int errnum = pthread_attr_init(attr);
+    if (errnum != 0) {
+        return errnum;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    errnum = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (errnum != 0) {
+        pthread_attr_destroy(attr);
+    }
+    return errnum;
+}
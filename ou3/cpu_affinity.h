@@ -0,0 +1,40 @@
+/**
+ * @file cpu_affinity.h
+ * @brief Placement of worker threads on CPUs and NUMA nodes.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Left alone, the scheduler moves workers between sockets, and the cache
+ * lines of the work queue and of the directories being listed then move
+ * across the interconnect with them. A placement pins every worker to
+ * one CPU the process may run on and tells it the NUMA node of that CPU,
+ * so that the work queue can keep work on the node that found it.
+ */
+
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <pthread.h>
+
+/**
+ * @brief How workers are spread over the CPUs.
+ */
+typedef enum {
+    AFFINITY_NONE,    /**< Workers are not pinned and all count as node 0 */
+    AFFINITY_COMPACT, /**< Fill the CPUs of one node before using the next */
+    AFFINITY_SCATTER  /**< Deal workers to the nodes in turn */
+} affinity_t;
+
+/**
+ * @struct cpu_place_t
+ * @brief Where one worker runs.
+ */
+typedef struct {
+    int cpu;  /**< CPU the worker is pinned to, -1 if it is not pinned */
+    int node; /**< Index of the CPU's NUMA node among the nodes used, 0 if not pinned */
+} cpu_place_t;
+
+int affinity_place(affinity_t affinity, int num_workers, cpu_place_t *places);
+int affinity_attr_init(pthread_attr_t *attr, int cpu);
+
+#endif // CPU_AFFINITY_H
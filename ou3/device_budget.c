@@ -0,0 +1,202 @@
+/**
+ * @file device_budget.c
+ * @brief Implementation of per-device worker limits.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Devices are kept in a small fixed table that is only appended to, so
+ * workers look up a device without locking; the table's mutex is only
+ * taken to add a device the first time it is seen. Each device has its
+ * own mutex, which guards its count of busy workers and the items set
+ * aside for it. Devices beyond the table's size are not limited.
+ */
+
+#include "device_budget.h"
+#include "safe_lock.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/** Most devices a budget keeps track of; further ones are not limited. */
+#define MAX_DEVICES 64
+
+/**
+ * @struct device_slot_t
+ * @brief The busy workers and waiting items of one device.
+ */
+typedef struct {
+    alignas(64) pthread_mutex_t mutex; /**< Guards the fields below */
+    uint64_t dev;                      /**< Device, set before the slot is published */
+    int max;                           /**< Most workers busy with items of the device, 0 for no limit */
+    int busy;                          /**< Workers busy with items of the device */
+    void **waiting;                    /**< Items set aside until a worker is free, used as a stack */
+    size_t num_waiting;                /**< Entries in waiting */
+    size_t capacity;                   /**< Allocated entries of waiting */
+} device_slot_t;
+
+/**
+ * @struct device_budget
+ * @brief Internal structure holding the table of devices.
+ */
+struct device_budget {
+    device_slot_t slots[MAX_DEVICES]; /**< Devices seen so far */
+    atomic_int count;                 /**< Published slots, read without locking */
+    pthread_mutex_t mutex;            /**< Serializes adding slots */
+    int default_max;                  /**< Limit of devices without one of their own, 0 for none */
+};
+
+/**
+ * @brief Returns the slot of a device among the published ones, or NULL.
+ */
+static device_slot_t *find_slot(device_budget_t *budget, uint64_t dev) {
+    int count = atomic_load_explicit(&budget->count, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        if (budget->slots[i].dev == dev) {
+            return &budget->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the slot of a device, adding one with the given limit if it has none.
+ * Returns NULL if the table is full.
+ */
+static device_slot_t *get_slot(device_budget_t *budget, uint64_t dev, int max) {
+    device_slot_t *slot = find_slot(budget, dev);
+    if (slot) {
+        return slot;
+    }
+
+    safe_lock(&budget->mutex);
+    slot = find_slot(budget, dev);
+    int count = atomic_load_explicit(&budget->count, memory_order_relaxed);
+    if (!slot && count < MAX_DEVICES) {
+        slot = &budget->slots[count];
+        int errnum = pthread_mutex_init(&slot->mutex, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        slot->dev = dev;
+        slot->max = max;
+        slot->busy = 0;
+        slot->waiting = NULL;
+        slot->num_waiting = 0;
+        slot->capacity = 0;
+        atomic_store_explicit(&budget->count, count + 1, memory_order_release);
+    }
+    safe_unlock(&budget->mutex);
+    return slot;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates a budget letting at most default_max workers work on each device.
+ * A default_max of 0 leaves devices unlimited unless device_budget_set()
+ * gives them a limit. Exits the program if allocation fails.
+ */
+device_budget_t *device_budget_create(int default_max) {
+    device_budget_t *budget = malloc(sizeof(device_budget_t));
+    if (!budget) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&budget->count, 0);
+    budget->default_max = default_max;
+    int errnum = pthread_mutex_init(&budget->mutex, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    return budget;
+}
+
+/**
+ * @brief Lets at most max workers work on a device, 0 for no limit.
+ * Must be called before the budget is used by the workers.
+ */
+void device_budget_set(device_budget_t *budget, uint64_t dev, int max) {
+    device_slot_t *slot = get_slot(budget, dev, max);
+    if (slot) {
+        slot->max = max;
+    }
+}
+
+/**
+ * @brief Claims a place for a worker about to process an item of a device.
+ * Returns 1 if the worker may go ahead, and must then call
+ * device_budget_leave() once done with the item. If the device is at its
+ * limit, the item is set aside for a worker already busy with the device
+ * and 0 is returned.
+ */
+int device_budget_enter(device_budget_t *budget, uint64_t dev, void *item) {
+    device_slot_t *slot = find_slot(budget, dev);
+    if (!slot && budget->default_max > 0) {
+        slot = get_slot(budget, dev, budget->default_max);
+    }
+    if (!slot || slot->max == 0) {
+        return 1;
+    }
+
+    safe_lock(&slot->mutex);
+    int entered = slot->busy < slot->max;
+    if (entered) {
+        slot->busy++;
+    } else {
+        if (slot->num_waiting == slot->capacity) {
+            size_t capacity = slot->capacity ? slot->capacity * 2 : 64;
+            void **waiting = realloc(slot->waiting, capacity * sizeof(void *));
+            if (!waiting) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            slot->waiting = waiting;
+            slot->capacity = capacity;
+        }
+        slot->waiting[slot->num_waiting++] = item;
+    }
+    safe_unlock(&slot->mutex);
+    return entered;
+}
+
+/**
+ * @brief Gives up the place a worker claimed for an item of a device.
+ * If items of the device were set aside, the worker keeps its place and
+ * one of them is returned for it to process next, to be followed by
+ * another call. Otherwise NULL is returned.
+ */
+void *device_budget_leave(device_budget_t *budget, uint64_t dev) {
+    device_slot_t *slot = find_slot(budget, dev);
+    if (!slot || slot->max == 0) {
+        return NULL;
+    }
+
+    void *item = NULL;
+    safe_lock(&slot->mutex);
+    if (slot->num_waiting > 0) {
+        item = slot->waiting[--slot->num_waiting];
+    } else {
+        slot->busy--;
+    }
+    safe_unlock(&slot->mutex);
+    return item;
+}
+
+/**
+ * @brief Frees the budget. No items may be set aside in it any more.
+ */
+void device_budget_destroy(device_budget_t *budget) {
+    int count = atomic_load(&budget->count);
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_destroy(&budget->slots[i].mutex);
+        free(budget->slots[i].waiting);
+    }
+    pthread_mutex_destroy(&budget->mutex);
+    free(budget);
+}
@@ -0,0 +1,26 @@
+/**
+ * @file device_budget.h
+ * @brief Per-device limits on how many workers of a scan work on one file system at once.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * When a scan spans fast and slow file systems, a slow one can tie up
+ * every worker in blocking calls while work on the fast ones waits. A
+ * budget caps the workers busy with items of each device; an item whose
+ * device is at its cap is set aside, and picked up by the next worker to
+ * finish an item of that device, which keeps its place.
+ */
+
+#ifndef DEVICE_BUDGET_H
+#define DEVICE_BUDGET_H
+
+#include <stdint.h>
+
+typedef struct device_budget device_budget_t;
+device_budget_t *device_budget_create(int default_max);
+void device_budget_set(device_budget_t *budget, uint64_t dev, int max);
+int device_budget_enter(device_budget_t *budget, uint64_t dev, void *item);
+void *device_budget_leave(device_budget_t *budget, uint64_t dev);
+void device_budget_destroy(device_budget_t *budget);
+
+#endif // DEVICE_BUDGET_H
@@ -0,0 +1,358 @@
+/**
+ * @file dir_handle.c
+ * @brief Implementation of reference-counted directory handles and work items.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ */
+
+#include "dir_handle.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/** Size of a directory's first item chunk; later chunks double up to ITEM_CHUNK_MAX. */
+#define ITEM_CHUNK_MIN 512
+
+/** Largest item chunk, enough for about 500 entries with typical names. */
+#define ITEM_CHUNK_MAX (64 * 1024)
+
+/** Alignment of items within a chunk. */
+#define ITEM_ALIGN alignof(scan_item_t)
+
+/**
+ * @struct item_chunk
+ * @brief A block of memory holding work items for the entries of one directory.
+ */
+typedef struct item_chunk {
+    struct item_chunk *next;                   /**< Previously filled chunk */
+    size_t used;                               /**< Bytes handed out */
+    size_t size;                               /**< Bytes available in data */
+    alignas(scan_item_t) unsigned char data[]; /**< Item storage */
+} item_chunk_t;
+
+/**
+ * @brief Carves size bytes for an item out of parent's chunks.
+ * Usually only the thread listing parent calls this, but the workers
+ * handling chunks of a split listing create items for the subdirectories
+ * in them as well, so the chunks are guarded by a spin lock. It is held
+ * for a few instructions, apart from the occasional malloc of a new chunk.
+ */
+static scan_item_t *item_alloc(dir_handle_t *parent, size_t size) {
+    size = (size + ITEM_ALIGN - 1) & ~(ITEM_ALIGN - 1);
+    while (atomic_flag_test_and_set_explicit(&parent->items_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+    item_chunk_t *chunk = parent->items;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = chunk ? chunk->size * 2 : ITEM_CHUNK_MIN;
+        if (chunk_size > ITEM_CHUNK_MAX) {
+            chunk_size = ITEM_CHUNK_MAX;
+        }
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+
+        item_chunk_t *fresh = malloc(sizeof(item_chunk_t) + chunk_size);
+        if (!fresh) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        fresh->next = chunk;
+        fresh->used = 0;
+        fresh->size = chunk_size;
+        parent->items = chunk = fresh;
+    }
+
+    scan_item_t *item = (scan_item_t *)(chunk->data + chunk->used);
+    chunk->used += size;
+    atomic_flag_clear_explicit(&parent->items_lock, memory_order_release);
+    return item;
+}
+
+/**
+ * @brief Frees all item chunks of a handle.
+ */
+static void free_item_chunks(dir_handle_t *handle) {
+    item_chunk_t *chunk = handle->items;
+    while (chunk) {
+        item_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    handle->items = NULL;
+}
+
+/**
+ * @brief Builds "<parent path>/<name>" by walking the handle chain.
+ * Returns a newly allocated string, or NULL if allocation fails.
+ */
+static char *build_path(const dir_handle_t *parent, const char *name) {
+    size_t length = strlen(name);
+    for (const dir_handle_t *h = parent; h; h = h->parent) {
+        length += strlen(h->name) + 1;
+    }
+
+    char *path = malloc(length + 1);
+    if (!path) {
+        return NULL;
+    }
+
+    size_t pos = length - strlen(name);
+    memcpy(path + pos, name, strlen(name) + 1);
+    for (const dir_handle_t *h = parent; h; h = h->parent) {
+        size_t part = strlen(h->name);
+        path[--pos] = '/';
+        pos -= part;
+        memcpy(path + pos, h->name, part);
+    }
+    return path;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates a work item for an entry in parent.
+ * The item keeps the parent's fd open until it is freed. Items for the
+ * entries of a directory come from the directory's chunks, and may be
+ * created by any thread using the directory; a root item is allocated on
+ * its own.
+ */
+scan_item_t *item_create(dir_handle_t *parent, const char *name) {
+    size_t length = strlen(name) + 1;
+    size_t size = sizeof(scan_item_t) + length;
+    scan_item_t *item = parent ? item_alloc(parent, size) : malloc(size);
+    if (!item) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    item->parent = parent;
+    item->stat_done = 0;
+    item->blocks = 0;
+    item->root = parent ? parent->root : 0;
+    item->dev = parent ? parent->dev : 0;
+    item->index = 0;
+    item->chunk_size = 0;
+    memcpy(item->name, name, length);
+    if (parent) {
+        atomic_fetch_add(&parent->users, 1);
+    }
+    return item;
+}
+
+/**
+ * @brief Creates a work item for a chunk of parent's listing.
+ * The size bytes of getdents64 records are copied into the item, which is
+ * allocated on its own rather than from parent's chunks, so that its
+ * memory is returned as soon as it has been processed. Like an entry's
+ * item, it keeps the parent's fd open until it is freed.
+ */
+scan_item_t *item_create_chunk(dir_handle_t *parent, const void *records, size_t size) {
+    scan_item_t *item = malloc(sizeof(scan_item_t) + size);
+    if (!item) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    item->parent = parent;
+    item->stat_done = 0;
+    item->blocks = 0;
+    item->root = parent->root;
+    item->dev = parent->dev;
+    item->index = 0;
+    item->chunk_size = size;
+    memcpy(item->name, records, size);
+    atomic_fetch_add(&parent->users, 1);
+    return item;
+}
+
+/**
+ * @brief Returns the directory fd to resolve the item's name against.
+ */
+int item_dirfd(const scan_item_t *item) {
+    return item->parent ? item->parent->fd : AT_FDCWD;
+}
+
+/**
+ * @brief Returns the full path of an item for use in messages.
+ * The caller frees the string. errno is preserved so that the path can be
+ * built between a failing call and perror().
+ */
+char *item_path(const scan_item_t *item) {
+    return entry_path(item->parent, item->name);
+}
+
+/**
+ * @brief Returns the full path of the entry name in parent for use in messages.
+ * The caller frees the string. errno is preserved like in item_path().
+ */
+char *entry_path(const dir_handle_t *parent, const char *name) {
+    int saved_errno = errno;
+    char *path = build_path(parent, name);
+    errno = saved_errno;
+    return path;
+}
+
+/**
+ * @brief Frees an item and releases its use of the parent's fd.
+ * An item of a directory's entry stays in its chunk until the last item of
+ * that directory is done, which frees them all; roots and chunks are
+ * freed right away. worker identifies the caller to a rollup, see
+ * dir_handle_release(). Returns -1 if this closed the parent directory and
+ * closing failed.
+ */
+int item_free(scan_item_t *item, void *worker) {
+    dir_handle_t *parent = item->parent;
+    if (!parent || item->chunk_size) {
+        free(item);
+    }
+    return parent ? dir_handle_release(parent, worker) : 0;
+}
+
+/**
+ * @brief Wraps an opened directory stream in a new handle.
+ * The handle starts with one user, held by the caller that lists the
+ * directory, and pins its parent's name chain. rollup is NULL, or sums
+ * directory totals up the tree if its done callback is set.
+ */
+dir_handle_t *dir_handle_create(dir_handle_t *parent, const char *name, DIR *dir, const dir_rollup_t *rollup) {
+    size_t length = strlen(name) + 1;
+    dir_handle_t *handle = malloc(sizeof(dir_handle_t) + length);
+    if (!handle) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    handle->dir = dir;
+    handle->fd = dirfd(dir);
+    atomic_init(&handle->users, 1);
+    atomic_init(&handle->refs, 1);
+    handle->parent = parent;
+    handle->depth = parent ? parent->depth + 1 : 0;
+    handle->root = parent ? parent->root : 0;
+    handle->root_dev = parent ? parent->root_dev : 0;
+    handle->dev = parent ? parent->dev : 0;
+    handle->index = 0;
+    handle->rollup = rollup;
+    atomic_init(&handle->blocks, 0);
+    handle->items = NULL;
+    atomic_flag_clear(&handle->items_lock);
+    memcpy(handle->name, name, length);
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    return handle;
+}
+
+/**
+ * @brief Adds blocks counted in a directory to its total, if totals are summed.
+ * Must be called while the caller still uses or holds the handle.
+ */
+void dir_handle_add_blocks(dir_handle_t *handle, size_t blocks) {
+    if (handle && handle->rollup && handle->rollup->done && blocks > 0) {
+        atomic_fetch_add(&handle->blocks, blocks);
+    }
+}
+
+/**
+ * @brief Drops one reference to a handle's name chain.
+ * Frees the handle and walks up to release its parent when the last
+ * reference is gone. Iterative so that deep chains do not use the stack.
+ * When totals are summed, the finished directory's total is reported and
+ * added to its parent before the parent's reference is dropped, so a
+ * parent's total is complete by the time it finishes in turn. worker is
+ * passed on to the rollup's callback.
+ */
+void dir_handle_unref(dir_handle_t *handle, void *worker) {
+    while (handle && atomic_fetch_sub(&handle->refs, 1) == 1) {
+        dir_handle_t *parent = handle->parent;
+        if (handle->rollup && handle->rollup->done) {
+            unsigned long long blocks = atomic_load(&handle->blocks);
+            handle->rollup->done(handle, blocks, handle->rollup->context, worker);
+            if (parent) {
+                atomic_fetch_add(&parent->blocks, blocks);
+            }
+        }
+        free(handle);
+        handle = parent;
+    }
+}
+
+/**
+ * @brief Takes one more reference to a handle's name chain.
+ * Keeps the handle, and so the totals of the directories above it, from
+ * finishing until it is dropped with dir_handle_unref(). Must be called
+ * while the caller still uses or holds the handle.
+ */
+void dir_handle_ref(dir_handle_t *handle) {
+    atomic_fetch_add(&handle->refs, 1);
+}
+
+/**
+ * @brief Orders two entries of the same scanned path the way a depth-first traversal reaches them.
+ * The entries are the ones at index_a in a and at index_b in b, where a
+ * NULL handle stands for the scanned path itself. Both chains are walked
+ * up to the directory they share, and the entries, or the directories
+ * leading to them, are ordered by their positions in its listing; an
+ * entry comes before everything below it. Returns a negative value, 0 or
+ * a positive value like strcmp().
+ */
+int dir_handle_compare(const dir_handle_t *a, uint64_t index_a, const dir_handle_t *b, uint64_t index_b) {
+    if (!a || !b) {
+        return (a != NULL) - (b != NULL);
+    }
+    while (a->depth > b->depth) {
+        index_a = a->index;
+        a = a->parent;
+    }
+    while (b->depth > a->depth) {
+        index_b = b->index;
+        b = b->parent;
+    }
+    while (a != b) {
+        index_a = a->index;
+        a = a->parent;
+        index_b = b->index;
+        b = b->parent;
+    }
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+/**
+ * @brief Releases one user of a handle's fd.
+ * The last user closes the directory, frees the items of its entries in
+ * bulk and drops the fd's reference. Directories this finishes are
+ * passed to the rollup's callback along with worker, which may be NULL.
+ * Returns -1 if closedir failed, after reporting it with the full path,
+ * through the rollup's error callback if it has one.
+ */
+int dir_handle_release(dir_handle_t *handle, void *worker) {
+    if (atomic_fetch_sub(&handle->users, 1) != 1) {
+        return 0;
+    }
+
+    int ret = 0;
+    if (closedir(handle->dir) == -1) {
+        int saved_errno = errno;
+        char *path = build_path(handle->parent, handle->name);
+        if (handle->rollup && handle->rollup->error) {
+            handle->rollup->error(path ? path : handle->name, saved_errno, handle->rollup->context, worker);
+        } else {
+            errno = saved_errno;
+            perror(path ? path : handle->name);
+        }
+        free(path);
+        ret = -1;
+    }
+    handle->dir = NULL;
+    handle->fd = -1;
+    free_item_chunks(handle);
+    dir_handle_unref(handle, worker);
+    return ret;
+}
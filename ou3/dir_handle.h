@@ -0,0 +1,109 @@
+/**
+ * @file dir_handle.h
+ * @brief Reference-counted directory handles and work items for fd-relative traversal.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * A work item names one entry relative to its parent directory handle, so
+ * workers can use fstatat/openat on the parent's fd instead of building and
+ * re-walking a full path for every entry.
+ */
+
+#ifndef DIR_HANDLE_H
+#define DIR_HANDLE_H
+
+#include <dirent.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct dir_handle;
+struct item_chunk;
+
+/**
+ * @brief Called with a directory's total once everything below it has been counted.
+ * worker is what the caller of the release that finished the directory
+ * passed, so the callback can tell which thread it runs on.
+ */
+typedef void (*dir_done_fn)(const struct dir_handle *handle, unsigned long long blocks, void *context, void *worker);
+
+/**
+ * @brief Called instead of printing an error when closing a directory fails.
+ * worker is passed on like for dir_done_fn.
+ */
+typedef void (*dir_error_fn)(const char *path, int errnum, void *context, void *worker);
+
+/**
+ * @struct dir_rollup_t
+ * @brief Summing of directory totals up the tree and error reporting, shared by all handles of a scan.
+ */
+typedef struct {
+    dir_done_fn done;   /**< Called for every finished directory, NULL if totals are not summed */
+    dir_error_fn error; /**< Called if closing a directory fails, NULL to print the error */
+    void *context;      /**< Passed to done and error */
+} dir_rollup_t;
+
+/**
+ * @struct dir_handle
+ * @brief An open directory shared by the work items naming its entries.
+ *
+ * The directory stream stays open while the lister or any child item still
+ * needs its fd. The handle itself lives as long as any descendant handle,
+ * so full paths can be rebuilt for error messages. It is therefore freed
+ * exactly when its whole subtree has been processed, which is where a
+ * rollup adds the directory's total to its parent.
+ *
+ * The work items for a directory's entries are carved out of chunks owned
+ * by its handle, and all of them are freed at once when the last one is
+ * done, instead of one malloc and one free per entry.
+ */
+typedef struct dir_handle {
+    DIR *dir;                   /**< Open directory stream, NULL once closed */
+    int fd;                     /**< File descriptor of dir, base for *at() calls */
+    atomic_int users;           /**< Lister plus pending child items using fd */
+    atomic_int refs;            /**< Open fd plus child handles keeping the name chain */
+    struct dir_handle *parent;  /**< Parent directory, NULL for a root */
+    unsigned int depth;         /**< Levels below the root, 0 for a root */
+    unsigned int root;          /**< Index of the scanned path this directory is under */
+    uint64_t root_dev;          /**< Device of the scanned path this directory is under */
+    uint64_t dev;               /**< Device of this directory */
+    uint64_t index;             /**< Position of the directory in its parent's listing, 0 for a root */
+    const dir_rollup_t *rollup; /**< Rollup of this scan, NULL for none */
+    atomic_ullong blocks;       /**< Blocks counted in this subtree so far, if totals are summed */
+    struct item_chunk *items;   /**< Memory of the items for the entries */
+    atomic_flag items_lock;     /**< Held while items grows, as workers on chunks of the listing also add to it */
+    char name[];                /**< Entry name, or the root path as given */
+} dir_handle_t;
+
+/**
+ * @struct scan_item
+ * @brief One directory entry waiting to be examined, or a chunk of a directory's listing.
+ * A chunk holds the raw getdents64 records of part of a large directory,
+ * so that its entries can be examined by another worker than the lister.
+ */
+typedef struct scan_item {
+    dir_handle_t *parent; /**< Directory containing the entry, NULL for a root */
+    int stat_done;        /**< Directory already stat'ed by its lister */
+    size_t blocks;        /**< Blocks of the directory itself, if stat_done */
+    unsigned int root;    /**< Index of the scanned path the entry is under */
+    uint64_t dev;         /**< Device of the entry if stat_done, otherwise of its parent, 0 for a root */
+    uint64_t index;       /**< Position of the entry in its parent's listing, or of a chunk's first record */
+    size_t chunk_size;    /**< Bytes of getdents64 records in name for a chunk, 0 for an entry */
+    char name[];          /**< Entry name, the root path as given, or a chunk's records */
+} scan_item_t;
+
+scan_item_t *item_create(dir_handle_t *parent, const char *name);
+scan_item_t *item_create_chunk(dir_handle_t *parent, const void *records, size_t size);
+int item_dirfd(const scan_item_t *item);
+char *item_path(const scan_item_t *item);
+char *entry_path(const dir_handle_t *parent, const char *name);
+int item_free(scan_item_t *item, void *worker);
+
+dir_handle_t *dir_handle_create(dir_handle_t *parent, const char *name, DIR *dir, const dir_rollup_t *rollup);
+void dir_handle_add_blocks(dir_handle_t *handle, size_t blocks);
+void dir_handle_ref(dir_handle_t *handle);
+void dir_handle_unref(dir_handle_t *handle, void *worker);
+int dir_handle_compare(const dir_handle_t *a, uint64_t index_a, const dir_handle_t *b, uint64_t index_b);
+int dir_handle_release(dir_handle_t *handle, void *worker);
+
+#endif // DIR_HANDLE_H
@@ -3,267 +3,2646 @@
  * @brief Directory size calculation with optional parallel traversal.
  * @date 2025-11-19
  * @author Bran Mjöberg Quanne
+ *
+ * Entries are examined relative to their parent directory's fd
+ * (fstatat/openat/fdopendir), so the cost per entry does not grow with the
+ * depth of the tree and no path is ever limited to PATH_MAX.
  */
 
 #include "dirsize.h"
+#include "cpu_affinity.h"
+#include "device_budget.h"
+#include "dir_handle.h"
+#include "inode_set.h"
+#include "link_owners.h"
+#include "name_filter.h"
+#include "safe_lock.h"
+#include "scan_cache.h"
+#include "top_n.h"
+#include "uring_stat.h"
 #include "work_queue.h"
+#include "ws_deque.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 /* --- INTERNAL --- */
 
+/** Number of directory entries stat'ed per io_uring batch, also the ring size. */
+#define STAT_BATCH 256
+
+/** Most hard-linked inodes remembered per scan, about 270 MB at worst. */
+#define LINK_SET_MAX_ENTRIES (1u << 22)
+
+/** Number of independently locked shards in the hard-link set. */
+#define LINK_SET_SHARDS 256
+
+/** Items a worker collects before publishing them to the shared queue in one batch. */
+#define PUSH_BATCH 64
+
+/** Most items a worker takes from the shared queue at once. */
+#define POP_BATCH 16
+
+/** Estimated bytes a queued item takes: the item, its name, its queue slot and allocator slack. */
+#define QUEUED_ITEM_BYTES 128
+
+/** Size of the buffers directory listings are read into with getdents64, and of a chunk of a split listing. */
+#define DENTS_BUFFER_BYTES (32 * 1024)
+
+/** Items a worker processes between checks of the shared queue's size under a memory limit. */
+#define CAP_CHECK_INTERVAL 64
+
+/** Workers a -j auto scan starts with, and the fewest it shrinks to. */
+#define AUTO_MIN_THREADS 2
+
+/** Workers created for a -j auto scan, the most it grows to. */
+#define AUTO_MAX_THREADS 64
+
+/** Length of one measuring window of the -j auto tuner, in milliseconds. */
+#define AUTO_WINDOW_MS 50
+
+/** Factor by which throughput must rise for more workers to be kept. */
+#define AUTO_GAIN 1.10
+
+/** Share of time the active workers may wait for work and still get company. */
+#define AUTO_IDLE_GROW 0.25
+
+/** Share of time spent waiting for work above which workers are parked. */
+#define AUTO_IDLE_SHRINK 0.50
+
+/** Windows the tuner holds a worker count before probing a larger one. */
+#define AUTO_PROBE_WINDOWS 10
+
+/**
+ * @struct worker_pool_t
+ * @brief Shared state of a -j auto pool.
+ * Workers with an id at or above limit park until the tuner raises it.
+ */
+typedef struct {
+    atomic_int limit;      /**< Number of workers allowed to take work */
+    atomic_int done;       /**< Set once the traversal is complete */
+    pthread_mutex_t mutex; /**< Guards parking and the tuner's sleep */
+    pthread_cond_t cond;   /**< Signals a new limit or completion */
+} worker_pool_t;
+
+/**
+ * @struct kernel_dirent64_t
+ * @brief Layout of the records getdents64 returns, for the offsets of their fields.
+ */
+typedef struct {
+    uint64_t d_ino;          /**< Inode number */
+    int64_t d_off;           /**< Position of the next record */
+    unsigned short d_reclen; /**< Length of this record */
+    unsigned char d_type;    /**< File type, or DT_UNKNOWN */
+    char d_name[];           /**< NUL-terminated entry name */
+} kernel_dirent64_t;
+
+/**
+ * @struct stat_batch_t
+ * @brief Per-thread io_uring ring and buffers for stat'ing a listing in batches.
+ */
+typedef struct {
+    uring_stat_t *ring;                      /**< This thread's ring */
+    size_t count;                            /**< Names collected so far */
+    char *names[STAT_BATCH];                 /**< Pointers into storage */
+    uint64_t positions[STAT_BATCH];          /**< Position of each name in the listing */
+    char storage[STAT_BATCH][NAME_MAX + 1];  /**< Copies of the collected names */
+    uring_stat_result_t results[STAT_BATCH]; /**< One result per name */
+} stat_batch_t;
+
+/**
+ * @struct dir_record_t
+ * @brief What a lister collects about one directory for the scan cache.
+ * Reused by a thread for every directory it lists.
+ */
+typedef struct {
+    uint64_t own_blocks;     /**< Blocks of files with a single link */
+    cache_link_t *links;     /**< Hard-linked files */
+    size_t num_links;        /**< Number of hard-linked files */
+    size_t links_capacity;   /**< Allocated links */
+    char *subdirs;           /**< NUL-terminated subdirectory names */
+    size_t subdirs_size;     /**< Bytes used in subdirs */
+    size_t subdirs_capacity; /**< Bytes allocated for subdirs */
+    uint32_t num_subdirs;    /**< Number of subdirectories */
+    int complete;            /**< Cleared if any entry could not be examined */
+} dir_record_t;
+
+/**
+ * @struct root_id_t
+ * @brief Identity of one scanned path, for finding it again below another.
+ */
+typedef struct {
+    uint64_t dev;       /**< Device of the path */
+    uint64_t ino;       /**< Inode of the path */
+    unsigned int index; /**< Index of the path in the scan */
+} root_id_t;
+
+/**
+ * @struct item_stack_t
+ * @brief Growable LIFO stack of work items used by the single-threaded traversal.
+ */
+typedef struct {
+    scan_item_t **items; /**< Stack storage */
+    size_t size;         /**< Number of items on the stack */
+    size_t capacity;     /**< Allocated slots */
+} item_stack_t;
+
+/**
+ * @struct thread_args_t
+ * @brief Arguments passed to worker threads for parallel traversal.
+ */
+typedef struct {
+    struct scan_ctx *ctx;          /**< Context this worker belongs to */
+    struct scan *scan;             /**< Scan being worked on */
+    const scan_options_t *options; /**< Options of that scan */
+    atomic_int *cancelled;         /**< Set once that scan is cancelled */
+    scan_engine_t engine;          /**< Scheduling engine in use */
+    item_stack_t *stack;           /**< Stack of a context's only worker, NULL with several workers */
+    stat_batch_t *batch;           /**< This scan's io_uring batch, NULL to use fstatat */
+    stat_batch_t *uring_batch;     /**< This thread's io_uring batch once set up, kept across scans */
+    int uring_tried;               /**< Whether setting up uring_batch was tried */
+    inode_set_t *links;            /**< Hard-linked inodes seen so far, NULL to count every link */
+    link_owners_t *owners;         /**< Directories hard-linked files are credited to, or NULL */
+    size_t deferred;               /**< Blocks the item being processed counted but left to the owners of their links */
+    scan_cache_t *cache;           /**< Per-directory cache, NULL to always list directories */
+    int verify_cache;              /**< List every directory and report stale cache entries */
+    const name_filter_t *exclude;  /**< Names of entries to skip, or NULL */
+    int one_file_system;           /**< Skip directories on other devices than their scanned path */
+    device_budget_t *devices;      /**< Limits on the workers busy per device, or NULL for none */
+    dir_record_t record;           /**< This thread's record of the directory being listed */
+    char *dents;                   /**< Two getdents64 buffers of DENTS_BUFFER_BYTES, allocated on first use */
+    dir_visit_fn visit;            /**< Called for every directory listed, or NULL */
+    void *visit_context;           /**< Passed to visit */
+    const dir_rollup_t *rollup;    /**< Summing of directory totals, NULL if not requested */
+    work_queue_t *queue;           /**< Pointer to the shared work queue (ENGINE_QUEUE) */
+    void *pending[PUSH_BATCH];     /**< Items discovered but not yet pushed to the queue */
+    size_t num_pending;            /**< Entries in pending */
+    void *popped[POP_BATCH];       /**< Items taken from the queue but not yet processed */
+    size_t num_popped;             /**< Entries in popped */
+    size_t next_popped;            /**< Index of the next entry of popped to process */
+    ws_deque_t **deques;           /**< Per-worker deques, indexed by id (ENGINE_STEAL) */
+    int id;                        /**< Index of this worker */
+    int num_threads;               /**< Total number of workers */
+    int node;                      /**< NUMA node of this worker, whose sub-queue it uses first */
+    const cpu_place_t *places;     /**< Placement of every worker, NULL if all are on one node */
+    atomic_int *active;            /**< Number of workers not searching for work (ENGINE_STEAL) */
+    unsigned int seed;             /**< Per-worker seed for picking steal victims */
+    int num_roots;                 /**< Number of paths scanned at once */
+    const root_id_t *root_ids;     /**< Paths to look for below other paths, sorted, or NULL */
+    int num_root_ids;              /**< Entries in root_ids */
+    int root_files;                /**< Whether root_ids holds files, so files must be looked up too */
+    atomic_int *covered;           /**< Per path, set once it is found below or equal to an earlier one */
+    atomic_ullong *root_blocks;    /**< This worker's blocks per path, its row of the scan's worker_blocks */
+    atomic_ullong *root_published; /**< This worker's items published per path, its row of worker_published */
+    atomic_ullong *root_finished;  /**< This worker's items finished per path, its row of worker_finished */
+    pthread_mutex_t *size_mutex;   /**< Mutex for merging the largest entries into the scan's */
+    int *had_access_error;         /**< Pointer to error flag */
+    pthread_mutex_t *error_mutex;  /**< Mutex for updating error flag */
+    scan_thread_stats_t *stats;    /**< This worker's counters, NULL when not measuring */
+    queue_stats_t queue_stats;     /**< This worker's waits for work and on the shared queue */
+    size_t queue_cap;              /**< Queued items above which work is kept local, 0 for no cap */
+    int capped;                    /**< Set while the worker keeps new work local to bound memory */
+    unsigned int since_check;      /**< Items processed since the queue size was last checked */
+    item_stack_t local;            /**< Directories kept from the shared queue while capped (ENGINE_QUEUE) */
+    int holding;                   /**< Whether a task is registered for the items on local */
+    int item_local;                /**< Whether the item being processed came from local */
+    top_n_t *top_files;            /**< This worker's largest files, or NULL if not requested */
+    top_n_t *top_dirs;             /**< This worker's largest directories, or NULL if not requested */
+    worker_pool_t *pool;           /**< Pool tuned by -j auto, NULL for a fixed number of workers */
+    queue_stats_t stats_base;      /**< queue_stats when the scan started */
+    atomic_ullong progress;        /**< Entries stat'ed so far over all scans, read by the tuner and for progress */
+    atomic_ullong published;       /**< Items published so far over all scans, read for progress */
+    atomic_ullong finished;        /**< Items finished so far over all scans, read for progress */
+    atomic_ullong idle_ns;         /**< Time spent waiting for work so far, read by the tuner */
+} thread_args_t;
+
+/**
+ * @struct scan
+ * @brief A submitted scan of one or more paths.
+ */
+struct scan {
+    struct scan_ctx *ctx;            /**< Context the scan was submitted to */
+    char **paths;                    /**< Copies of the scanned paths */
+    int num_paths;                   /**< Number of paths */
+    scan_options_t options;          /**< Copy of the options */
+    scan_done_fn done;               /**< Called once the scan completes, or NULL */
+    void *done_context;              /**< Passed to done */
+    size_t *totals;                  /**< Total of each path, summed up once finished */
+    atomic_ullong *worker_blocks;    /**< Blocks counted per worker and path, one row of num_paths per worker */
+    atomic_ullong *worker_published; /**< Items published per worker and path, laid out like worker_blocks */
+    atomic_ullong *worker_finished;  /**< Items finished per worker and path, laid out like worker_blocks */
+    int had_access_error;            /**< Set if some entry could not be examined */
+    atomic_int cancelled;            /**< Set by scan_cancel() */
+    scan_state_t state;              /**< Where the scan stands, guarded by the context's mutex */
+    int released;                    /**< Set once the caller gave up its handle, guarded likewise */
+    inode_set_t *links;              /**< Hard-linked inodes seen so far, NULL to count every link */
+    link_owners_t *owners;           /**< Directories hard-linked files are credited to, see count_file() */
+    root_id_t *root_ids;             /**< Paths to look for below other paths, see identify_roots() */
+    int num_root_ids;                /**< Entries in root_ids */
+    int root_files;                  /**< Whether root_ids holds files */
+    int identifying;                 /**< Set once a worker identifies the paths, guarded by the context's mutex */
+    int identified;                  /**< Set once root_ids is complete, guarded likewise */
+    atomic_int *covered;             /**< Per path, set once it is found below or equal to an earlier one */
+    dir_rollup_t rollup;             /**< Rollup shared by the scan's directory handles */
+    device_budget_t *devices;        /**< Limits on the workers busy per device, or NULL for none */
+    uint64_t base_entries;           /**< Sum of the workers' progress when the scan started */
+    uint64_t base_published;         /**< Sum of the workers' published when the scan started */
+    uint64_t base_finished;          /**< Sum of the workers' finished when the scan started */
+    uint64_t entries;                /**< Entries stat'ed, once finished */
+    uint64_t blocks;                 /**< Blocks counted, once finished */
+    struct scan *next;               /**< Next queued scan */
+};
+
+/**
+ * @struct scan_ctx
+ * @brief A pool of workers and the scans submitted to it.
+ *
+ * Scans run one at a time, in the order they were submitted. The workers
+ * wait on cond for the next scan between scans; the last worker to finish
+ * a scan completes it and starts the next one.
+ */
+struct scan_ctx {
+    int num_threads;             /**< Number of workers */
+    scan_engine_t engine;        /**< Scheduling engine, unused with a single worker */
+    pthread_t *threads;          /**< Worker threads */
+    thread_args_t *args;         /**< Per-worker state, indexed by id */
+    work_queue_t *queue;         /**< Shared work queue (ENGINE_QUEUE), or NULL */
+    ws_deque_t **deques;         /**< Per-worker deques (ENGINE_STEAL), or NULL */
+    cpu_place_t *places;         /**< CPU and NUMA node of every worker */
+    int num_nodes;               /**< Number of NUMA nodes the workers are on */
+    item_stack_t stack;          /**< Stack of a single worker */
+    atomic_int active;           /**< Number of workers not searching for work (ENGINE_STEAL) */
+    worker_pool_t pool;          /**< Shared state of a -j auto pool */
+    int tuned;                   /**< Whether the pool is tuned by -j auto */
+    pthread_t tuner;             /**< Thread running tune_pool() for each scan, if tuned */
+    pthread_mutex_t mutex;       /**< Guards the fields below and the state of scans */
+    pthread_cond_t cond;         /**< Signals a started or finished scan, or shutdown */
+    scan_t *current;             /**< Scan being worked on, or NULL */
+    scan_t *first_queued;        /**< Next scan to start, or NULL */
+    scan_t *last_queued;         /**< Last scan submitted, if any are queued */
+    unsigned long generation;    /**< Incremented whenever a scan starts */
+    int arrived;                 /**< Workers, and the tuner, done with the current scan */
+    int shutdown;                /**< Set to make the workers exit */
+    pthread_mutex_t size_mutex;  /**< Guards the largest entries of the current scan */
+    pthread_mutex_t error_mutex; /**< Guards the error flag of the current scan */
+};
+
+/**
+ * @brief Destroys the per-worker deques and any items left in them.
+ */
+static void destroy_deques(ws_deque_t **deques, int num_threads) {
+    if (!deques) {
+        return;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (!deques[i]) {
+            continue;
+        }
+        scan_item_t *item;
+        while ((item = deque_steal(deques[i])) != NULL) {
+            item_free(item, NULL);
+        }
+        deque_destroy(deques[i]);
+    }
+    free(deques);
+}
+
+/**
+ * @brief Flags an access error in a thread-safe way.
+ */
+static void flag_access_error(int *had_error, pthread_mutex_t *error_mutex) {
+    if (error_mutex) {
+        safe_lock(error_mutex);
+        *had_error = 1;
+        safe_unlock(error_mutex);
+    } else {
+        *had_error = 1;
+    }
+}
+
+/**
+ * @brief Reports a problem found while scanning to the scan's error callback, or to stderr without one.
+ * errnum is the errno value of a failed call, or 0 for a problem described by message.
+ */
+static void report_problem(const scan_options_t *options, const char *path, int errnum, const char *message) {
+    if (options->error) {
+        options->error(path, errnum, message, options->error_context);
+    } else {
+        fprintf(stderr, "%s: %s\n", path, message ? message : strerror(errnum));
+    }
+}
+
+/**
+ * @brief Reports a file/directory access error for an entry in a thread-safe way.
+ * The full path is only assembled here, on the error path.
+ */
+static void report_access_error(thread_args_t *args, const dir_handle_t *parent, const char *name) {
+    int errnum = errno;
+    char *path = entry_path(parent, name);
+    report_problem(args->options, path ? path : name, errnum, NULL);
+    free(path);
+    flag_access_error(args->had_access_error, args->error_mutex);
+}
+
+/**
+ * @brief Returns the time to measure a step from, or 0 when not measuring.
+ * Without stats no clock is read at all.
+ */
+static uint64_t stats_start(const thread_args_t *args) {
+    return args->stats ? monotonic_ns() : 0;
+}
+
+/**
+ * @brief Returns the queue counters to pass to the shared queue, or NULL when not measuring.
+ * The -j auto tuner needs the time spent waiting for work, so a tuned pool always measures it.
+ */
+static queue_stats_t *queue_stats(thread_args_t *args) {
+    return args->stats || args->pool ? &args->queue_stats : NULL;
+}
+
+/**
+ * @brief Counts entries stat'ed in the worker's stats and its progress.
+ * Only the worker writes its progress, so a relaxed load and store suffice.
+ */
+static void note_entries(thread_args_t *args, uint64_t count) {
+    if (args->stats) {
+        args->stats->entries += count;
+    }
+    uint64_t progress = atomic_load_explicit(&args->progress, memory_order_relaxed);
+    atomic_store_explicit(&args->progress, progress + count, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds to one of the worker's own counters, which other threads only read.
+ */
+static void counter_add(atomic_ullong *counter, uint64_t amount) {
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + amount, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds one to one of the worker's own item counters per path, see scan_path_done().
+ * The release store lets a reader that sees the new value also see
+ * everything the worker did before, the items it published included.
+ */
+static void counter_increment(atomic_ullong *counter) {
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + 1, memory_order_release);
+}
+
+/**
+ * @brief Notes the depth of the queue or stack the worker just pushed to.
+ */
+static void stats_note_depth(thread_args_t *args, size_t depth) {
+    if (args->stats && depth > args->stats->peak_queue) {
+        args->stats->peak_queue = depth;
+    }
+}
+
+/**
+ * @brief Stats an entry without following symlinks, counting it in the worker's stats.
+ */
+static int timed_fstatat(thread_args_t *args, int dirfd, const char *name, struct stat *file_stat) {
+    uint64_t start = stats_start(args);
+    int ret = fstatat(dirfd, name, file_stat, AT_SYMLINK_NOFOLLOW);
+    if (args->stats) {
+        args->stats->stat_ns += monotonic_ns() - start;
+    }
+    note_entries(args, 1);
+    return ret;
+}
+
+/**
+ * @brief Reads the next getdents64 records of a directory, counting the time in the worker's stats.
+ * Fills at most DENTS_BUFFER_BYTES of buffer. Returns the bytes read, 0 at
+ * the end of the directory, or -1 on error.
+ */
+static ssize_t timed_getdents(thread_args_t *args, int fd, char *buffer) {
+    uint64_t start = stats_start(args);
+    ssize_t size = syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER_BYTES);
+    if (args->stats) {
+        args->stats->readdir_ns += monotonic_ns() - start;
+    }
+    return size;
+}
+
+/**
+ * @brief Offers an entry to one of the worker's top-N collections.
+ * The full path is only built for an entry that can get in. If it cannot
+ * be built, the entry is left out and the error is reported.
+ */
+static void note_top(thread_args_t *args, top_n_t *top, const dir_handle_t *parent, const char *name,
+                     uint64_t blocks) {
+    if (!top || blocks == 0 || !top_n_accepts(top, blocks)) {
+        return;
+    }
+    char *path = entry_path(parent, name);
+    if (!path) {
+        report_problem(args->options, name, ENOMEM, NULL);
+        flag_access_error(args->had_access_error, args->error_mutex);
+        return;
+    }
+    top_n_add(top, blocks, path);
+}
+
+/**
+ * @brief Returns non-zero if an entry is excluded by name, before anything else is done with it.
+ */
+static int is_excluded(const thread_args_t *args, const char *name) {
+    return args->exclude && name_filter_match(args->exclude, name);
+}
+
+/**
+ * @brief Returns non-zero if a directory on dev is on another file system than its scanned path.
+ */
+static int is_other_device(const thread_args_t *args, const dir_handle_t *parent, uint64_t dev) {
+    return args->one_file_system && parent && dev != parent->root_dev;
+}
+
+/**
+ * @brief Returns the blocks a file found under path root adds to the total.
+ * A file with more than one link counts for the first path, in the order
+ * the paths were given, that any of its links is found under, and only
+ * once there, whatever order the workers find the links in. If a link
+ * was counted for a later path before, the blocks are taken off that
+ * path's total and counted here instead.
+ */
+static size_t count_blocks(thread_args_t *args, unsigned int root, unsigned long nlink, uint64_t dev, uint64_t ino,
+                           size_t blocks) {
+    if (!args->links || nlink <= 1) {
+        return blocks;
+    }
+    unsigned int previous;
+    if (inode_set_claim(args->links, dev, ino, root, &previous) != 0) {
+        return blocks;
+    }
+    if (previous <= root) {
+        return 0;
+    }
+    counter_add(&args->root_blocks[previous], -(uint64_t)blocks);
+    return blocks;
+}
+
+/**
+ * @brief Gives up a place handed out by the link owners.
+ */
+static void release_link(thread_args_t *args, link_place_t *place) {
+    free(place->name);
+    if (place->dir) {
+        dir_handle_unref(place->dir, args);
+    }
+}
+
+/**
+ * @brief Credits a file to the directory owning it and gives up the place.
+ * The file's blocks are added to the directory's total, and the file is
+ * offered to the largest files under the name it has there.
+ */
+static void credit_link(thread_args_t *args, link_place_t *place) {
+    dir_handle_add_blocks(place->dir, place->blocks);
+    note_top(args, args->top_files, place->dir, place->name, place->blocks);
+    release_link(args, place);
+}
+
+/**
+ * @brief Counts a file found as name at position index in parent, under path root.
+ *
+ * Returns the blocks it adds to its path's total, see count_blocks().
+ * They are also credited to parent by the caller, and the file is offered
+ * to the largest files here. A file with more than one link is counted
+ * for its path by the first worker to find one, which would credit it to
+ * whichever directory that worker was in. With link owners, it is instead
+ * credited to the link du would count, the first in the order the paths
+ * were given and their directories are listed, whatever order the workers
+ * find the links in: its blocks go to args->deferred for the caller to
+ * leave out of parent, and once the owner is known, see
+ * link_owners_offer(), they are credited there. Links of files the owners
+ * cannot track are credited where they are found.
+ */
+static size_t count_file(thread_args_t *args, dir_handle_t *parent, uint64_t index, const char *name,
+                         unsigned int root, unsigned long nlink, uint64_t dev, uint64_t ino, size_t blocks) {
+    size_t counted = count_blocks(args, root, nlink, dev, ino, blocks);
+    if (args->owners && nlink > 1) {
+        link_place_t place = {.dir = parent, .index = index, .root = root, .blocks = blocks, .name = NULL};
+        link_place_t dropped;
+        link_place_t owner;
+        int result = link_owners_offer(args->owners, dev, ino, nlink, &place, name, &dropped, &owner);
+        if (result != -1) {
+            args->deferred += counted;
+            if (result & LINK_DROPPED) {
+                release_link(args, &dropped);
+            }
+            if (result & LINK_OWNED) {
+                credit_link(args, &owner);
+            }
+            return counted;
+        }
+    }
+    note_top(args, args->top_files, parent, name, counted);
+    return counted;
+}
+
+/**
+ * @brief Applies du's rule for an entry found under path root that is also a scanned path.
+ * An entry that is an earlier path is skipped with everything below it,
+ * as it counts for that path. A later path found here is covered: it
+ * counts here, and the later path's own total is dropped. Only directories
+ * are looked up unless some path is a file. Returns non-zero if the entry
+ * is to be skipped.
+ */
+static int is_earlier_root(thread_args_t *args, unsigned int root, int is_dir, uint64_t dev, uint64_t ino) {
+    if (args->num_root_ids == 0 || (!is_dir && !args->root_files)) {
+        return 0;
+    }
+    int low = 0;
+    int high = args->num_root_ids;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        const root_id_t *id = &args->root_ids[middle];
+        if (id->ino < ino || (id->ino == ino && id->dev < dev)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (int i = low; i < args->num_root_ids && args->root_ids[i].ino == ino && args->root_ids[i].dev == dev; i++) {
+        unsigned int index = args->root_ids[i].index;
+        if (index < root) {
+            return 1;
+        }
+        if (index > root) {
+            atomic_store_explicit(&args->covered[index], 1, memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Warns if the hard-link set ran out of room during a scan.
+ * Not an access error: the total is still printed, only possibly too large.
+ */
+static void warn_if_saturated(const scan_options_t *options, const char *path, inode_set_t *links) {
+    if (links && inode_set_saturated(links)) {
+        report_problem(options, path, 0, "too many hard-linked files to track, some were counted more than once");
+    }
+}
+
+/**
+ * @brief Clears a record before a directory is listed.
+ */
+static void record_reset(dir_record_t *record) {
+    record->own_blocks = 0;
+    record->num_links = 0;
+    record->subdirs_size = 0;
+    record->num_subdirs = 0;
+    record->complete = 1;
+}
+
+/**
+ * @brief Returns the blocks of all files in a record, hard-linked ones included.
+ */
+static uint64_t record_file_blocks(const dir_record_t *record) {
+    uint64_t blocks = record->own_blocks;
+    for (size_t i = 0; i < record->num_links; i++) {
+        blocks += record->links[i].blocks;
+    }
+    return blocks;
+}
+
+/**
+ * @brief Adds a hard-linked file to a record.
+ */
+static void record_add_link(dir_record_t *record, uint64_t dev, uint64_t ino, uint64_t blocks) {
+    if (record->num_links == record->links_capacity) {
+        size_t new_capacity = record->links_capacity ? record->links_capacity * 2 : 64;
+        cache_link_t *links = realloc(record->links, new_capacity * sizeof(cache_link_t));
+        if (!links) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        record->links = links;
+        record->links_capacity = new_capacity;
+    }
+    record->links[record->num_links++] = (cache_link_t){.dev = dev, .ino = ino, .blocks = blocks};
+}
+
+/**
+ * @brief Adds a subdirectory name to a record.
+ */
+static void record_add_subdir(dir_record_t *record, const char *name) {
+    size_t length = strlen(name) + 1;
+    if (record->subdirs_size + length > record->subdirs_capacity) {
+        size_t new_capacity = record->subdirs_capacity ? record->subdirs_capacity * 2 : 4096;
+        while (new_capacity < record->subdirs_size + length) {
+            new_capacity *= 2;
+        }
+        char *subdirs = realloc(record->subdirs, new_capacity);
+        if (!subdirs) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        record->subdirs = subdirs;
+        record->subdirs_capacity = new_capacity;
+    }
+    memcpy(record->subdirs + record->subdirs_size, name, length);
+    record->subdirs_size += length;
+    record->num_subdirs++;
+}
+
+/**
+ * @brief Sets up an io_uring batch for the calling thread.
+ * Returns NULL if io_uring was not requested or is unavailable, in which
+ * case entries are published one by one and stat'ed with fstatat.
+ */
+static stat_batch_t *stat_batch_create(int use_uring) {
+    if (!use_uring) {
+        return NULL;
+    }
+
+    uring_stat_t *ring = uring_stat_create(STAT_BATCH);
+    if (!ring) {
+        return NULL;
+    }
+
+    stat_batch_t *batch = malloc(sizeof(stat_batch_t));
+    if (!batch) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    batch->ring = ring;
+    batch->count = 0;
+    for (int i = 0; i < STAT_BATCH; i++) {
+        batch->names[i] = batch->storage[i];
+    }
+    return batch;
+}
+
+/**
+ * @brief Destroys a batch created by stat_batch_create().
+ */
+static void stat_batch_destroy(stat_batch_t *batch) {
+    if (batch) {
+        uring_stat_destroy(batch->ring);
+        free(batch);
+    }
+}
+
+/**
+ * @brief Pushes an item onto a local stack, growing it when full.
+ */
+static void stack_push(item_stack_t *stack, scan_item_t *item) {
+    if (stack->size == stack->capacity) {
+        size_t new_capacity = stack->capacity ? stack->capacity * 2 : 1024;
+        scan_item_t **new_items = realloc(stack->items, new_capacity * sizeof(scan_item_t *));
+        if (!new_items) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        stack->items = new_items;
+        stack->capacity = new_capacity;
+    }
+    stack->items[stack->size++] = item;
+}
+
+/**
+ * @brief Backs off while a work-stealing worker waits for work to appear.
+ * Yields for the first rounds, then sleeps briefly so idle workers do not
+ * compete with busy ones for the CPU.
+ */
+static void idle_backoff(int round) {
+    if (round < 64) {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 50000};
+    nanosleep(&pause, NULL);
+}
+
+/**
+ * @brief Parks a worker of a -j auto pool while its id is at or above the tuner's limit.
+ * Only called by a worker that holds no items, so a parked worker never
+ * hides work from the others. Returns 0 if the traversal completed while
+ * the worker was parked.
+ */
+static int pool_wait_if_parked(thread_args_t *args) {
+    worker_pool_t *pool = args->pool;
+    if (!pool || args->id < atomic_load(&pool->limit)) {
+        return 1;
+    }
+
+    safe_lock(&pool->mutex);
+    while (args->id >= atomic_load(&pool->limit) && !atomic_load(&pool->done)) {
+        int errnum = pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    int done = atomic_load(&pool->done);
+    safe_unlock(&pool->mutex);
+    return !done;
+}
+
+/**
+ * @brief Tells the tuner and the parked workers of a -j auto pool that the traversal is complete.
+ */
+static void pool_finish(worker_pool_t *pool) {
+    if (!pool || atomic_load(&pool->done)) {
+        return;
+    }
+    safe_lock(&pool->mutex);
+    atomic_store(&pool->done, 1);
+    int errnum = pthread_cond_broadcast(&pool->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    safe_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Tries to steal one item from the other workers' deques.
+ * Victims are visited starting at a random worker so that thieves spread
+ * out. When the workers are placed on several NUMA nodes, the victims on
+ * the thief's own node are tried first, and the others only if all of
+ * those are empty.
+ */
+static scan_item_t *steal_from_others(thread_args_t *args) {
+    int start = rand_r(&args->seed) % args->num_threads;
+    for (int remote = 0; remote < (args->places ? 2 : 1); remote++) {
+        for (int i = 0; i < args->num_threads; i++) {
+            int victim = (start + i) % args->num_threads;
+            if (victim == args->id || (args->places && (args->places[victim].node != args->node) != remote)) {
+                continue;
+            }
+            scan_item_t *item = deque_steal(args->deques[victim]);
+            if (item) {
+                return item;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns non-zero if any worker's deque appears to hold items.
+ */
+static int any_work_visible(thread_args_t *args) {
+    for (int i = 0; i < args->num_threads; i++) {
+        if (deque_size(args->deques[i]) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Fetches the next item for a work-stealing worker.
+ *
+ * The worker first pops from its own deque (LIFO), then steals (FIFO) from
+ * the others. If both fail it leaves the active set and spins until either
+ * work becomes visible again or no worker is active. A worker only goes
+ * inactive with an empty deque, and only active workers push, so once the
+ * active count reaches zero every deque is empty and the traversal is done.
+ * A parked worker of a -j auto pool also counts as inactive; it parks
+ * only once its own deque is empty.
+ */
+static scan_item_t *steal_next_item(thread_args_t *args) {
+    scan_item_t *item = deque_pop(args->deques[args->id]);
+    if (!item && args->pool && args->id >= atomic_load(&args->pool->limit)) {
+        atomic_fetch_sub(args->active, 1);
+        if (!pool_wait_if_parked(args)) {
+            return NULL;
+        }
+        atomic_fetch_add(args->active, 1);
+    }
+    if (!item) {
+        item = steal_from_others(args);
+    }
+    if (item) {
+        return item;
+    }
+
+    uint64_t start = queue_stats(args) ? monotonic_ns() : 0;
+    atomic_fetch_sub(args->active, 1);
+    for (int round = 0;; round++) {
+        if (atomic_load(args->active) == 0) {
+            break;
+        }
+        if (any_work_visible(args)) {
+            atomic_fetch_add(args->active, 1);
+            item = steal_from_others(args);
+            if (item) {
+                break;
+            }
+            atomic_fetch_sub(args->active, 1);
+        }
+        idle_backoff(round);
+    }
+    if (start) {
+        args->queue_stats.wait_ns += monotonic_ns() - start;
+    }
+    return item;
+}
+
+/**
+ * @brief Takes the next item from the shared queue.
+ * Items are taken in batches and handed out from the worker's local
+ * buffer. A worker of a -j auto pool may park once its buffer is empty.
+ */
+static scan_item_t *queue_next_item(thread_args_t *args) {
+    if (args->next_popped == args->num_popped) {
+        if (!pool_wait_if_parked(args)) {
+            return NULL;
+        }
+        args->num_popped = queue_pop_batch(args->queue, args->node, args->popped, POP_BATCH, queue_stats(args));
+        args->next_popped = 0;
+        if (args->num_popped == 0) {
+            return NULL;
+        }
+    }
+    return args->popped[args->next_popped++];
+}
+
+/**
+ * @brief Moves the oldest half of a capped worker's local directories to the shared queue.
+ * The oldest are the shallowest, so they likely lead to the most work for
+ * the other workers.
+ */
+static void offload_local(thread_args_t *args) {
+    item_stack_t *local = &args->local;
+    size_t count = (local->size + 1) / 2;
+    queue_push_batch(args->queue, args->node, (void *const *)local->items, count, queue_stats(args));
+    memmove(local->items, local->items + count, (local->size - count) * sizeof(scan_item_t *));
+    local->size -= count;
+}
+
+/**
+ * @brief Decides whether a worker of the shared queue keeps new work local to bound memory.
+ *
+ * Only directories are published, so the queue grows with the number of
+ * directories found but not yet listed, which a wide tree can make large
+ * when they are taken breadth first. Under a memory limit, a worker is
+ * capped once the queue reaches queue_cap items, and then pushes the
+ * subdirectories it finds onto its local stack, to be processed depth
+ * first. The queue's size is only checked every CAP_CHECK_INTERVAL items;
+ * once it has drained below half the cap, the worker hands half of its
+ * local stack back to the queue and publishes there again. The stack of
+ * the single-threaded traversal and the deques of the work-stealing
+ * engine are worked on depth first already.
+ */
+static void update_capped(thread_args_t *args) {
+    if (!args->queue_cap || args->stack || args->engine != ENGINE_QUEUE) {
+        return;
+    }
+    if (++args->since_check >= CAP_CHECK_INTERVAL) {
+        args->since_check = 0;
+        size_t size = queue_size(args->queue);
+        if (!args->capped) {
+            args->capped = size >= args->queue_cap;
+        } else if (size < args->queue_cap / 2) {
+            args->capped = 0;
+            if (args->local.size > 0) {
+                offload_local(args);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fetches the next item to process from the configured engine.
+ * A capped worker of the shared queue first works through its local
+ * stack, and releases the task that kept the others waiting once it is
+ * empty. In a -j auto pool, the worker's time spent waiting for work is
+ * published for the tuner, and the tuner and parked workers are told
+ * once the traversal is complete. Returns NULL at that point.
+ */
+static scan_item_t *next_item(thread_args_t *args) {
+    update_capped(args);
+    if (args->stack) {
+        return args->stack->size ? args->stack->items[--args->stack->size] : NULL;
+    }
+    if (args->local.size > 0) {
+        args->item_local = 1;
+        return args->local.items[--args->local.size];
+    }
+    args->item_local = 0;
+    if (args->holding) {
+        args->holding = 0;
+        queue_task_done(args->queue, queue_stats(args));
+    }
+    scan_item_t *item = args->engine == ENGINE_STEAL ? steal_next_item(args) : queue_next_item(args);
+    if (args->pool) {
+        atomic_store_explicit(&args->idle_ns, args->queue_stats.wait_ns, memory_order_relaxed);
+        if (!item) {
+            pool_finish(args->pool);
+        }
+    }
+    return item;
+}
+
+/**
+ * @brief Pushes the items collected for the shared queue in one batch.
+ */
+static void flush_pending(thread_args_t *args) {
+    if (args->num_pending > 0) {
+        queue_push_batch(args->queue, args->node, args->pending, args->num_pending, queue_stats(args));
+        args->num_pending = 0;
+    }
+}
+
+/**
+ * @brief Publishes a discovered item to the configured engine.
+ * The work-stealing engine pushes onto the worker's own deque. For the
+ * shared queue, items are collected and pushed PUSH_BATCH at a time; the
+ * rest are pushed by flush_pending() once the current item is processed.
+ * A capped worker keeps them on its local stack instead, registering one
+ * task with the queue for as long as the stack holds any, so that the
+ * other workers do not finish while it still has work they could get.
+ */
+static void publish_item(thread_args_t *args, scan_item_t *item) {
+    counter_add(&args->published, 1);
+    counter_increment(&args->root_published[item->root]);
+    if (args->stack) {
+        stack_push(args->stack, item);
+        stats_note_depth(args, args->stack->size);
+    } else if (args->engine == ENGINE_STEAL) {
+        deque_push(args->deques[args->id], item);
+        if (args->stats) {
+            stats_note_depth(args, deque_size(args->deques[args->id]));
+        }
+    } else if (args->capped) {
+        if (!args->holding) {
+            queue_task_add(args->queue, queue_stats(args));
+            args->holding = 1;
+        }
+        stack_push(&args->local, item);
+    } else {
+        args->pending[args->num_pending++] = item;
+        if (args->num_pending == PUSH_BATCH) {
+            flush_pending(args);
+        }
+    }
+}
+
+/**
+ * @brief Frees an item returned by next_item() and marks it fully processed.
+ * Only the shared queue tracks outstanding tasks; the work-stealing
+ * engine detects termination through its active-worker count instead.
+ * The items the processed one led to are pushed before it is marked
+ * done, so the queue never looks finished while some are held back.
+ * Items from a capped worker's local stack were never queued and are
+ * covered by the task it holds instead.
+ */
+static void finish_item(thread_args_t *args, scan_item_t *item) {
+    counter_add(&args->finished, 1);
+    counter_increment(&args->root_finished[item->root]);
+    if (item_free(item, args) == -1) {
+        flag_access_error(args->had_access_error, args->error_mutex);
+    }
+    if (!args->stack && args->engine == ENGINE_QUEUE) {
+        flush_pending(args);
+        if (!args->item_local) {
+            queue_task_done(args->queue, queue_stats(args));
+        }
+    }
+}
+
+/**
+ * @brief Accounts for one entry at position index that the lister has stat'ed itself.
+ * Files are counted right away; directories are published as items that
+ * only need to be listed and carry their own blocks, which count when the
+ * item is processed. When a record is given, the entry is also added to
+ * it. Returns the blocks counted.
+ */
+static size_t handle_entry(thread_args_t *args, dir_handle_t *handle, const char *name, uint64_t index,
+                           const uring_stat_result_t *result, dir_record_t *record) {
+    if (result->error) {
+        errno = result->error;
+        report_access_error(args, handle, name);
+        if (record) {
+            record->complete = 0;
+        }
+        return 0;
+    }
+
+    if (record) {
+        if (result->is_dir) {
+            record_add_subdir(record, name);
+        } else if (result->nlink > 1) {
+            record_add_link(record, result->dev, result->ino, result->blocks);
+        } else {
+            record->own_blocks += result->blocks;
+        }
+    }
+
+    if (result->is_dir) {
+        if (is_other_device(args, handle, result->dev) ||
+            is_earlier_root(args, handle->root, 1, result->dev, result->ino)) {
+            return 0;
+        }
+        scan_item_t *item = item_create(handle, name);
+        item->stat_done = 1;
+        item->blocks = result->blocks;
+        item->dev = result->dev;
+        item->index = index;
+        publish_item(args, item);
+        return 0;
+    }
+    if (is_earlier_root(args, handle->root, 0, result->dev, result->ino)) {
+        return 0;
+    }
+    return count_file(args, handle, index, name, handle->root, result->nlink, result->dev, result->ino,
+                      result->blocks);
+}
+
+/**
+ * @brief Stats one entry of a directory with fstatat.
+ */
+static void stat_entry(thread_args_t *args, int dirfd, const char *name, uring_stat_result_t *result) {
+    struct stat file_stat;
+    memset(result, 0, sizeof(*result));
+    if (timed_fstatat(args, dirfd, name, &file_stat) == -1) {
+        result->error = errno;
+        return;
+    }
+    result->is_dir = S_ISDIR(file_stat.st_mode);
+    result->blocks = file_stat.st_blocks;
+    result->dev = file_stat.st_dev;
+    result->ino = file_stat.st_ino;
+    result->nlink = file_stat.st_nlink;
+}
+
+/**
+ * @brief Stats the names collected in the batch with one io_uring submission.
+ * Returns the blocks counted.
+ */
+static size_t flush_stat_batch(thread_args_t *args, dir_handle_t *handle, dir_record_t *record) {
+    stat_batch_t *batch = args->batch;
+    uint64_t start = stats_start(args);
+    uring_stat_batch(batch->ring, handle->fd, batch->names, batch->results, batch->count);
+    if (args->stats) {
+        args->stats->stat_ns += monotonic_ns() - start;
+    }
+    note_entries(args, batch->count);
+
+    size_t blocks = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        blocks += handle_entry(args, handle, batch->names[i], batch->positions[i], &batch->results[i], record);
+    }
+
+    batch->count = 0;
+    return blocks;
+}
+
+/**
+ * @brief Handles the getdents64 records of part of a directory's listing.
+ * Entries are stat'ed here and only directories are published, so the
+ * engine carries one item per directory instead of one per entry. The
+ * entry's d_type tells directories apart without a stat: they are
+ * published as they are and stat'ed by the worker that opens them. On
+ * file systems that report DT_UNKNOWN, every entry is stat'ed here. With
+ * io_uring, all entries are stat'ed in batches, and when a record for the
+ * scan cache or a visitor is requested, directories are stat'ed here as
+ * well. Entries matching the exclude filter are dropped before they are
+ * stat'ed or published. The records start at position base of the
+ * directory's listing, see list_directory(). Returns the blocks counted.
+ */
+static size_t list_records(thread_args_t *args, dir_handle_t *handle, const char *records, size_t size,
+                           uint64_t base, dir_record_t *record) {
+    size_t blocks = 0;
+    for (size_t offset = 0; offset < size;) {
+        unsigned short length;
+        unsigned char type;
+        memcpy(&length, records + offset + offsetof(kernel_dirent64_t, d_reclen), sizeof(length));
+        memcpy(&type, records + offset + offsetof(kernel_dirent64_t, d_type), sizeof(type));
+        const char *name = records + offset + offsetof(kernel_dirent64_t, d_name);
+        uint64_t index = base + offset;
+        offset += length;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_excluded(args, name)) {
+            continue;
+        }
+
+        if (args->batch) {
+            args->batch->positions[args->batch->count] = index;
+            strcpy(args->batch->names[args->batch->count++], name);
+            if (args->batch->count == STAT_BATCH) {
+                blocks += flush_stat_batch(args, handle, record);
+            }
+        } else if (record || type != DT_DIR) {
+            uring_stat_result_t result;
+            stat_entry(args, handle->fd, name, &result);
+            blocks += handle_entry(args, handle, name, index, &result, record);
+        } else {
+            scan_item_t *item = item_create(handle, name);
+            item->index = index;
+            publish_item(args, item);
+        }
+    }
+
+    if (args->batch && args->batch->count > 0) {
+        blocks += flush_stat_batch(args, handle, record);
+    }
+    return blocks;
+}
+
+/**
+ * @brief Reads all entries of an opened directory with getdents64.
+ *
+ * A directory whose listing fits in one buffer is handled right away, see
+ * list_records(). A larger one is split: while further buffers come in,
+ * each previous one is published as a chunk item for any worker to
+ * handle, and the lister only handles the last one itself. So the entries
+ * of a directory with millions of them are stat'ed by all workers instead
+ * of the one that opened it. The single-threaded traversal, listings
+ * recorded for the scan cache or a visitor, which must be complete in one
+ * place, and capped workers do not split. A cancelled scan stops reading
+ * between buffers. The position of an entry is the offset of its record
+ * in everything getdents64 returned for the directory, so entries are
+ * ordered as they are listed whichever worker handles them. Returns the
+ * blocks counted while listing.
+ */
+static size_t list_directory(thread_args_t *args, dir_handle_t *handle, dir_record_t *record) {
+    if (!args->dents) {
+        args->dents = malloc(2 * DENTS_BUFFER_BYTES);
+        if (!args->dents) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int split = !args->stack && !record && !args->capped;
+    size_t blocks = 0;
+    size_t held = 0;
+    uint64_t held_position = 0;
+    uint64_t position = 0;
+    int current = 0;
+    while (!atomic_load_explicit(args->cancelled, memory_order_relaxed)) {
+        char *buffer = args->dents + current * DENTS_BUFFER_BYTES;
+        ssize_t size = timed_getdents(args, handle->fd, buffer);
+        if (size == -1) {
+            report_access_error(args, handle->parent, handle->name);
+            if (record) {
+                record->complete = 0;
+            }
+        }
+        if (size <= 0) {
+            break;
+        }
+        if (!split) {
+            blocks += list_records(args, handle, buffer, size, position, record);
+            position += size;
+            continue;
+        }
+        if (held > 0) {
+            scan_item_t *chunk = item_create_chunk(handle, args->dents + (1 - current) * DENTS_BUFFER_BYTES, held);
+            chunk->index = held_position;
+            publish_item(args, chunk);
+        }
+        held = size;
+        held_position = position;
+        position += size;
+        current = 1 - current;
+    }
+
+    if (held > 0) {
+        blocks += list_records(args, handle, args->dents + (1 - current) * DENTS_BUFFER_BYTES, held, held_position,
+                               record);
+    }
+    return blocks;
+}
+
+/**
+ * @brief Returns the blocks of all files recorded in a cache entry, hard-linked ones included.
+ */
+static uint64_t entry_file_blocks(const cache_entry_t *entry) {
+    uint64_t blocks = entry->own_blocks;
+    for (uint32_t i = 0; i < entry->num_links; i++) {
+        blocks += entry->links[i].blocks;
+    }
+    return blocks;
+}
+
+/**
+ * @brief Reports a cache entry that claimed to be valid but did not match the directory.
+ */
+static void check_cache_entry(thread_args_t *args, const dir_handle_t *handle, const cache_entry_t *cached,
+                              const cache_entry_t *fresh) {
+    if (cached->own_blocks == fresh->own_blocks && cached->num_links == fresh->num_links &&
+        cached->num_subdirs == fresh->num_subdirs && cached->subdirs_size == fresh->subdirs_size &&
+        (fresh->num_links == 0 || memcmp(cached->links, fresh->links, fresh->num_links * sizeof(cache_link_t)) == 0) &&
+        (fresh->subdirs_size == 0 || memcmp(cached->subdirs, fresh->subdirs, fresh->subdirs_size) == 0)) {
+        return;
+    }
+
+    char *path = entry_path(handle->parent, handle->name);
+    char message[96];
+    snprintf(message, sizeof(message), "stale cache entry (cached %llu blocks in files, found %llu)",
+             (unsigned long long)entry_file_blocks(cached), (unsigned long long)entry_file_blocks(fresh));
+    report_problem(args->options, path ? path : handle->name, 0, message);
+    free(path);
+}
+
+/**
+ * @brief Hands the summary of a listed directory to the visitor, if any.
+ * dir_stat is NULL if the directory itself could not be stat'ed. If the
+ * directory's path cannot be built, the visitor is not called and the
+ * error is reported.
+ */
+static void visit_directory(thread_args_t *args, const dir_handle_t *handle, const struct stat *dir_stat,
+                            uint64_t file_blocks, int complete) {
+    if (!args->visit) {
+        return;
+    }
+
+    char *path = entry_path(handle->parent, handle->name);
+    if (!path) {
+        report_problem(args->options, handle->name, ENOMEM, NULL);
+        flag_access_error(args->had_access_error, args->error_mutex);
+        return;
+    }
+
+    dir_summary_t summary = {.path = path,
+                             .depth = handle->depth,
+                             .dev = dir_stat ? dir_stat->st_dev : 0,
+                             .ino = dir_stat ? dir_stat->st_ino : 0,
+                             .dir_blocks = dir_stat ? dir_stat->st_blocks : 0,
+                             .file_blocks = file_blocks,
+                             .complete = complete && dir_stat};
+    args->visit(&summary, args->visit_context);
+    free(path);
+}
+
+/**
+ * @brief Lists an opened directory for a visitor.
+ * The entries are stat'ed inline so that the blocks of the files directly
+ * in the directory are known once the listing is done.
+ * Returns the blocks counted.
+ */
+static size_t list_directory_visited(thread_args_t *args, dir_handle_t *handle) {
+    struct stat dir_stat;
+    int have_stat = fstat(handle->fd, &dir_stat) == 0;
+
+    dir_record_t *record = &args->record;
+    record_reset(record);
+    size_t blocks = list_directory(args, handle, record);
+    visit_directory(args, handle, have_stat ? &dir_stat : NULL, record_file_blocks(record), record->complete);
+    return blocks;
+}
+
+/**
+ * @brief Lists an opened directory through the scan cache.
+ *
+ * If the cache holds a valid entry for the directory, the entry's file
+ * blocks are replayed and its recorded subdirectories are published
+ * without reading the directory, their positions being their order in
+ * the entry. The cache does not keep file names or positions, so this is
+ * skipped when the largest files are collected, names are excluded, some
+ * scanned path is a file, which could be among the files, or hard-linked
+ * files are credited to their owners; with excluded names, the listing is not stored either, since it
+ * would miss the excluded entries. Otherwise, or when verifying, the
+ * directory is listed with its entries stat'ed inline, and the result is
+ * stored for the next run if every entry could be examined.
+ * Returns the blocks counted.
+ */
+static size_t list_directory_cached(thread_args_t *args, dir_handle_t *handle) {
+    struct stat dir_stat;
+    if (fstat(handle->fd, &dir_stat) == -1) {
+        return args->visit ? list_directory_visited(args, handle) : list_directory(args, handle, NULL);
+    }
+
+    dir_stamp_t stamp;
+    dir_stamp_from_stat(&stamp, &dir_stat);
+    const cache_entry_t *cached = scan_cache_lookup(args->cache, &stamp);
+
+    if (cached && !args->verify_cache && !args->top_files && !args->exclude && !args->root_files &&
+        !(args->owners && cached->num_links > 0)) {
+        size_t blocks = cached->own_blocks;
+        for (uint32_t i = 0; i < cached->num_links; i++) {
+            const cache_link_t *link = &cached->links[i];
+            blocks += count_blocks(args, handle->root, 2, link->dev, link->ino, link->blocks);
+        }
+        uint64_t index = 0;
+        for (const char *name = cached->subdirs; name < cached->subdirs + cached->subdirs_size;
+             name += strlen(name) + 1) {
+            scan_item_t *item = item_create(handle, name);
+            item->index = index++;
+            publish_item(args, item);
+        }
+        scan_cache_keep(args->cache, cached);
+        visit_directory(args, handle, &dir_stat, entry_file_blocks(cached), 1);
+        return blocks;
+    }
+
+    dir_record_t *record = &args->record;
+    record_reset(record);
+    size_t blocks = list_directory(args, handle, record);
+    visit_directory(args, handle, &dir_stat, record_file_blocks(record), record->complete);
+    if (!record->complete || args->exclude) {
+        return blocks;
+    }
+
+    cache_entry_t fresh = {.stamp = stamp,
+                           .own_blocks = record->own_blocks,
+                           .num_links = record->num_links,
+                           .num_subdirs = record->num_subdirs,
+                           .links = record->links,
+                           .subdirs = record->subdirs,
+                           .subdirs_size = record->subdirs_size};
+    if (cached) {
+        check_cache_entry(args, handle, cached, &fresh);
+    }
+    scan_cache_store(args->cache, &fresh);
+    return blocks;
+}
+
+/**
+ * @brief Examines one item and returns the number of blocks it occupies.
+ * A file only contributes its own blocks. A directory is opened relative
+ * to its parent's fd and its entries are listed through a handle that
+ * the published child items share. With a rollup, the blocks are also
+ * added to the directory they belong to: a file's to its parent, a
+ * directory's own and those of the files listed in it to itself.
+ * With one_file_system, a directory on another device than its scanned
+ * path is skipped and counts nothing, as is an entry that is an earlier
+ * scanned path (see is_earlier_root()); a scanned path that is the same
+ * as an earlier one is covered by it. A chunk of a split listing
+ * contributes the blocks of the files among its entries, which are added
+ * to the directory they are in. Hard-linked files left to their owners
+ * (see count_file()) count for the total but are not added anywhere.
+ */
+static size_t process_item(thread_args_t *args, scan_item_t *item) {
+    args->deferred = 0;
+    if (item->chunk_size) {
+        size_t blocks = list_records(args, item->parent, item->name, item->chunk_size, item->index, NULL);
+        dir_handle_add_blocks(item->parent, blocks - args->deferred);
+        return blocks;
+    }
+
+    size_t blocks = item->blocks;
+    uint64_t root_dev = item->parent ? item->parent->root_dev : 0;
+    uint64_t dev = item->dev;
+    if (!item->stat_done) {
+        struct stat file_stat;
+        if (timed_fstatat(args, item_dirfd(item), item->name, &file_stat) == -1) {
+            report_access_error(args, item->parent, item->name);
+            return 0;
+        }
+        if ((S_ISDIR(file_stat.st_mode) && is_other_device(args, item->parent, file_stat.st_dev)) ||
+            is_earlier_root(args, item->root, S_ISDIR(file_stat.st_mode), file_stat.st_dev, file_stat.st_ino)) {
+            if (!item->parent) {
+                atomic_store_explicit(&args->covered[item->root], 1, memory_order_relaxed);
+            }
+            return 0;
+        }
+        if (!item->parent) {
+            root_dev = file_stat.st_dev;
+        }
+        dev = file_stat.st_dev;
+
+        if (!S_ISDIR(file_stat.st_mode)) {
+            blocks = count_file(args, item->parent, item->index, item->name, item->root, file_stat.st_nlink,
+                                file_stat.st_dev, file_stat.st_ino, file_stat.st_blocks);
+            dir_handle_add_blocks(item->parent, blocks - args->deferred);
+            return blocks;
+        }
+        blocks = file_stat.st_blocks;
+    }
+
+    uint64_t start = stats_start(args);
+    int fd = openat(item_dirfd(item), item->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (args->stats) {
+        args->stats->readdir_ns += monotonic_ns() - start;
+        args->stats->dirs += dir != NULL;
+    }
+    if (!dir) {
+        report_access_error(args, item->parent, item->name);
+        if (fd != -1) {
+            close(fd);
+        }
+        dir_handle_add_blocks(item->parent, blocks);
+        return blocks;
+    }
+
+    dir_handle_t *handle = dir_handle_create(item->parent, item->name, dir, args->rollup);
+    handle->root = item->root;
+    handle->root_dev = root_dev;
+    handle->dev = dev;
+    handle->index = item->index;
+    if (args->cache) {
+        blocks += list_directory_cached(args, handle);
+    } else if (args->visit) {
+        blocks += list_directory_visited(args, handle);
+    } else {
+        blocks += list_directory(args, handle, NULL);
+    }
+    dir_handle_add_blocks(handle, blocks - args->deferred);
+
+    if (dir_handle_release(handle, args) == -1) {
+        flag_access_error(args->had_access_error, args->error_mutex);
+    }
+    return blocks;
+}
+
+/**
+ * @brief Processes an item returned by next_item() and frees it, within the budget of its device.
+ * If the item's device already has as many busy workers as it may, the
+ * item is set aside for one of them and left. Otherwise the worker goes
+ * on with the items of the device set aside meanwhile, so the device
+ * keeps its workers and no more. Items set aside from a capped worker's
+ * local stack get a task of their own with the shared queue, as the
+ * worker may release the task covering its stack before they are done.
+ * Scanned paths are not limited, since their devices are not known yet.
+ */
+static void run_item(thread_args_t *args, scan_item_t *item) {
+    device_budget_t *devices = item->parent ? args->devices : NULL;
+    uint64_t dev = item->dev;
+    if (devices && !device_budget_enter(devices, dev, item)) {
+        if (args->item_local) {
+            queue_task_add(args->queue, queue_stats(args));
+        }
+        return;
+    }
+    do {
+        if (!atomic_load_explicit(args->cancelled, memory_order_relaxed)) {
+            counter_add(&args->root_blocks[item->root], process_item(args, item));
+        }
+        finish_item(args, item);
+        item = devices ? device_budget_leave(devices, dev) : NULL;
+        args->item_local = 0;
+    } while (item);
+}
+
+/**
+ * @brief Handles a finished directory's total, called by the rollup.
+ * The total is offered to the largest directories of the worker that
+ * finished it, and passed to options->dir_total if it is shallow enough.
+ * The scanned path itself is left out; its total is the result of the scan.
+ */
+static void report_dir_total(const dir_handle_t *handle, unsigned long long blocks, void *context, void *worker) {
+    const scan_options_t *options = context;
+    thread_args_t *args = worker;
+    if (handle->depth == 0) {
+        return;
+    }
+    if (args) {
+        note_top(args, args->top_dirs, handle->parent, handle->name, blocks);
+    }
+    if (!options->dir_total || handle->depth > (unsigned int)options->dir_total_depth) {
+        return;
+    }
+
+    char *path = entry_path(handle->parent, handle->name);
+    if (!path) {
+        report_problem(options, handle->name, ENOMEM, NULL);
+        if (args) {
+            flag_access_error(args->had_access_error, args->error_mutex);
+        }
+        return;
+    }
+    options->dir_total(path, blocks, options->dir_total_context);
+    free(path);
+}
+
+/**
+ * @brief Reports a directory that could not be closed, called by the rollup.
+ */
+static void report_close_error(const char *path, int errnum, void *context, void *worker) {
+    (void)worker;
+    report_problem(context, path, errnum, NULL);
+}
+
+/**
+ * @brief Sets up the shared state of a -j auto pool.
+ * The condition variable uses the monotonic clock, so that the tuner's
+ * windows are not affected by changes to the wall clock.
+ */
+static void pool_init(worker_pool_t *pool) {
+    atomic_init(&pool->limit, AUTO_MIN_THREADS);
+    atomic_init(&pool->done, 0);
+
+    int errnum = pthread_mutex_init(&pool->mutex, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_condattr_t attr;
+    errnum = pthread_condattr_init(&attr);
+    if (errnum == 0) {
+        errnum = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    }
+    if (errnum == 0) {
+        errnum = pthread_cond_init(&pool->cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_init: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Destroys the mutex and condition variable of a -j auto pool.
+ */
+static void pool_destroy(worker_pool_t *pool) {
+    int errnum = pthread_mutex_destroy(&pool->mutex);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+
+    errnum = pthread_cond_destroy(&pool->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_destroy: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Sleeps for one tuning window, or until the traversal completes.
+ * Must be called with the pool mutex held. Returns 0 once the traversal is complete.
+ */
+static int pool_wait_window(worker_pool_t *pool) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += AUTO_WINDOW_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!atomic_load(&pool->done)) {
+        int errnum = pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline);
+        if (errnum == ETIMEDOUT) {
+            break;
+        }
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_timedwait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return !atomic_load(&pool->done);
+}
+
+/**
+ * @brief Tunes the number of active workers of a -j auto pool until the traversal completes.
+ *
+ * Runs on the context's tuner thread. After every window of
+ * AUTO_WINDOW_MS it measures the entries stat'ed per second and the share
+ * of time the active workers spent waiting for work. While probing, the
+ * number of workers doubles as long as each step raises throughput by
+ * AUTO_GAIN and the workers rarely wait; the first step that does not pay
+ * off is undone, which leaves the pool at the start of the plateau. After
+ * that, a quarter of the workers are parked whenever they mostly wait, and
+ * every AUTO_PROBE_WINDOWS windows half as many again are tried, since the
+ * best number shifts as caches warm up or the scan moves to other parts
+ * of the tree.
+ */
+static void tune_pool(worker_pool_t *pool, thread_args_t *args, int num_threads) {
+    int best = atomic_load(&pool->limit);
+    double best_rate = 0;
+    int probing = 1;
+    int held = 0;
+    uint64_t last_entries = 0;
+    uint64_t last_idle = 0;
+    for (int i = 0; i < num_threads; i++) {
+        last_entries += atomic_load_explicit(&args[i].progress, memory_order_relaxed);
+        last_idle += atomic_load_explicit(&args[i].idle_ns, memory_order_relaxed);
+    }
+    uint64_t last_time = monotonic_ns();
+
+    safe_lock(&pool->mutex);
+    while (pool_wait_window(pool)) {
+        uint64_t entries = 0;
+        uint64_t idle = 0;
+        for (int i = 0; i < num_threads; i++) {
+            entries += atomic_load_explicit(&args[i].progress, memory_order_relaxed);
+            idle += atomic_load_explicit(&args[i].idle_ns, memory_order_relaxed);
+        }
+        uint64_t now = monotonic_ns();
+        int limit = atomic_load(&pool->limit);
+        double seconds = (now - last_time) / 1e9;
+        double rate = (entries - last_entries) / seconds;
+        double idle_share = (idle - last_idle) / 1e9 / (seconds * limit);
+        last_entries = entries;
+        last_idle = idle;
+        last_time = now;
+
+        int next = limit;
+        if (probing) {
+            if (rate > best_rate * AUTO_GAIN) {
+                best = limit;
+                best_rate = rate;
+                if (idle_share < AUTO_IDLE_GROW && limit < num_threads) {
+                    next = limit * 2 < num_threads ? limit * 2 : num_threads;
+                }
+            } else {
+                next = best;
+            }
+            probing = next > limit;
+            held = 0;
+        } else if (idle_share > AUTO_IDLE_SHRINK && limit > AUTO_MIN_THREADS) {
+            next = limit - limit / 4 > AUTO_MIN_THREADS ? limit - limit / 4 : AUTO_MIN_THREADS;
+            held = 0;
+        } else if (++held >= AUTO_PROBE_WINDOWS && idle_share < AUTO_IDLE_GROW && limit < num_threads) {
+            best = limit;
+            best_rate = rate;
+            next = limit + (limit + 1) / 2 < num_threads ? limit + (limit + 1) / 2 : num_threads;
+            probing = 1;
+        }
+
+        if (next != limit) {
+            atomic_store(&pool->limit, next);
+            int errnum = pthread_cond_broadcast(&pool->cond);
+            if (errnum != 0) {
+                fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    safe_unlock(&pool->mutex);
+}
+
 /**
- * @struct thread_args_t
- * @brief Arguments passed to worker threads for parallel traversal.
+ * @brief Waits until the context starts a scan after the one numbered *generation.
+ * Returns that scan and updates *generation, or returns NULL once the
+ * context shuts down.
  */
-typedef struct {
-    work_queue_t *queue;          /**< Pointer to the shared work queue */
-    size_t *total_size;           /**< Pointer to the shared total size */
-    pthread_mutex_t *size_mutex;  /**< Mutex for updating total size */
-    int *had_access_error;        /**< Pointer to error flag */
-    pthread_mutex_t *error_mutex; /**< Mutex for updating error flag */
-} thread_args_t;
+static scan_t *wait_for_scan(scan_ctx_t *ctx, unsigned long *generation) {
+    safe_lock(&ctx->mutex);
+    while (!ctx->shutdown && ctx->generation == *generation) {
+        int errnum = pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    scan_t *scan = ctx->shutdown ? NULL : ctx->current;
+    *generation = ctx->generation;
+    safe_unlock(&ctx->mutex);
+    return scan;
+}
 
 /**
- * @brief Frees resources and destroys mutexes.
- * @param threads Array of thread handles.
- * @param args Array of thread arguments.
- * @param size_mutex Mutex for total size.
- * @param error_mutex Mutex for error flag.
- * @param queue Work queue.
+ * @brief Wakes every thread waiting on the context's condition variable.
+ * Must be called with the context's mutex held.
  */
-static void free_and_destroy_mutex(pthread_t *threads, thread_args_t *args, pthread_mutex_t *size_mutex,
-                                   pthread_mutex_t *error_mutex, work_queue_t *queue) {
-    free(threads);
-    free(args);
-
-    int errnum = pthread_mutex_destroy(size_mutex);
+static void ctx_broadcast(scan_ctx_t *ctx) {
+    int errnum = pthread_cond_broadcast(&ctx->cond);
     if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
-        queue_destroy(queue);
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
         exit(EXIT_FAILURE);
     }
+}
 
-    errnum = pthread_mutex_destroy(error_mutex);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
-        queue_destroy(queue);
-        exit(EXIT_FAILURE);
+/**
+ * @brief Sums the counters the workers of a context have kept over all scans.
+ */
+static void sum_counters(const scan_ctx_t *ctx, uint64_t *entries, uint64_t *published, uint64_t *finished) {
+    *entries = 0;
+    *published = 0;
+    *finished = 0;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        *entries += atomic_load_explicit(&ctx->args[i].progress, memory_order_relaxed);
+        *published += atomic_load_explicit(&ctx->args[i].published, memory_order_relaxed);
+        *finished += atomic_load_explicit(&ctx->args[i].finished, memory_order_relaxed);
     }
-    queue_destroy(queue);
 }
 
 /**
- * @brief Reports a file/directory access error in a thread-safe way.
+ * @brief Sums the blocks the workers have counted so far under each path of a scan.
+ * Reads the workers' counters without locking, so it can be called at any
+ * time; the sums are exact once the scan has finished. A hard link moved
+ * to an earlier path is taken off the later one's counter by the worker
+ * that moved it, which a reader may see before the link was added to it,
+ * so a sum that comes out below zero is read as zero. Paths covered by
+ * an earlier one are zero.
  */
-static void report_access_error(const char *path, int *had_error, pthread_mutex_t *error_mutex) {
-    perror(path);
-    if (error_mutex) {
-        safe_lock(error_mutex);
-        *had_error = 1;
-        safe_unlock(error_mutex);
-    } else {
-        *had_error = 1;
+static void sum_worker_blocks(const scan_t *scan, size_t *totals) {
+    for (int i = 0; i < scan->num_paths; i++) {
+        totals[i] = 0;
+    }
+    for (int worker = 0; worker < scan->ctx->num_threads; worker++) {
+        const atomic_ullong *row = scan->worker_blocks + (size_t)worker * scan->num_paths;
+        for (int i = 0; i < scan->num_paths; i++) {
+            totals[i] += atomic_load_explicit(&row[i], memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < scan->num_paths; i++) {
+        if ((int64_t)totals[i] < 0 || atomic_load_explicit(&scan->covered[i], memory_order_relaxed)) {
+            totals[i] = 0;
+        }
     }
 }
 
-/* --- EXTERNAL --- */
-
 /**
- * @brief Worker thread function for parallel directory traversal.
- * Each worker repeatedly pops a path from the shared work queue.
- * For each path, it checks if it is a file or directory:
- *   - If a file, it adds its size to a local counter.
- *   - If a directory, it opens the directory and pushes all entries onto the queue.
- * Access errors are reported and flagged. When the queue is empty, the worker
- * adds its local size to the shared total size in a thread-safe way and exits.
+ * @brief Reads the progress of a running scan from the workers' counters.
+ * The items pending are the scanned paths and the items published since
+ * the scan started, less those finished since. The blocks are summed like
+ * the totals of sum_worker_blocks().
  */
-static void *worker_func(void *arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    size_t local_size = 0;
+static void read_progress(const scan_t *scan, scan_progress_t *progress) {
+    uint64_t entries, published, finished;
+    sum_counters(scan->ctx, &entries, &published, &finished);
+    progress->entries = entries - scan->base_entries;
+    progress->pending = scan->num_paths + (published - scan->base_published) - (finished - scan->base_finished);
+    progress->blocks = 0;
+    for (int i = 0; i < scan->num_paths; i++) {
+        if (atomic_load_explicit(&scan->covered[i], memory_order_relaxed)) {
+            continue;
+        }
+        uint64_t blocks = 0;
+        for (int worker = 0; worker < scan->ctx->num_threads; worker++) {
+            blocks += atomic_load_explicit(&scan->worker_blocks[(size_t)worker * scan->num_paths + i],
+                                           memory_order_relaxed);
+        }
+        progress->blocks += (int64_t)blocks < 0 ? 0 : blocks;
+    }
+}
 
-    while (1) {
-        char *path = queue_pop(args->queue);
-        if (!path) {
-            break;
+/**
+ * @brief Makes a scan the current one and hands its paths to the workers.
+ * Must be called with the context's mutex held, while no scan runs. The
+ * paths go onto the stack of a single worker, are dealt round-robin to
+ * the deques of the workers that take work first, or are pushed to the
+ * shared queue in one batch. The workers are woken last, so they find
+ * the engine already seeded.
+ */
+static void start_scan_locked(scan_ctx_t *ctx, scan_t *scan) {
+    ctx->current = scan;
+    ctx->arrived = 0;
+    scan->state = SCAN_RUNNING;
+    if (!scan->options.count_links) {
+        scan->links = inode_set_create(LINK_SET_MAX_ENTRIES, ctx->num_threads == 1 ? 1 : LINK_SET_SHARDS);
+        if (scan->rollup.done || scan->options.top_files) {
+            scan->owners = link_owners_create(LINK_SET_MAX_ENTRIES, ctx->num_threads == 1 ? 1 : LINK_SET_SHARDS,
+                                              scan->options.top_files != 0);
         }
+    }
+    sum_counters(ctx, &scan->base_entries, &scan->base_published, &scan->base_finished);
 
-        struct stat file_stat;
-        if (lstat(path, &file_stat) == -1) {
-            report_access_error(path, args->had_access_error, args->error_mutex);
-            free(path);
-            queue_task_done(args->queue);
-            continue;
+    atomic_store(&ctx->active, ctx->num_threads);
+    if (ctx->tuned) {
+        atomic_store(&ctx->pool.limit, AUTO_MIN_THREADS);
+        atomic_store(&ctx->pool.done, 0);
+    }
+    int first_active = ctx->tuned ? AUTO_MIN_THREADS : ctx->num_threads;
+
+    scan_item_t **roots = malloc(scan->num_paths * sizeof(scan_item_t *));
+    if (!roots) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < scan->num_paths; i++) {
+        roots[i] = item_create(NULL, scan->paths[i]);
+        roots[i]->root = i;
+    }
+    if (ctx->num_threads == 1) {
+        for (int i = scan->num_paths - 1; i >= 0; i--) {
+            stack_push(&ctx->stack, roots[i]);
+        }
+    } else if (ctx->deques) {
+        for (int i = 0; i < scan->num_paths; i++) {
+            deque_push(ctx->deques[i % first_active], roots[i]);
         }
+    } else {
+        queue_push_batch(ctx->queue, 0, (void *const *)roots, scan->num_paths, NULL);
+    }
+    free(roots);
 
-        local_size += file_stat.st_blocks;
+    ctx->generation++;
+    ctx_broadcast(ctx);
+}
 
-        if (S_ISDIR(file_stat.st_mode)) {
-            DIR *dir = opendir(path);
-            if (!dir) {
-                report_access_error(path, args->had_access_error, args->error_mutex);
-                free(path);
-                queue_task_done(args->queue);
-                continue;
-            }
+/**
+ * @brief Frees a scan and the copies it holds.
+ */
+static void scan_free(scan_t *scan) {
+    for (int i = 0; i < scan->num_paths; i++) {
+        free(scan->paths[i]);
+    }
+    free(scan->paths);
+    free(scan->totals);
+    free(scan->worker_blocks);
+    free(scan->worker_published);
+    free(scan->worker_finished);
+    free(scan->covered);
+    free(scan->root_ids);
+    if (scan->devices) {
+        device_budget_destroy(scan->devices);
+    }
+    free(scan);
+}
 
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
+/**
+ * @brief Finishes the current scan, called by the last thread done with it.
+ * The final progress is recorded and the completion callback is called
+ * without the mutex held, so that it may submit further scans. The next
+ * queued scan is started right after, and a scan whose handle was
+ * already released is freed.
+ */
+static void complete_scan(scan_ctx_t *ctx, scan_t *scan) {
+    scan_progress_t progress;
+    read_progress(scan, &progress);
+    scan->entries = progress.entries;
+    scan->blocks = progress.blocks;
+    sum_worker_blocks(scan, scan->totals);
+
+    warn_if_saturated(&scan->options, scan->num_paths == 1 ? scan->paths[0] : "mdu", scan->links);
+    if (scan->links) {
+        inode_set_destroy(scan->links);
+        scan->links = NULL;
+    }
+    if (scan->owners) {
+        link_owners_destroy(scan->owners);
+        scan->owners = NULL;
+    }
+
+    if (scan->done) {
+        scan_result_t result = {.paths = scan->paths,
+                                .totals = scan->totals,
+                                .num_paths = scan->num_paths,
+                                .had_access_error = scan->had_access_error,
+                                .cancelled = atomic_load(&scan->cancelled)};
+        scan->done(&result, scan->done_context);
+    }
+
+    safe_lock(&ctx->mutex);
+    scan->state = SCAN_FINISHED;
+    ctx->current = NULL;
+    scan_t *next = ctx->first_queued;
+    if (next) {
+        ctx->first_queued = next->next;
+        start_scan_locked(ctx, next);
+    }
+    ctx_broadcast(ctx);
+    int released = scan->released;
+    safe_unlock(&ctx->mutex);
+
+    if (released) {
+        scan_free(scan);
+    }
+}
+
+/**
+ * @brief Tells the context that a worker or the tuner is done with the current scan.
+ * The last of them completes the scan.
+ */
+static void arrive(scan_ctx_t *ctx, scan_t *scan) {
+    safe_lock(&ctx->mutex);
+    int last = ++ctx->arrived == ctx->num_threads + ctx->tuned;
+    safe_unlock(&ctx->mutex);
+    if (last) {
+        complete_scan(ctx, scan);
+    }
+}
+
+/**
+ * @brief Points a worker at a newly started scan.
+ * The worker sets up its io_uring batch the first time a scan asks for
+ * one and keeps it for later scans. Its largest files and directories
+ * are collected in heaps of its own.
+ */
+static void begin_worker_scan(thread_args_t *args, scan_t *scan) {
+    const scan_options_t *options = &scan->options;
+    args->scan = scan;
+    args->options = options;
+    args->cancelled = &scan->cancelled;
+    if (options->use_uring && !args->uring_tried) {
+        args->uring_batch = stat_batch_create(1);
+        args->uring_tried = 1;
+    }
+    args->batch = options->use_uring ? args->uring_batch : NULL;
+    args->links = scan->links;
+    args->owners = scan->owners;
+    args->cache = options->cache;
+    args->verify_cache = options->verify_cache;
+    args->exclude = options->exclude;
+    args->one_file_system = options->one_file_system;
+    args->devices = scan->devices;
+    args->visit = options->visit;
+    args->visit_context = options->visit_context;
+    args->rollup = &scan->rollup;
+    args->num_roots = scan->num_paths;
+    args->covered = scan->covered;
+    args->root_blocks = scan->worker_blocks + (size_t)args->id * scan->num_paths;
+    args->root_published = scan->worker_published + (size_t)args->id * scan->num_paths;
+    args->root_finished = scan->worker_finished + (size_t)args->id * scan->num_paths;
+    args->had_access_error = &scan->had_access_error;
+    args->stats = options->stats ? &options->stats[args->id] : NULL;
+    args->stats_base = args->queue_stats;
+    args->queue_stats.peak_size = 0;
+    args->queue_cap = options->memory_limit / QUEUED_ITEM_BYTES + (options->memory_limit != 0);
+    args->capped = 0;
+    args->since_check = 0;
+    args->top_files = options->top_files ? top_n_create(top_n_capacity(options->top_files)) : NULL;
+    args->top_dirs = options->top_dirs ? top_n_create(top_n_capacity(options->top_dirs)) : NULL;
+}
+
+/**
+ * @brief Orders path identities by inode, then device, for is_earlier_root().
+ */
+static int compare_root_ids(const void *a, const void *b) {
+    const root_id_t *x = a;
+    const root_id_t *y = b;
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-                char full_path[PATH_MAX];
-                int ret = snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-                if (ret >= (int)sizeof(full_path) || ret < 0) {
-                    fprintf(stderr, "Filepath too long: %s/%s\n", path, entry->d_name);
-                    report_access_error("", args->had_access_error, args->error_mutex);
-                    continue;
+/**
+ * @brief Identifies the paths of a scan before any of them is listed.
+ * Like du, a scan of several paths that counts every file once also
+ * counts everything once over the paths, see is_earlier_root(). For that,
+ * every path must be known before any is looked up: the first worker to
+ * begin the scan stats them all, and the others wait until it is done.
+ * This happens on a worker rather than on submission so that a path on
+ * a hanging file system does not block the caller, which can still give
+ * up on the scan.
+ */
+static void identify_roots(thread_args_t *args, scan_t *scan) {
+    scan_ctx_t *ctx = args->ctx;
+    if (scan->num_paths > 1 && !scan->options.count_links) {
+        safe_lock(&ctx->mutex);
+        if (!scan->identifying) {
+            scan->identifying = 1;
+            safe_unlock(&ctx->mutex);
+            root_id_t *ids = malloc(scan->num_paths * sizeof(root_id_t));
+            if (!ids) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            int count = 0;
+            for (int i = 0; i < scan->num_paths; i++) {
+                struct stat path_stat;
+                if (fstatat(AT_FDCWD, scan->paths[i], &path_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+                    ids[count++] = (root_id_t){.dev = path_stat.st_dev, .ino = path_stat.st_ino, .index = i};
+                    scan->root_files |= !S_ISDIR(path_stat.st_mode);
                 }
-                queue_push(args->queue, full_path);
             }
-
-            if (closedir(dir) == -1) {
-                report_access_error(path, args->had_access_error, args->error_mutex);
+            qsort(ids, count, sizeof(root_id_t), compare_root_ids);
+            safe_lock(&ctx->mutex);
+            scan->root_ids = ids;
+            scan->num_root_ids = count;
+            scan->identified = 1;
+            ctx_broadcast(ctx);
+        }
+        while (!scan->identified) {
+            int errnum = pthread_cond_wait(&ctx->cond, &ctx->mutex);
+            if (errnum != 0) {
+                fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+                exit(EXIT_FAILURE);
             }
         }
+        safe_unlock(&ctx->mutex);
+    }
+    args->root_ids = scan->root_ids;
+    args->num_root_ids = scan->num_root_ids;
+    args->root_files = scan->root_files;
+}
+
+/**
+ * @brief Credits the hard-linked files whose owners are still open once the traversal is over.
+ * Those are files with links that were not found, outside the scanned
+ * paths or skipped. Every worker takes from the owners until none are
+ * left, so the directories they finish report to its own collections.
+ */
+static void credit_remaining_links(thread_args_t *args) {
+    link_place_t owner;
+    while (args->owners && link_owners_take(args->owners, &owner)) {
+        credit_link(args, &owner);
+    }
+}
 
-        free(path);
-        queue_task_done(args->queue);
+/**
+ * @brief Adds what a worker found in a scan to the scan's results.
+ * The worker's heaps of largest entries are merged under the size mutex,
+ * and its waits during the scan are added to its stats. Its sizes are
+ * already in the scan's worker_blocks.
+ */
+static void end_worker_scan(thread_args_t *args) {
+    const scan_options_t *options = args->options;
+    if (args->stats) {
+        args->stats->wait_ns += args->queue_stats.wait_ns - args->stats_base.wait_ns;
+        args->stats->lock_ns += args->queue_stats.lock_ns - args->stats_base.lock_ns;
+        stats_note_depth(args, args->queue_stats.peak_size);
     }
 
     safe_lock(args->size_mutex);
-    *(args->total_size) += local_size;
+    if (args->top_files) {
+        top_n_merge(options->top_files, args->top_files);
+    }
+    if (args->top_dirs) {
+        top_n_merge(options->top_dirs, args->top_dirs);
+    }
     safe_unlock(args->size_mutex);
 
+    if (args->top_files) {
+        top_n_destroy(args->top_files);
+        args->top_files = NULL;
+    }
+    if (args->top_dirs) {
+        top_n_destroy(args->top_dirs);
+        args->top_dirs = NULL;
+    }
+}
+
+/**
+ * @brief Tuner thread of a -j auto context.
+ * Tunes the pool while each scan runs, then arrives like a worker, so a
+ * scan only completes once the tuner has stopped looking at it.
+ */
+static void *tuner_func(void *arg) {
+    scan_ctx_t *ctx = arg;
+    unsigned long generation = 0;
+    scan_t *scan;
+    while ((scan = wait_for_scan(ctx, &generation)) != NULL) {
+        tune_pool(&ctx->pool, ctx->args, ctx->num_threads);
+        arrive(ctx, scan);
+    }
     return NULL;
 }
 
 /**
- * @brief Recursively calculates the disk usage of a path (single-threaded).
- * This function starts at the given path and checks if it is a file or directory:
- *   - If a file, it returns its size.
- *   - If a directory, it opens the directory and recursively calls itself for each entry.
- * The sizes of all files and subdirectories are accumulated.
- * Any access errors are reported and flagged.
+ * @brief Initializes the mutexes and condition variable of a context.
+ * Returns -1 with errno set if one cannot be initialized, after destroying
+ * those that were.
  */
-void get_size(const char *path, size_t *result, int *had_access_error) {
-    struct stat file_stat;
-    if (lstat(path, &file_stat) == -1) {
-        report_access_error(path, had_access_error, NULL);
-        *result = 0;
-        return;
+static int ctx_init_sync(scan_ctx_t *ctx) {
+    int errnum = pthread_mutex_init(&ctx->mutex, NULL);
+    if (errnum != 0) {
+        errno = errnum;
+        return -1;
+    }
+    pthread_condattr_t attr;
+    errnum = pthread_condattr_init(&attr);
+    if (errnum == 0) {
+        errnum = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        if (errnum == 0) {
+            errnum = pthread_cond_init(&ctx->cond, &attr);
+        }
+        pthread_condattr_destroy(&attr);
+    }
+    if (errnum != 0) {
+        pthread_mutex_destroy(&ctx->mutex);
+        errno = errnum;
+        return -1;
+    }
+    errnum = pthread_mutex_init(&ctx->size_mutex, NULL);
+    if (errnum != 0) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->mutex);
+        errno = errnum;
+        return -1;
+    }
+    errnum = pthread_mutex_init(&ctx->error_mutex, NULL);
+    if (errnum != 0) {
+        pthread_mutex_destroy(&ctx->size_mutex);
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->mutex);
+        errno = errnum;
+        return -1;
     }
+    return 0;
+}
 
-    size_t total_size = file_stat.st_blocks;
+/**
+ * @brief Stops and joins the first num_started workers and the tuner if it runs, then frees the context.
+ * No scan may be running or queued.
+ */
+static void ctx_teardown(scan_ctx_t *ctx, int num_started, int tuner_started) {
+    safe_lock(&ctx->mutex);
+    ctx->shutdown = 1;
+    ctx_broadcast(ctx);
+    safe_unlock(&ctx->mutex);
 
-    if (!S_ISDIR(file_stat.st_mode)) {
-        *result = total_size;
-        return;
+    for (int i = 0; i < num_started; i++) {
+        int errnum = pthread_join(ctx->threads[i], NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(errnum));
+        }
+    }
+    if (tuner_started) {
+        int errnum = pthread_join(ctx->tuner, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(errnum));
+        }
     }
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        report_access_error(path, had_access_error, NULL);
-        *result = total_size;
-        return;
+    if (ctx->tuned) {
+        pool_destroy(&ctx->pool);
     }
+    destroy_deques(ctx->deques, ctx->num_threads);
+    if (ctx->queue) {
+        queue_destroy(ctx->queue);
+    }
+    free(ctx->stack.items);
+    free(ctx->threads);
+    free(ctx->args);
+    free(ctx->places);
+    pthread_mutex_destroy(&ctx->error_mutex);
+    pthread_mutex_destroy(&ctx->size_mutex);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx);
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Returns the number of worker threads a context with num_threads creates.
+ * This is num_threads itself, or the most a SCAN_THREADS_AUTO context
+ * grows to, and the number of entries options->stats must hold.
+ */
+int scan_pool_size(int num_threads) {
+    return num_threads == SCAN_THREADS_AUTO ? AUTO_MAX_THREADS : num_threads;
+}
+
+/**
+ * @brief Worker thread function for directory traversal.
+ * Between scans, the worker waits for the context to start the next one.
+ * During a scan, it repeatedly takes an item from the configured engine:
+ * the stack of a single worker, the shared work queue, or its own deque
+ * with stealing from the other workers, once the scan's paths have been
+ * identified (see identify_roots()).
+ * Items are directories, apart from the scanned paths themselves, which
+ * may also be files. The worker opens each directory, stats the files in
+ * it and adds their sizes to its own counter per scanned path, which
+ * progress readers poll without locking, and publishes the
+ * subdirectories as new work; a directory with a valid cache entry is
+ * not read at all. Once the scan is cancelled, the remaining items are
+ * only freed.
+ * Access errors are reported and flagged, and the largest files and
+ * directories it finishes are kept in its own top-N collections when
+ * requested. When no work is left, the worker credits the hard-linked
+ * files still waiting for their owners (see credit_remaining_links()),
+ * merges its collections into the scan's in a thread-safe way and arrives at the end of the scan; the
+ * last worker to arrive sums the counters into the totals. With stats, the
+ * worker's counters, including its waits on the shared queue, are added
+ * to its own entry of options->stats.
+ */
+static void *worker_func(void *arg) {
+    thread_args_t *args = (thread_args_t *)arg;
+    unsigned long generation = 0;
+    scan_t *scan;
+    while ((scan = wait_for_scan(args->ctx, &generation)) != NULL) {
+        begin_worker_scan(args, scan);
+        identify_roots(args, scan);
+        scan_item_t *item;
+        while ((item = next_item(args)) != NULL) {
+            run_item(args, item);
         }
+        credit_remaining_links(args);
+        end_worker_scan(args);
+        arrive(args->ctx, scan);
+    }
 
-        char full_path[PATH_MAX];
-        int ret = snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-        if (ret >= (int)sizeof(full_path)) {
-            fprintf(stderr, "Filepath too long: %s/%s\n", path, entry->d_name);
-            *had_access_error = 1;
-            continue;
+    stat_batch_destroy(args->uring_batch);
+    free(args->record.links);
+    free(args->record.subdirs);
+    free(args->dents);
+    free(args->local.items);
+    return NULL;
+}
+
+/**
+ * @brief Creates a scan context with a pool of workers that stays up until it is destroyed.
+ * With a single worker, items are kept on a stack and worked on depth
+ * first, with no locking. Otherwise the workers use the given engine:
+ *   - ENGINE_QUEUE uses one shared work queue for all workers.
+ *   - ENGINE_STEAL gives every worker its own deque and lets idle workers
+ *     steal.
+ * With num_threads set to SCAN_THREADS_AUTO, AUTO_MAX_THREADS workers are
+ * created but only AUTO_MIN_THREADS take work at the start of each scan;
+ * a tuner thread then tunes how many are active (see tune_pool()) while
+ * the scan runs.
+ * Unless affinity is AFFINITY_NONE, every worker is started pinned to a
+ * CPU of its own (see affinity_place()). The shared queue then has a
+ * sub-queue per NUMA node the workers are on, and workers take from
+ * their own node's first; with the deques, thieves try the workers on
+ * their own node first.
+ * Returns NULL with errno set if the context cannot be set up.
+ */
+scan_ctx_t *scan_ctx_create(int num_threads, scan_engine_t engine, affinity_t affinity) {
+    scan_ctx_t *ctx = calloc(1, sizeof(scan_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    if (ctx_init_sync(ctx) == -1) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->tuned = num_threads == SCAN_THREADS_AUTO;
+    ctx->num_threads = scan_pool_size(num_threads);
+    ctx->engine = engine;
+    if (ctx->tuned) {
+        pool_init(&ctx->pool);
+    }
+    atomic_init(&ctx->active, 0);
+    ctx->places = malloc(ctx->num_threads * sizeof(cpu_place_t));
+    if (!ctx->places) {
+        ctx_teardown(ctx, 0, 0);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx->num_nodes = affinity_place(affinity, ctx->num_threads, ctx->places);
+    if (ctx->num_nodes == -1) {
+        int errnum = errno;
+        ctx_teardown(ctx, 0, 0);
+        errno = errnum;
+        return NULL;
+    }
+    if (ctx->num_threads > 1 && engine == ENGINE_STEAL) {
+        ctx->deques = calloc(ctx->num_threads, sizeof(ws_deque_t *));
+        if (!ctx->deques) {
+            ctx_teardown(ctx, 0, 0);
+            errno = ENOMEM;
+            return NULL;
         }
+        for (int i = 0; i < ctx->num_threads; i++) {
+            ctx->deques[i] = deque_create();
+        }
+    } else if (ctx->num_threads > 1) {
+        ctx->queue = queue_create(ctx->num_nodes);
+    }
 
-        size_t child_size = 0;
-        get_size(full_path, &child_size, had_access_error);
-        total_size += child_size;
+    ctx->threads = malloc(ctx->num_threads * sizeof(pthread_t));
+    ctx->args = calloc(ctx->num_threads, sizeof(thread_args_t));
+    if (!ctx->threads || !ctx->args) {
+        ctx_teardown(ctx, 0, 0);
+        errno = ENOMEM;
+        return NULL;
     }
 
-    if (closedir(dir) == -1) {
-        report_access_error(path, had_access_error, NULL);
+    for (int i = 0; i < ctx->num_threads; i++) {
+        thread_args_t *args = &ctx->args[i];
+        args->ctx = ctx;
+        args->engine = engine;
+        args->stack = ctx->num_threads == 1 ? &ctx->stack : NULL;
+        args->queue = ctx->queue;
+        args->deques = ctx->deques;
+        args->id = i;
+        args->num_threads = ctx->num_threads;
+        args->node = ctx->places[i].node;
+        args->places = ctx->num_nodes > 1 ? ctx->places : NULL;
+        args->active = &ctx->active;
+        args->seed = (unsigned int)i * 2654435761u + 1;
+        args->size_mutex = &ctx->size_mutex;
+        args->error_mutex = &ctx->error_mutex;
+        args->pool = ctx->tuned ? &ctx->pool : NULL;
+        atomic_init(&args->progress, 0);
+        atomic_init(&args->published, 0);
+        atomic_init(&args->finished, 0);
+        atomic_init(&args->idle_ns, 0);
     }
 
-    *result = total_size;
+    for (int i = 0; i < ctx->num_threads; i++) {
+        pthread_attr_t attr;
+        int pinned = ctx->places[i].cpu >= 0;
+        int errnum = pinned ? affinity_attr_init(&attr, ctx->places[i].cpu) : 0;
+        if (errnum == 0) {
+            errnum = pthread_create(&ctx->threads[i], pinned ? &attr : NULL, worker_func, &ctx->args[i]);
+            if (pinned) {
+                pthread_attr_destroy(&attr);
+            }
+        }
+        if (errnum != 0) {
+            ctx_teardown(ctx, i, 0);
+            errno = errnum;
+            return NULL;
+        }
+    }
+    if (ctx->tuned) {
+        int errnum = pthread_create(&ctx->tuner, NULL, tuner_func, ctx);
+        if (errnum != 0) {
+            ctx_teardown(ctx, ctx->num_threads, 0);
+            errno = errnum;
+            return NULL;
+        }
+    }
+    return ctx;
 }
 
 /**
- * @brief Calculates the disk usage of a path using multiple threads.
- * This function sets up a work queue and pushes the initial path onto it.
- * It initializes mutexes and creates the specified number of worker threads.
- * Each thread processes files and directories from the queue in parallel.
- * After all threads finish, it cleans up resources and returns the total size.
- * Any access errors encountered are reported and flagged.
+ * @brief Submits a scan of one or more paths to a context.
+ * The scan starts right away if the context is idle, and otherwise once
+ * the scans submitted before it are done. The paths and options are
+ * copied; what the options point to (cache, heaps, stats, filters) must
+ * stay valid until the scan completes. Every item carries the index of
+ * the path it is under, so a separate total is kept for each path.
+ * Unless options->count_links is set, everything is counted once over
+ * all paths, like du does: a hard-linked file counts for the first path,
+ * in the order given, that one of its links is under (see
+ * count_blocks()), an entry that is an earlier path is skipped, and a
+ * path that is below or the same as an earlier one is covered by it and
+ * totals zero (see scan_path_covered()). Totals do not depend on the
+ * number of workers or their timing, and neither do directory totals or
+ * the largest files: a hard-linked file is credited to the directory of
+ * the link du counts (see count_file()).
+ * With options->dir_total, each directory's total is summed into its parent
+ * as its subtree finishes and reported right then, by whichever worker
+ * finished the last entry below it.
+ * With options->top_files and options->top_dirs, every worker keeps its
+ * own bounded heap of the largest files and directories, and the heaps
+ * are merged into them as the workers finish.
+ * With options->stats, which must then hold scan_pool_size(num_threads)
+ * entries, worker i adds its counters to options->stats[i].
+ * With options->memory_limit, workers of the shared queue keep new work
+ * local once the queued items reach the limit; see update_capped(). A
+ * single worker and the work-stealing engine ignore it.
+ * done, if given, is called with the result on the worker that completes
+ * the scan. The returned handle must be given back with scan_release().
+ * Returns NULL with errno set if the scan cannot be set up.
  */
-void get_size_parallel(const char *path, int num_threads, size_t *result, int *had_access_error) {
-    work_queue_t *queue = queue_create();
-    queue_push(queue, path);
+scan_t *scan_submit(scan_ctx_t *ctx, char *const *paths, int num_paths, const scan_options_t *options,
+                    scan_done_fn done, void *done_context) {
+    scan_t *scan = calloc(1, sizeof(scan_t));
+    if (!scan) {
+        return NULL;
+    }
+    size_t num_counters = (size_t)ctx->num_threads * num_paths;
+    scan->paths = calloc(num_paths, sizeof(char *));
+    scan->num_paths = scan->paths ? num_paths : 0;
+    int copied = scan->paths != NULL;
+    for (int i = 0; i < scan->num_paths; i++) {
+        scan->paths[i] = strdup(paths[i]);
+        copied = copied && scan->paths[i];
+    }
+    scan->totals = calloc(num_paths, sizeof(size_t));
+    scan->worker_blocks = calloc(num_counters, sizeof(atomic_ullong));
+    scan->worker_published = calloc(num_counters, sizeof(atomic_ullong));
+    scan->worker_finished = calloc(num_counters, sizeof(atomic_ullong));
+    scan->covered = calloc(num_paths, sizeof(atomic_int));
+    if (!copied || !scan->totals || !scan->worker_blocks || !scan->worker_published || !scan->worker_finished ||
+        !scan->covered) {
+        scan_free(scan);
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    size_t total_size = 0;
-    pthread_mutex_t size_mutex, error_mutex;
+    scan->ctx = ctx;
+    scan->options = *options;
+    scan->done = done;
+    scan->done_context = done_context;
+    atomic_init(&scan->cancelled, 0);
+    scan->rollup.done = options->dir_total || options->top_dirs ? report_dir_total : NULL;
+    scan->rollup.error = report_close_error;
+    scan->rollup.context = &scan->options;
+    if (ctx->num_threads > 1 && (options->device_workers > 0 || options->num_devices > 0)) {
+        scan->devices = device_budget_create(options->device_workers);
+        for (int i = 0; i < options->num_devices; i++) {
+            device_budget_set(scan->devices, options->devices[i].dev, options->devices[i].max_workers);
+        }
+    }
+    scan->options.devices = NULL;
+    scan->options.num_devices = 0;
 
-    int errnum = pthread_mutex_init(&size_mutex, NULL);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
-        queue_destroy(queue);
-        exit(EXIT_FAILURE);
+    safe_lock(&ctx->mutex);
+    if (!ctx->current) {
+        start_scan_locked(ctx, scan);
+    } else {
+        scan->state = SCAN_QUEUED;
+        if (ctx->first_queued) {
+            ctx->last_queued->next = scan;
+        } else {
+            ctx->first_queued = scan;
+        }
+        ctx->last_queued = scan;
     }
+    safe_unlock(&ctx->mutex);
+    return scan;
+}
 
-    errnum = pthread_mutex_init(&error_mutex, NULL);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
-        pthread_mutex_destroy(&size_mutex);
-        queue_destroy(queue);
-        exit(EXIT_FAILURE);
+/**
+ * @brief Polls where a scan stands and how much it has counted so far.
+ * The counts are only exact once the scan has finished; while it runs,
+ * they lag slightly behind the workers, and the directories pending
+ * include those being read.
+ */
+void scan_progress(scan_t *scan, scan_progress_t *progress) {
+    scan_ctx_t *ctx = scan->ctx;
+    safe_lock(&ctx->mutex);
+    progress->state = scan->state;
+    if (scan->state == SCAN_RUNNING) {
+        read_progress(scan, progress);
+    } else {
+        progress->entries = scan->entries;
+        progress->blocks = scan->blocks;
+        progress->pending = scan->state == SCAN_QUEUED ? (uint64_t)scan->num_paths : 0;
     }
+    safe_unlock(&ctx->mutex);
+}
 
-    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
-    thread_args_t *args = malloc(num_threads * sizeof(thread_args_t));
+/**
+ * @brief Stores the total counted so far under each path of a scan in totals.
+ * Only reads the workers' counters, without taking any lock, so it is
+ * cheap enough to poll often and works even if the workers are stuck.
+ * The totals mostly grow while the scan runs; a path's total drops when a
+ * hard link it counted turns up under an earlier path, or when it turns
+ * out to be covered by one. They are exact once the scan has finished,
+ * unless it was cancelled.
+ */
+void scan_partial_totals(scan_t *scan, size_t *totals) {
+    sum_worker_blocks(scan, totals);
+}
 
-    if (!threads || !args) {
-        perror("malloc");
-        free_and_destroy_mutex(threads, args, &size_mutex, &error_mutex, queue);
-        exit(EXIT_FAILURE);
+/**
+ * @brief Returns non-zero if everything under a path of a scan has been counted.
+ * Like scan_partial_totals(), only reads the workers' counters. A path is
+ * done once every item under it that was published has finished, the
+ * path itself included. The counters of finished items are read before
+ * those of published ones: an item finishes after the items it led to
+ * were published, so a path whose items are not all finished never
+ * looks done.
+ */
+int scan_path_done(scan_t *scan, int index) {
+    uint64_t finished = 0;
+    uint64_t published = 1;
+    for (int worker = 0; worker < scan->ctx->num_threads; worker++) {
+        finished += atomic_load_explicit(&scan->worker_finished[(size_t)worker * scan->num_paths + index],
+                                         memory_order_acquire);
     }
+    for (int worker = 0; worker < scan->ctx->num_threads; worker++) {
+        published += atomic_load_explicit(&scan->worker_published[(size_t)worker * scan->num_paths + index],
+                                          memory_order_acquire);
+    }
+    return finished == published;
+}
 
-    for (int i = 0; i < num_threads; i++) {
-        args[i].queue = queue;
-        args[i].total_size = &total_size;
-        args[i].size_mutex = &size_mutex;
-        args[i].had_access_error = had_access_error;
-        args[i].error_mutex = &error_mutex;
+/**
+ * @brief Returns non-zero if a path of a scan was covered by an earlier one.
+ * A covered path is below or the same as an earlier path and was counted
+ * with it; du prints no line for it. Only final once the scan has
+ * finished.
+ */
+int scan_path_covered(scan_t *scan, int index) {
+    return atomic_load_explicit(&scan->covered[index], memory_order_relaxed);
+}
+
+/**
+ * @brief Asks a scan to stop early.
+ * The workers stop listing and drop the items left, so the scan
+ * finishes soon with incomplete totals. A queued scan finishes as soon
+ * as it starts.
+ */
+void scan_cancel(scan_t *scan) {
+    atomic_store(&scan->cancelled, 1);
+}
 
-        int errnum = pthread_create(&threads[i], NULL, worker_func, &args[i]);
+/**
+ * @brief Waits for a scan to finish.
+ * The total of each path is stored in totals, if given, and
+ * *had_access_error is set if some entry could not be examined. Must not
+ * be called from a completion callback. Returns -1 if the scan was
+ * cancelled, 0 otherwise.
+ */
+int scan_wait(scan_t *scan, size_t *totals, int *had_access_error) {
+    scan_ctx_t *ctx = scan->ctx;
+    safe_lock(&ctx->mutex);
+    while (scan->state != SCAN_FINISHED) {
+        int errnum = pthread_cond_wait(&ctx->cond, &ctx->mutex);
         if (errnum != 0) {
-            fprintf(stderr, "pthread_create: %s\n", strerror(errnum));
-            free_and_destroy_mutex(threads, args, &size_mutex, &error_mutex, queue);
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
             exit(EXIT_FAILURE);
         }
     }
+    safe_unlock(&ctx->mutex);
 
-    for (int i = 0; i < num_threads; i++) {
+    if (totals) {
+        memcpy(totals, scan->totals, scan->num_paths * sizeof(size_t));
+    }
+    if (scan->had_access_error) {
+        *had_access_error = 1;
+    }
+    return atomic_load(&scan->cancelled) ? -1 : 0;
+}
+
+/**
+ * @brief Waits at most seconds for a scan to finish.
+ * Returns 1 if it has finished, 0 if the time ran out first. The results
+ * are then read with scan_wait(), which no longer blocks.
+ */
+int scan_wait_timeout(scan_t *scan, double seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    time_t whole = (time_t)seconds;
+    deadline.tv_sec += whole;
+    deadline.tv_nsec += (long)((seconds - (double)whole) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-        int errnum = pthread_join(threads[i], NULL);
+    scan_ctx_t *ctx = scan->ctx;
+    safe_lock(&ctx->mutex);
+    while (scan->state != SCAN_FINISHED) {
+        int errnum = pthread_cond_timedwait(&ctx->cond, &ctx->mutex, &deadline);
+        if (errnum == ETIMEDOUT) {
+            break;
+        }
         if (errnum != 0) {
-            fprintf(stderr, "pthread_join: %s\n", strerror(errnum));
+            fprintf(stderr, "pthread_cond_timedwait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    int finished = scan->state == SCAN_FINISHED;
+    safe_unlock(&ctx->mutex);
+    return finished;
+}
+
+/**
+ * @brief Gives back the handle of a scan.
+ * A finished scan is freed right away, a queued or running one once it
+ * completes. The handle must not be used afterwards.
+ */
+void scan_release(scan_t *scan) {
+    scan_ctx_t *ctx = scan->ctx;
+    safe_lock(&ctx->mutex);
+    int finished = scan->state == SCAN_FINISHED;
+    scan->released = 1;
+    safe_unlock(&ctx->mutex);
+    if (finished) {
+        scan_free(scan);
+    }
+}
+
+/**
+ * @brief Waits for the scans submitted to a context to complete, then stops its workers and frees it.
+ */
+void scan_ctx_destroy(scan_ctx_t *ctx) {
+    safe_lock(&ctx->mutex);
+    while (ctx->current || ctx->first_queued) {
+        int errnum = pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
         }
     }
+    safe_unlock(&ctx->mutex);
+    ctx_teardown(ctx, ctx->num_threads, ctx->tuned);
+}
+
+/**
+ * @brief Calculates the disk usage of a path (single-threaded).
+ * Runs one scan on a context with a single worker, which keeps the
+ * directories still to be listed on a stack and works on them depth
+ * first instead of by recursion, so the depth of the tree is not limited
+ * by the call stack; see scan_submit() for the options.
+ */
+void get_size(const char *path, const scan_options_t *options, size_t *result, int *had_access_error) {
+    char *paths[] = {(char *)path};
+    get_sizes_parallel(paths, 1, 1, options, result, had_access_error);
+}
 
-    free_and_destroy_mutex(threads, args, &size_mutex, &error_mutex, queue);
+/**
+ * @brief Calculates the disk usage of several paths with one pool of threads.
+ * Runs one scan of all paths on a context of its own with num_threads
+ * workers and options->engine, and waits for it; results[i] receives the
+ * total of paths[i]. See scan_ctx_create() and scan_submit().
+ * Exits the program if the context or the scan cannot be set up.
+ */
+void get_sizes_parallel(char *const *paths, int num_paths, int num_threads, const scan_options_t *options,
+                        size_t *results, int *had_access_error) {
+    scan_ctx_t *ctx = scan_ctx_create(num_threads, options->engine, options->affinity);
+    if (!ctx) {
+        perror("scan_ctx_create");
+        exit(EXIT_FAILURE);
+    }
+    scan_t *scan = scan_submit(ctx, paths, num_paths, options, NULL, NULL);
+    if (!scan) {
+        perror("scan_submit");
+        exit(EXIT_FAILURE);
+    }
+    scan_wait(scan, results, had_access_error);
+    scan_release(scan);
+    scan_ctx_destroy(ctx);
+}
 
-    *result = total_size;
+/**
+ * @brief Calculates the disk usage of a path using multiple threads.
+ * A pool of num_threads workers scans the single path; see get_sizes_parallel().
+ */
+void get_size_parallel(const char *path, int num_threads, const scan_options_t *options, size_t *result,
+                       int *had_access_error) {
+    char *paths[] = {(char *)path};
+    get_sizes_parallel(paths, 1, num_threads, options, result, had_access_error);
 }
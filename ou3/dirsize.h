@@ -3,14 +3,183 @@
  * @brief Small public API for computing disk usage in 512-byte blocks.
  * @date 2025-11-19
  * @author Bran Mjöberg Quanne
+ *
+ * A scan context owns a pool of worker threads that stays up between
+ * scans. Scans are submitted to it and run one after the other; the
+ * caller can poll their progress, cancel them, wait for them or be called
+ * back when they complete. Problems found while scanning go to an error
+ * callback instead of stderr. get_size() and get_sizes_parallel() wrap
+ * this in a blocking call with a context of their own.
  */
 
 #ifndef DIRSIZE_H
 #define DIRSIZE_H
 
+#include "cpu_affinity.h"
+#include "name_filter.h"
+#include "scan_cache.h"
+#include "top_n.h"
 #include <stddef.h>
+#include <stdint.h>
 
-void get_size(const char *path, size_t *result, int *had_access_error);
-void get_size_parallel(const char *path, int num_threads, size_t *result, int *had_access_error);
+/**
+ * @brief Scheduling engine of a scan context's workers.
+ */
+typedef enum {
+    ENGINE_QUEUE, /**< One shared, mutex-protected work queue */
+    ENGINE_STEAL  /**< Per-worker deques with work stealing */
+} scan_engine_t;
+
+/**
+ * @struct dir_summary_t
+ * @brief What a scan found directly inside one directory.
+ */
+typedef struct {
+    const char *path;     /**< Path of the directory, starting with the scanned path */
+    unsigned int depth;   /**< Levels below the scanned path, the number of names after it in path */
+    uint64_t dev;         /**< Device of the directory */
+    uint64_t ino;         /**< Inode of the directory */
+    uint64_t dir_blocks;  /**< Blocks of the directory itself */
+    uint64_t file_blocks; /**< Blocks of the non-directory entries in it, every hard link counted */
+    int complete;         /**< Zero if some entry could not be examined */
+} dir_summary_t;
+
+/**
+ * @brief Called once for every directory a scan lists.
+ * Parallel scans call it from several worker threads at once, in no
+ * particular order; the summary is only valid during the call.
+ */
+typedef void (*dir_visit_fn)(const dir_summary_t *summary, void *context);
+
+/**
+ * @brief Called with the total of a directory once everything below it has been counted.
+ * Directories finish in post-order, children before their parent. Parallel
+ * scans call it from several worker threads at once.
+ */
+typedef void (*dir_total_fn)(const char *path, size_t blocks, void *context);
+
+/**
+ * @brief Called for every problem a scan runs into, in place of a message on stderr.
+ * errnum is the errno value of a failed call on path, or 0 for a problem
+ * described by message, which is NULL otherwise. Parallel scans call it
+ * from several worker threads at once.
+ */
+typedef void (*scan_error_fn)(const char *path, int errnum, const char *message, void *context);
+
+/**
+ * @struct scan_thread_stats_t
+ * @brief What one worker of a scan did and where its time went.
+ * Scans add to the counters, so one array can be passed to several scans.
+ */
+typedef struct {
+    uint64_t entries;    /**< Entries stat'ed, scanned paths included */
+    uint64_t dirs;       /**< Directories opened and listed */
+    uint64_t stat_ns;    /**< Time in lstat (fstatat) and io_uring stat batches */
+    uint64_t readdir_ns; /**< Time opening and reading directories */
+    uint64_t wait_ns;    /**< Time blocked or spinning while waiting for work */
+    uint64_t lock_ns;    /**< Time waiting for the shared queue's mutex */
+    uint64_t peak_queue; /**< Deepest queue (or own deque) seen right after a push */
+} scan_thread_stats_t;
+
+/**
+ * @struct device_limit_t
+ * @brief Most workers of a scan that may be busy on one device at once.
+ */
+typedef struct {
+    uint64_t dev;    /**< Device the limit applies to */
+    int max_workers; /**< Most workers busy with the device's directories, 0 for no limit */
+} device_limit_t;
+
+/**
+ * @struct scan_options_t
+ * @brief Options controlling how a tree is traversed.
+ */
+typedef struct {
+    scan_engine_t engine;          /**< Scheduling engine for the context of get_sizes_parallel */
+    affinity_t affinity;           /**< Placement of the workers of the context of get_sizes_parallel */
+    int use_uring;                 /**< Batch stat calls through io_uring when available */
+    int count_links;               /**< Count every hard link instead of each inode once */
+    scan_cache_t *cache;           /**< Per-directory cache to use and update, or NULL */
+    int verify_cache;              /**< Read every directory and report stale cache entries */
+    dir_visit_fn visit;            /**< Called for every directory listed, or NULL */
+    void *visit_context;           /**< Passed to visit */
+    dir_total_fn dir_total;        /**< Called for finished directories down to dir_total_depth, or NULL */
+    int dir_total_depth;           /**< Deepest level below the scanned path passed to dir_total */
+    void *dir_total_context;       /**< Passed to dir_total */
+    scan_thread_stats_t *stats;    /**< One entry per thread to add counters to, or NULL to not measure */
+    size_t memory_limit;           /**< Bytes the shared queue may take before workers keep work local, 0 for none */
+    top_n_t *top_files;            /**< Receives the largest files found, or NULL */
+    top_n_t *top_dirs;             /**< Receives the largest directories below the scanned paths, or NULL */
+    const name_filter_t *exclude;  /**< Entries whose names match are skipped with their subtrees, or NULL */
+    int one_file_system;           /**< Skip directories on other devices than their scanned path */
+    scan_error_fn error;           /**< Called for problems found while scanning, or NULL to print them */
+    void *error_context;           /**< Passed to error */
+    int device_workers;            /**< Most workers busy on each device at once, 0 for no limit */
+    const device_limit_t *devices; /**< Limits of single devices, overriding device_workers */
+    int num_devices;               /**< Number of devices */
+} scan_options_t;
+
+/**
+ * @struct scan_result_t
+ * @brief Outcome of a scan, passed to its completion callback.
+ */
+typedef struct {
+    char *const *paths;   /**< The scanned paths */
+    const size_t *totals; /**< Total of each path, in blocks */
+    int num_paths;        /**< Number of paths */
+    int had_access_error; /**< Set if some entry could not be examined */
+    int cancelled;        /**< Set if the scan was cancelled; the totals are then incomplete */
+} scan_result_t;
+
+/**
+ * @brief Called on a worker thread once a scan has completed.
+ * The result is only valid during the call.
+ */
+typedef void (*scan_done_fn)(const scan_result_t *result, void *context);
+
+/**
+ * @brief Where a submitted scan stands.
+ */
+typedef enum {
+    SCAN_QUEUED,  /**< Waiting for the scans submitted before it */
+    SCAN_RUNNING, /**< Being worked on */
+    SCAN_FINISHED /**< Complete or cancelled */
+} scan_state_t;
+
+/**
+ * @struct scan_progress_t
+ * @brief Progress of a scan, as polled with scan_progress().
+ */
+typedef struct {
+    scan_state_t state; /**< Where the scan stands */
+    uint64_t entries;   /**< Entries stat'ed so far */
+    uint64_t blocks;    /**< Blocks counted so far, over all paths */
+    uint64_t pending;   /**< Directories published but not yet finished */
+} scan_progress_t;
+
+typedef struct scan_ctx scan_ctx_t;
+typedef struct scan scan_t;
+
+/** Passed as num_threads to have a parallel scan tune its number of workers while it runs. */
+#define SCAN_THREADS_AUTO 0
+
+int scan_pool_size(int num_threads);
+scan_ctx_t *scan_ctx_create(int num_threads, scan_engine_t engine, affinity_t affinity);
+scan_t *scan_submit(scan_ctx_t *ctx, char *const *paths, int num_paths, const scan_options_t *options,
+                    scan_done_fn done, void *done_context);
+void scan_progress(scan_t *scan, scan_progress_t *progress);
+void scan_partial_totals(scan_t *scan, size_t *totals);
+int scan_path_done(scan_t *scan, int index);
+int scan_path_covered(scan_t *scan, int index);
+void scan_cancel(scan_t *scan);
+int scan_wait_timeout(scan_t *scan, double seconds);
+int scan_wait(scan_t *scan, size_t *totals, int *had_access_error);
+void scan_release(scan_t *scan);
+void scan_ctx_destroy(scan_ctx_t *ctx);
+void get_size(const char *path, const scan_options_t *options, size_t *result, int *had_access_error);
+void get_size_parallel(const char *path, int num_threads, const scan_options_t *options, size_t *result,
+                       int *had_access_error);
+void get_sizes_parallel(char *const *paths, int num_paths, int num_threads, const scan_options_t *options,
+                        size_t *results, int *had_access_error);
 
 #endif // !DIRSIZE_H
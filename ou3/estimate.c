@@ -0,0 +1,427 @@
+/**
+ * @file estimate.c
+ * @brief Implementation of the sampling estimate of a tree's disk usage.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * A walk starts at the scanned path. In every directory it adds what the
+ * directory holds itself, times the product of the numbers of choices
+ * made on the way, and goes on into one subdirectory picked at random;
+ * the sum is an unbiased estimate of the total (Knuth, 1975).
+ *
+ * The directories read are kept in a tree, so a directory is listed at
+ * most once however many walks pass through it. Once everything below a
+ * directory has been read, its exact total is known; it is then counted
+ * exactly by the walks through its parent and no longer picked, which
+ * makes the estimate converge to the exact total as the tree is read.
+ * The subdirectories of a complete directory are freed, so memory grows
+ * with the frontier of the walks and not with the tree.
+ *
+ * A hard-linked file counts in the first directory read that holds one
+ * of its links, so a tree read completely totals like a scan. While
+ * sampling, the links in directories not read yet are extrapolated as if
+ * none had been seen.
+ */
+
+#define _GNU_SOURCE
+#include "estimate.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** Walks taken before the confidence interval is trusted to end the estimate. */
+#define MIN_SAMPLES 32
+
+/** Standard normal quantile of a two-sided 95% confidence interval. */
+#define Z_95 1.959964
+
+/**
+ * @struct est_node
+ * @brief A directory met by the walks.
+ */
+typedef struct est_node {
+    struct est_node *parent;    /**< Parent directory, NULL for the scanned path */
+    struct est_node **children; /**< Subdirectories once listed, incomplete ones first */
+    uint32_t num_children;      /**< Entries in children */
+    uint32_t num_complete;      /**< Complete subdirectories, kept at the end of children */
+    uint32_t index;             /**< Position in the parent's children */
+    uint32_t depth;             /**< Levels below the scanned path */
+    int listed;                 /**< Set once the directory has been read */
+    int complete;               /**< Set once everything below the directory has been read */
+    double known;               /**< Blocks of the directory, its other entries and its complete subdirectories */
+    char name[];                /**< Entry name, or the scanned path as given */
+} est_node_t;
+
+/**
+ * @struct estimator_t
+ * @brief State of one estimate.
+ */
+typedef struct {
+    const estimate_options_t *options; /**< Stop rule and filters */
+    int root_fd;                       /**< Open descriptor of the scanned path */
+    uint64_t root_dev;                 /**< Device of the scanned path */
+    uint64_t rng;                      /**< State of the xorshift generator picking subdirectories */
+    uint64_t dirs_read;                /**< Directories listed */
+    int *had_access_error;             /**< Set when an entry could not be examined */
+} estimator_t;
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Returns a random number below bound, which must not be 0.
+ */
+static uint32_t random_below(estimator_t *est, uint32_t bound) {
+    est->rng ^= est->rng >> 12;
+    est->rng ^= est->rng << 25;
+    est->rng ^= est->rng >> 27;
+    return (uint32_t)((est->rng * 0x2545F4914F6CDD1DULL >> 32) % bound);
+}
+
+/**
+ * @brief Creates a node for a directory with blocks of its own.
+ * Exits the program if allocation fails.
+ */
+static est_node_t *node_create(est_node_t *parent, const char *name, double blocks) {
+    size_t length = strlen(name) + 1;
+    est_node_t *node = calloc(1, sizeof(est_node_t) + length);
+    if (!node) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 0;
+    node->known = blocks;
+    memcpy(node->name, name, length);
+    return node;
+}
+
+/**
+ * @brief Reports an entry of node that could not be examined and flags the error.
+ * The full path is only assembled here, on the error path.
+ */
+static void report_error(estimator_t *est, const est_node_t *node, const char *name) {
+    int errnum = errno;
+    size_t length = strlen(name) + 1;
+    for (const est_node_t *n = node; n; n = n->parent) {
+        length += strlen(n->name) + 1;
+    }
+    char *path = malloc(length);
+    if (path) {
+        size_t pos = length - strlen(name) - 1;
+        memcpy(path + pos, name, strlen(name) + 1);
+        for (const est_node_t *n = node; n; n = n->parent) {
+            size_t part = strlen(n->name);
+            path[--pos] = '/';
+            pos -= part;
+            memcpy(path + pos, n->name, part);
+        }
+    }
+    fprintf(stderr, "%s: %s\n", path ? path : name, strerror(errnum));
+    free(path);
+    *est->had_access_error = 1;
+}
+
+/**
+ * @brief Marks a node complete and completes its ancestors whose subdirectories all are.
+ * The node's total is added to its parent's known blocks, and the node
+ * moves to the complete end of the parent's children. Its own children
+ * are freed, as walks no longer enter it.
+ */
+static void node_complete(est_node_t *node) {
+    while (node) {
+        node->complete = 1;
+        for (uint32_t i = 0; i < node->num_children; i++) {
+            free(node->children[i]);
+        }
+        free(node->children);
+        node->children = NULL;
+        node->num_children = 0;
+        node->num_complete = 0;
+
+        est_node_t *parent = node->parent;
+        if (!parent) {
+            return;
+        }
+        parent->known += node->known;
+        uint32_t last = parent->num_children - parent->num_complete - 1;
+        est_node_t *swap = parent->children[last];
+        parent->children[last] = node;
+        parent->children[node->index] = swap;
+        swap->index = node->index;
+        node->index = last;
+        if (++parent->num_complete < parent->num_children) {
+            return;
+        }
+        node = parent;
+    }
+}
+
+/**
+ * @brief Adds a subdirectory with blocks of its own to a node being listed.
+ */
+static void node_add_child(est_node_t *node, const char *name, double blocks, uint32_t *capacity) {
+    if (node->num_children == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        est_node_t **children = realloc(node->children, *capacity * sizeof(est_node_t *));
+        if (!children) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        node->children = children;
+    }
+    est_node_t *child = node_create(node, name, blocks);
+    child->index = node->num_children;
+    node->children[node->num_children++] = child;
+}
+
+/**
+ * @brief Returns the blocks a file adds, 0 for a hard link already counted.
+ */
+static double file_blocks(const estimator_t *est, const struct stat *file_stat) {
+    if (!est->options->links || file_stat->st_nlink <= 1 ||
+        inode_set_insert(est->options->links, file_stat->st_dev, file_stat->st_ino) != 0) {
+        return file_stat->st_blocks;
+    }
+    return 0;
+}
+
+/**
+ * @brief Lists a directory through fd, which is left open.
+ * Every entry is stat'ed: the blocks of files and other non-directories
+ * are added to the node, see file_blocks(), and each subdirectory becomes a child carrying
+ * its own blocks. Subdirectories on other devices are left out with -x,
+ * like entries matching an exclude pattern.
+ */
+static void node_list(estimator_t *est, est_node_t *node, int fd) {
+    node->listed = 1;
+    est->dirs_read++;
+    int list_fd = dup(fd);
+    DIR *dir = list_fd == -1 ? NULL : fdopendir(list_fd);
+    if (!dir) {
+        report_error(est, node->parent, node->name);
+        if (list_fd != -1) {
+            close(list_fd);
+        }
+        return;
+    }
+
+    uint32_t capacity = 0;
+    struct dirent *entry;
+    for (;;) {
+        errno = 0;
+        entry = readdir(dir);
+        if (!entry) {
+            if (errno != 0) {
+                report_error(est, node->parent, node->name);
+            }
+            break;
+        }
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (est->options->exclude && name_filter_match(est->options->exclude, name)) {
+            continue;
+        }
+
+        struct stat file_stat;
+        if (fstatat(fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            report_error(est, node, name);
+            continue;
+        }
+        if (!S_ISDIR(file_stat.st_mode)) {
+            node->known += file_blocks(est, &file_stat);
+        } else if (!est->options->one_file_system || (uint64_t)file_stat.st_dev == est->root_dev) {
+            node_add_child(node, name, file_stat.st_blocks, &capacity);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Opens a directory below the scanned path by walking down from it.
+ * The directories on the way are opened with O_PATH, which is enough to
+ * resolve names against. Returns -1 with errno set on failure.
+ */
+static int node_open(estimator_t *est, const est_node_t *node) {
+    const est_node_t **chain = malloc((node->depth + 1) * sizeof(est_node_t *));
+    if (!chain) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (const est_node_t *n = node; n->parent; n = n->parent) {
+        chain[n->depth] = n;
+    }
+
+    int fd = est->root_fd;
+    for (uint32_t depth = 1; depth <= node->depth && fd != -1; depth++) {
+        int flags = O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC | (depth < node->depth ? O_PATH : O_RDONLY);
+        int next = openat(fd, chain[depth]->name, flags);
+        if (fd != est->root_fd) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        }
+        fd = next;
+    }
+    free(chain);
+    return fd;
+}
+
+/**
+ * @brief Takes one random walk from the root and returns its estimate of the total.
+ * Directories not read yet are listed on the way. A walk that has just
+ * listed a directory opens the next one relative to it; otherwise the
+ * next one is opened from the scanned path. The walk ends in a directory
+ * without subdirectories left to pick, which is then complete.
+ */
+static double sample(estimator_t *est, est_node_t *root) {
+    double weight = 1;
+    double value = 0;
+    est_node_t *node = root;
+    int fd = est->root_fd;
+    for (;;) {
+        if (!node->listed) {
+            node_list(est, node, fd);
+        }
+        value += weight * node->known;
+        if (node->num_complete == node->num_children) {
+            node_complete(node);
+            break;
+        }
+
+        uint32_t choices = node->num_children - node->num_complete;
+        est_node_t *child = node->children[random_below(est, choices)];
+        weight *= choices;
+        int child_fd = -1;
+        if (!child->listed) {
+            child_fd = fd != -1 ? openat(fd, child->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+                                : node_open(est, child);
+            if (child_fd == -1) {
+                report_error(est, node, child->name);
+                child->listed = 1;
+            }
+        }
+        if (fd != est->root_fd && fd != -1) {
+            close(fd);
+        }
+        fd = child_fd;
+        node = child;
+    }
+    if (fd != est->root_fd && fd != -1) {
+        close(fd);
+    }
+    return value;
+}
+
+/**
+ * @brief Frees the nodes still in the tree, without recursion.
+ */
+static void tree_free(est_node_t *node) {
+    while (node) {
+        if (node->num_children > 0) {
+            node = node->children[--node->num_children];
+            continue;
+        }
+        est_node_t *parent = node->parent;
+        free(node->children);
+        free(node);
+        node = parent;
+    }
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Estimates the disk usage of path from random walks through it.
+ *
+ * Walks are taken until the 95% confidence interval is within
+ * options->target_error of the estimate (after at least MIN_SAMPLES
+ * walks), until options->time_budget seconds have passed, or until the
+ * whole tree has been read, whichever comes first; with neither limit
+ * set, the tree is read completely. The interval assumes the mean of the
+ * walks to be normally distributed, which holds for many walks; trees
+ * whose size hides in a few deep corners can still fool it. With
+ * options->links, a hard-linked file only counts the first time one of
+ * its links is read, also over several calls sharing the set; without
+ * it, every link counts. A path that is not a directory is counted
+ * exactly.
+ * Access errors are reported and flagged.
+ */
+void estimate_size(const char *path, const estimate_options_t *options, estimate_t *result, int *had_access_error) {
+    *result = (estimate_t){0};
+    struct stat root_stat;
+    if (lstat(path, &root_stat) == -1) {
+        perror(path);
+        *had_access_error = 1;
+        result->exact = 1;
+        return;
+    }
+    estimator_t est = {.options = options,
+                       .root_fd = -1,
+                       .root_dev = root_stat.st_dev,
+                       .rng = (uint64_t)(now() * 1e9) | 1,
+                       .dirs_read = 0,
+                       .had_access_error = had_access_error};
+    if (!S_ISDIR(root_stat.st_mode)) {
+        result->blocks = file_blocks(&est, &root_stat);
+        result->exact = 1;
+        return;
+    }
+
+    est.root_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    est_node_t *root = node_create(NULL, path, root_stat.st_blocks);
+    if (est.root_fd == -1) {
+        perror(path);
+        *had_access_error = 1;
+        root->listed = 1;
+        node_complete(root);
+    }
+
+    double start = now();
+    double mean = 0;
+    double m2 = 0;
+    uint64_t count = 0;
+    double margin = 0;
+    while (!root->complete) {
+        double value = sample(&est, root);
+        count++;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+        margin = count > 1 ? Z_95 * sqrt(m2 / (count - 1) / count) : 0;
+
+        if (count >= MIN_SAMPLES && options->target_error > 0 && margin <= options->target_error * mean) {
+            break;
+        }
+        if (options->time_budget > 0 && now() - start >= options->time_budget) {
+            break;
+        }
+    }
+
+    result->samples = count;
+    result->dirs_read = est.dirs_read;
+    result->exact = root->complete;
+    result->blocks = root->complete ? root->known : mean;
+    result->margin = root->complete ? 0 : margin;
+    if (est.root_fd != -1) {
+        close(est.root_fd);
+    }
+    tree_free(root);
+}
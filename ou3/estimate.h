@@ -0,0 +1,49 @@
+/**
+ * @file estimate.h
+ * @brief Estimates the disk usage of a tree by sampling random paths through it.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Instead of visiting every directory, the estimator repeatedly walks
+ * down from the scanned path to a random leaf (Knuth's tree-size
+ * estimator) and extrapolates the total from the directories on the way.
+ * Every walk is an unbiased estimate of the total; their mean and spread
+ * give the estimate and its confidence interval, which shrink as walks
+ * are added. Directories already read are remembered, so later walks
+ * cost little I/O, and subtrees read completely count exactly.
+ */
+
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include "inode_set.h"
+#include "name_filter.h"
+#include <stdint.h>
+
+/**
+ * @struct estimate_options_t
+ * @brief When to stop refining an estimate, and which entries to skip.
+ */
+typedef struct {
+    double target_error;          /**< Stop once the 95% interval is within this fraction of the estimate, 0 for none */
+    double time_budget;           /**< Stop after this many seconds, 0 for no limit */
+    const name_filter_t *exclude; /**< Entries whose names match are skipped with their subtrees, or NULL */
+    int one_file_system;          /**< Skip directories on other devices than the scanned path */
+    inode_set_t *links;           /**< Hard-linked files counted so far, or NULL to count every link */
+} estimate_options_t;
+
+/**
+ * @struct estimate_t
+ * @brief An estimated total with its 95% confidence interval.
+ */
+typedef struct {
+    double blocks;      /**< Estimated total in 512-byte blocks */
+    double margin;      /**< Half-width of the 95% confidence interval, in blocks */
+    uint64_t samples;   /**< Random walks taken */
+    uint64_t dirs_read; /**< Directories listed */
+    int exact;          /**< Set if the whole tree was read, so blocks is exact */
+} estimate_t;
+
+void estimate_size(const char *path, const estimate_options_t *options, estimate_t *result, int *had_access_error);
+
+#endif // ESTIMATE_H
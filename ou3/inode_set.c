@@ -0,0 +1,249 @@
+/**
+ * @file inode_set.c
+ * @brief Implementation of a sharded open-addressing set of (device, inode) pairs.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Each shard is a linear-probing hash table with its own mutex, aligned to
+ * a cache line so that shards do not share lines. A shard doubles when it
+ * is three quarters full, but never beyond its share of max_entries; once
+ * a shard is at its limit new keys are rejected and the set is marked as
+ * saturated, which bounds memory at 64 bytes per allowed entry.
+ */
+
+#include "inode_set.h"
+#include "safe_lock.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/** Initial number of slots in each shard. */
+#define SHARD_INITIAL_SLOTS 64
+
+/**
+ * @struct inode_key_t
+ * @brief One slot in a shard. An inode number of 0 marks an empty slot.
+ */
+typedef struct {
+    uint64_t dev;   /**< Device the inode lives on */
+    uint64_t ino;   /**< Inode number, 0 if the slot is empty */
+    uint32_t owner; /**< Smallest owner that claimed the key */
+} inode_key_t;
+
+/**
+ * @struct inode_shard_t
+ * @brief One independently locked hash table.
+ */
+typedef struct {
+    alignas(64) pthread_mutex_t mutex; /**< Protects this shard */
+    inode_key_t *slots;                /**< Open-addressing table */
+    size_t capacity;                   /**< Number of slots, a power of two */
+    size_t count;                      /**< Number of occupied slots */
+    size_t max_count;                  /**< Entry limit for this shard */
+} inode_shard_t;
+
+/**
+ * @struct inode_set
+ * @brief Internal structure representing the sharded set.
+ */
+struct inode_set {
+    inode_shard_t *shards;   /**< Array of shards */
+    unsigned int shard_mask; /**< Number of shards minus one */
+    atomic_int saturated;    /**< Set once any insert was rejected */
+};
+
+/**
+ * @brief Mixes device and inode into a well-distributed 64-bit hash.
+ * Uses the splitmix64 finalizer.
+ */
+static uint64_t hash_key(uint64_t dev, uint64_t ino) {
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief Finds the slot holding the key, or the empty slot where it belongs.
+ */
+static inode_key_t *find_slot(inode_key_t *slots, size_t capacity, uint64_t hash, uint64_t dev, uint64_t ino) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i].ino == 0 || (slots[i].ino == ino && slots[i].dev == dev)) {
+            return &slots[i];
+        }
+    }
+}
+
+/**
+ * @brief Doubles a shard's table and rehashes its keys.
+ * Returns -1 if memory could not be allocated.
+ */
+static int grow_shard(inode_shard_t *shard) {
+    size_t new_capacity = shard->capacity * 2;
+    inode_key_t *new_slots = calloc(new_capacity, sizeof(inode_key_t));
+    if (!new_slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        inode_key_t *key = &shard->slots[i];
+        if (key->ino != 0) {
+            *find_slot(new_slots, new_capacity, hash_key(key->dev, key->ino), key->dev, key->ino) = *key;
+        }
+    }
+
+    free(shard->slots);
+    shard->slots = new_slots;
+    shard->capacity = new_capacity;
+    return 0;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty set.
+ *
+ * max_entries bounds the number of keys the set will hold in total; it is
+ * split evenly between the shards. shards is rounded up to a power of two.
+ * On allocation failure the program exits with an error.
+ */
+inode_set_t *inode_set_create(size_t max_entries, unsigned int shards) {
+    unsigned int count = 1;
+    while (count < shards) {
+        count <<= 1;
+    }
+
+    inode_set_t *set = malloc(sizeof(inode_set_t));
+    inode_shard_t *array = aligned_alloc(alignof(inode_shard_t), count * sizeof(inode_shard_t));
+    if (!set || !array) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        inode_shard_t *shard = &array[i];
+        int errnum = pthread_mutex_init(&shard->mutex, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        shard->slots = calloc(SHARD_INITIAL_SLOTS, sizeof(inode_key_t));
+        if (!shard->slots) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        shard->capacity = SHARD_INITIAL_SLOTS;
+        shard->count = 0;
+        shard->max_count = max_entries / count > 0 ? max_entries / count : 1;
+    }
+
+    set->shards = array;
+    set->shard_mask = count - 1;
+    atomic_init(&set->saturated, 0);
+    return set;
+}
+
+/**
+ * @brief Inserts a (device, inode) pair.
+ *
+ * Returns 1 if the key was not in the set and has been added, 0 if it was
+ * already present, and -1 if it could not be tracked because its shard is
+ * full (or ino is 0). Callers treat -1 like 1, i.e. count the file.
+ */
+int inode_set_insert(inode_set_t *set, uint64_t dev, uint64_t ino) {
+    unsigned int previous;
+    return inode_set_claim(set, dev, ino, 0, &previous);
+}
+
+/**
+ * @brief Claims a (device, inode) pair for owner.
+ *
+ * A key keeps the smallest owner that claimed it, so that when several
+ * threads claim it in any order, it ends up with the same owner. Returns
+ * like inode_set_insert(); if the key was already present, *previous is
+ * set to the owner it had, which owner replaces if it is smaller.
+ */
+int inode_set_claim(inode_set_t *set, uint64_t dev, uint64_t ino, unsigned int owner, unsigned int *previous) {
+    if (ino == 0) {
+        return -1;
+    }
+
+    uint64_t hash = hash_key(dev, ino);
+    inode_shard_t *shard = &set->shards[(hash >> 48) & set->shard_mask];
+
+    safe_lock(&shard->mutex);
+    inode_key_t *slot = find_slot(shard->slots, shard->capacity, hash, dev, ino);
+    if (slot->ino != 0) {
+        *previous = slot->owner;
+        if (owner < slot->owner) {
+            slot->owner = owner;
+        }
+        safe_unlock(&shard->mutex);
+        return 0;
+    }
+
+    if (shard->count >= shard->max_count) {
+        safe_unlock(&shard->mutex);
+        atomic_store_explicit(&set->saturated, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    if ((shard->count + 1) * 4 > shard->capacity * 3) {
+        if (grow_shard(shard) == -1) {
+            safe_unlock(&shard->mutex);
+            atomic_store_explicit(&set->saturated, 1, memory_order_relaxed);
+            return -1;
+        }
+        slot = find_slot(shard->slots, shard->capacity, hash, dev, ino);
+    }
+
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->owner = owner;
+    shard->count++;
+    safe_unlock(&shard->mutex);
+    return 1;
+}
+
+/**
+ * @brief Returns the number of keys in the set.
+ * Only exact when no other thread is inserting.
+ */
+size_t inode_set_size(inode_set_t *set) {
+    size_t total = 0;
+    for (unsigned int i = 0; i <= set->shard_mask; i++) {
+        total += set->shards[i].count;
+    }
+    return total;
+}
+
+/**
+ * @brief Returns non-zero if any key was rejected because the set was full.
+ */
+int inode_set_saturated(inode_set_t *set) {
+    return atomic_load_explicit(&set->saturated, memory_order_relaxed);
+}
+
+/**
+ * @brief Destroys the set and frees all shards.
+ */
+void inode_set_destroy(inode_set_t *set) {
+    for (unsigned int i = 0; i <= set->shard_mask; i++) {
+        int errnum = pthread_mutex_destroy(&set->shards[i].mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        free(set->shards[i].slots);
+    }
+    free(set->shards);
+    free(set);
+}
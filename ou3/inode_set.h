@@ -0,0 +1,26 @@
+/**
+ * @file inode_set.h
+ * @brief Sharded, memory-bounded concurrent set of (device, inode) pairs.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Used to count each hard-linked file only once, and to give it to the
+ * first of several scanned paths it is found under. Keys are spread over
+ * independently locked shards so that threads rarely wait for each other.
+ */
+
+#ifndef INODE_SET_H
+#define INODE_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct inode_set inode_set_t;
+inode_set_t *inode_set_create(size_t max_entries, unsigned int shards);
+int inode_set_insert(inode_set_t *set, uint64_t dev, uint64_t ino);
+int inode_set_claim(inode_set_t *set, uint64_t dev, uint64_t ino, unsigned int owner, unsigned int *previous);
+size_t inode_set_size(inode_set_t *set);
+int inode_set_saturated(inode_set_t *set);
+void inode_set_destroy(inode_set_t *set);
+
+#endif // INODE_SET_H
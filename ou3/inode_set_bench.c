@@ -0,0 +1,123 @@
+/**
+ * @file inode_set_bench.c
+ * @brief Micro-benchmark for the sharded inode set at 1, 8 and 64 threads.
+ *
+ * Simulates a hard-link-heavy tree: every inode is inserted once per link,
+ * and the links of one inode are handed to different threads so that
+ * duplicates race like they do in a parallel scan. Each configuration is
+ * run with a single shard (equivalent to one global lock) and with the
+ * shard count used by dirsize.c.
+ *
+ * Usage: inode_set_bench [inodes] [links_per_inode]
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ */
+
+#include "inode_set.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* --- INTERNAL --- */
+
+/**
+ * @struct bench_args_t
+ * @brief Arguments passed to each benchmark thread.
+ */
+typedef struct {
+    inode_set_t *set;  /**< Set under test */
+    int id;            /**< Index of this thread */
+    int num_threads;   /**< Total number of threads */
+    size_t inodes;     /**< Number of distinct inodes */
+    size_t links;      /**< Links per inode */
+    size_t added;      /**< Keys this thread added first */
+} bench_args_t;
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Inserts this thread's share of all (inode, link) pairs.
+ * Pair number i goes to thread i % num_threads, so consecutive links of
+ * the same inode land on different threads.
+ */
+static void *bench_thread(void *arg) {
+    bench_args_t *args = arg;
+    size_t total = args->inodes * args->links;
+    for (size_t i = args->id; i < total; i += args->num_threads) {
+        uint64_t ino = i / args->links + 1;
+        uint64_t dev = ino % 3;
+        if (inode_set_insert(args->set, dev, ino) != 0) {
+            args->added++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs one configuration and prints a result line.
+ * The set gets twice the needed capacity, since keys do not spread
+ * perfectly evenly over the shards.
+ */
+static void run(int num_threads, unsigned int shards, size_t inodes, size_t links) {
+    inode_set_t *set = inode_set_create(inodes * 2, shards);
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    bench_args_t *args = calloc(num_threads, sizeof(bench_args_t));
+    if (!threads || !args) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now();
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (bench_args_t){.set = set, .id = i, .num_threads = num_threads, .inodes = inodes, .links = links};
+        int errnum = pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t added = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        added += args[i].added;
+    }
+    double elapsed = now() - start;
+
+    printf("%7d %7u %12zu %10.3f %10.2f %s\n", num_threads, shards, inodes * links, elapsed,
+           inodes * links / elapsed / 1e6, added == inodes && !inode_set_saturated(set) ? "ok" : "MISMATCH");
+
+    inode_set_destroy(set);
+    free(threads);
+    free(args);
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Main entry point.
+ * Runs every thread count against one shard and the dirsize.c shard count.
+ */
+int main(int argc, char **argv) {
+    size_t inodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t links = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    const int thread_counts[] = {1, 8, 64};
+    const unsigned int shard_counts[] = {1, 256};
+
+    printf("%7s %7s %12s %10s %10s %s\n", "threads", "shards", "inserts", "seconds", "Mops/s", "check");
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        for (size_t s = 0; s < sizeof(shard_counts) / sizeof(shard_counts[0]); s++) {
+            run(thread_counts[t], shard_counts[s], inodes, links);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,313 @@
+/**
+ * @file link_owners.c
+ * @brief Implementation of a sharded map from hard-linked inodes to their first links.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Each shard is a chained hash table with its own mutex, aligned to a
+ * cache line so that shards do not share lines. Records are removed as
+ * soon as their inode is resolved, so the map only holds the files some
+ * of whose links are still to be found; like the hard-link set, it takes
+ * at most its share of max_entries per shard.
+ */
+
+#include "link_owners.h"
+#include "safe_lock.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/** Initial number of buckets in each shard. */
+#define SHARD_INITIAL_BUCKETS 64
+
+/**
+ * @struct link_record_t
+ * @brief The earliest link found so far of one inode.
+ */
+typedef struct link_record {
+    struct link_record *next; /**< Next record in the same bucket */
+    uint64_t dev;             /**< Device the inode lives on */
+    uint64_t ino;             /**< Inode number */
+    unsigned long nlink;      /**< Links the inode has, the most any of them reported */
+    unsigned long seen;       /**< Links offered so far */
+    link_place_t best;        /**< Earliest link offered so far */
+} link_record_t;
+
+/**
+ * @struct link_shard_t
+ * @brief One independently locked hash table.
+ */
+typedef struct {
+    alignas(64) pthread_mutex_t mutex; /**< Protects this shard */
+    link_record_t **buckets;           /**< Chains of records */
+    size_t capacity;                   /**< Number of buckets, a power of two */
+    size_t count;                      /**< Number of records */
+    size_t max_count;                  /**< Record limit for this shard */
+    size_t next_bucket;                /**< Buckets below this one are empty, for link_owners_take() */
+} link_shard_t;
+
+/**
+ * @struct link_owners
+ * @brief Internal structure representing the sharded map.
+ */
+struct link_owners {
+    link_shard_t *shards;    /**< Array of shards */
+    unsigned int shard_mask; /**< Number of shards minus one */
+    int keep_names;          /**< Whether places keep a copy of the link's name */
+    atomic_uint next_shard;  /**< Shards below this one are empty, for link_owners_take() */
+};
+
+/**
+ * @brief Mixes device and inode into a well-distributed 64-bit hash.
+ * Uses the splitmix64 finalizer.
+ */
+static uint64_t hash_key(uint64_t dev, uint64_t ino) {
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief Finds the link to the record of the key, or the NULL link at the end of its chain.
+ */
+static link_record_t **find_record(link_shard_t *shard, uint64_t hash, uint64_t dev, uint64_t ino) {
+    link_record_t **link = &shard->buckets[hash & (shard->capacity - 1)];
+    while (*link && ((*link)->ino != ino || (*link)->dev != dev)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * @brief Doubles a shard's buckets and rehashes its records.
+ * If memory cannot be allocated, the shard keeps its buckets and only
+ * gets slower.
+ */
+static void grow_shard(link_shard_t *shard) {
+    size_t new_capacity = shard->capacity * 2;
+    link_record_t **new_buckets = calloc(new_capacity, sizeof(link_record_t *));
+    if (!new_buckets) {
+        return;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        link_record_t *record = shard->buckets[i];
+        while (record) {
+            link_record_t *next = record->next;
+            link_record_t **head = &new_buckets[hash_key(record->dev, record->ino) & (new_capacity - 1)];
+            record->next = *head;
+            *head = record;
+            record = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = new_buckets;
+    shard->capacity = new_capacity;
+}
+
+/**
+ * @brief Returns non-zero if link a comes before link b in traversal order.
+ * Links under an earlier scanned path come first, and within one path
+ * they are ordered by dir_handle_compare().
+ */
+static int place_precedes(const link_place_t *a, const link_place_t *b) {
+    if (a->root != b->root) {
+        return a->root < b->root;
+    }
+    return dir_handle_compare(a->dir, a->index, b->dir, b->index) < 0;
+}
+
+/**
+ * @brief Returns a copy of an offered place that holds a reference to its directory and owns its name.
+ */
+static link_place_t keep_place(const link_owners_t *owners, const link_place_t *place, const char *name) {
+    link_place_t kept = *place;
+    kept.name = NULL;
+    if (owners->keep_names) {
+        kept.name = strdup(name);
+        if (!kept.name) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (kept.dir) {
+        dir_handle_ref(kept.dir);
+    }
+    return kept;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty map.
+ *
+ * max_entries bounds the number of records the map will hold at once; it
+ * is split evenly between the shards. shards is rounded up to a power of
+ * two. With keep_names, the places handed out carry the link's name.
+ * On allocation failure the program exits with an error.
+ */
+link_owners_t *link_owners_create(size_t max_entries, unsigned int shards, int keep_names) {
+    unsigned int count = 1;
+    while (count < shards) {
+        count <<= 1;
+    }
+
+    link_owners_t *owners = malloc(sizeof(link_owners_t));
+    link_shard_t *array = aligned_alloc(alignof(link_shard_t), count * sizeof(link_shard_t));
+    if (!owners || !array) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        link_shard_t *shard = &array[i];
+        int errnum = pthread_mutex_init(&shard->mutex, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        shard->buckets = calloc(SHARD_INITIAL_BUCKETS, sizeof(link_record_t *));
+        if (!shard->buckets) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        shard->capacity = SHARD_INITIAL_BUCKETS;
+        shard->count = 0;
+        shard->max_count = max_entries / count > 0 ? max_entries / count : 1;
+        shard->next_bucket = 0;
+    }
+
+    owners->shards = array;
+    owners->shard_mask = count - 1;
+    owners->keep_names = keep_names;
+    atomic_init(&owners->next_shard, 0);
+    return owners;
+}
+
+/**
+ * @brief Offers one link of an inode, found at place under the given name.
+ *
+ * The place's name is ignored; name is copied if names are kept. The
+ * earliest link offered so far is kept as the inode's owner. If place
+ * comes before the owner kept until now, that one is handed back in
+ * *dropped, and once nlink links have been offered, the owner is handed
+ * back in *owner and the inode is forgotten. Returns a combination of
+ * LINK_DROPPED and LINK_OWNED telling which of the two were filled, or -1
+ * if the inode cannot be tracked because its shard is full, in which case
+ * the caller credits the link where it is.
+ */
+int link_owners_offer(link_owners_t *owners, uint64_t dev, uint64_t ino, unsigned long nlink,
+                      const link_place_t *place, const char *name, link_place_t *dropped, link_place_t *owner) {
+    uint64_t hash = hash_key(dev, ino);
+    link_shard_t *shard = &owners->shards[(hash >> 48) & owners->shard_mask];
+    int result = 0;
+
+    safe_lock(&shard->mutex);
+    link_record_t **link = find_record(shard, hash, dev, ino);
+    link_record_t *record = *link;
+    if (!record) {
+        if (shard->count >= shard->max_count) {
+            safe_unlock(&shard->mutex);
+            return -1;
+        }
+        if (shard->count + 1 > shard->capacity) {
+            grow_shard(shard);
+            link = find_record(shard, hash, dev, ino);
+        }
+        record = malloc(sizeof(link_record_t));
+        if (!record) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        record->next = NULL;
+        record->dev = dev;
+        record->ino = ino;
+        record->nlink = nlink;
+        record->seen = 0;
+        record->best = keep_place(owners, place, name);
+        *link = record;
+        shard->count++;
+    } else if (place_precedes(place, &record->best)) {
+        *dropped = record->best;
+        record->best = keep_place(owners, place, name);
+        result |= LINK_DROPPED;
+    }
+
+    if (nlink > record->nlink) {
+        record->nlink = nlink;
+    }
+    if (++record->seen >= record->nlink) {
+        *link = record->next;
+        shard->count--;
+        *owner = record->best;
+        free(record);
+        result |= LINK_OWNED;
+    }
+    safe_unlock(&shard->mutex);
+    return result;
+}
+
+/**
+ * @brief Takes the owner of an inode not all of whose links were offered.
+ * For after the traversal, when no more links are offered: links outside
+ * the scanned paths or skipped by the scan are never found. Returns 1
+ * with the owner in *owner, or 0 once the map is empty.
+ */
+int link_owners_take(link_owners_t *owners, link_place_t *owner) {
+    for (unsigned int i = atomic_load(&owners->next_shard); i <= owners->shard_mask; i++) {
+        link_shard_t *shard = &owners->shards[i];
+        safe_lock(&shard->mutex);
+        for (; shard->next_bucket < shard->capacity; shard->next_bucket++) {
+            link_record_t *record = shard->buckets[shard->next_bucket];
+            if (record) {
+                shard->buckets[shard->next_bucket] = record->next;
+                shard->count--;
+                safe_unlock(&shard->mutex);
+                *owner = record->best;
+                free(record);
+                return 1;
+            }
+        }
+        safe_unlock(&shard->mutex);
+        unsigned int expected = i;
+        atomic_compare_exchange_strong(&owners->next_shard, &expected, i + 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Destroys the map and frees all shards.
+ * Records still in the map are freed without releasing their
+ * directories, so all of them should be taken first.
+ */
+void link_owners_destroy(link_owners_t *owners) {
+    for (unsigned int i = 0; i <= owners->shard_mask; i++) {
+        link_shard_t *shard = &owners->shards[i];
+        int errnum = pthread_mutex_destroy(&shard->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < shard->capacity; j++) {
+            link_record_t *record = shard->buckets[j];
+            while (record) {
+                link_record_t *next = record->next;
+                free(record->best.name);
+                free(record);
+                record = next;
+            }
+        }
+        free(shard->buckets);
+    }
+    free(owners->shards);
+    free(owners);
+}
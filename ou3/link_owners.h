@@ -0,0 +1,48 @@
+/**
+ * @file link_owners.h
+ * @brief Sharded map from hard-linked inodes to the first of their links found in traversal order.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Used to credit each hard-linked file to one directory, the one du would
+ * credit it to, however the workers happen to find its links. A link is
+ * kept as the inode's owner while no earlier one has been offered, and the
+ * owner is handed back once all links of the inode have been seen, or
+ * once the traversal is over.
+ */
+
+#ifndef LINK_OWNERS_H
+#define LINK_OWNERS_H
+
+#include "dir_handle.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/** Returned by link_owners_offer() when it filled *dropped. */
+#define LINK_DROPPED 1
+
+/** Returned by link_owners_offer() when it filled *owner. */
+#define LINK_OWNED 2
+
+/**
+ * @struct link_place_t
+ * @brief Where one link of a file was found.
+ * A place handed out by link_owners_offer() or link_owners_take() holds a
+ * reference to dir and owns name, which the caller gives up once done.
+ */
+typedef struct {
+    dir_handle_t *dir; /**< Directory the link is in, NULL if it is a scanned path itself */
+    uint64_t index;    /**< Position of the link in dir's listing */
+    unsigned int root; /**< Index of the scanned path the link is under */
+    size_t blocks;     /**< Blocks of the file */
+    char *name;        /**< Copy of the link's name if names are kept, otherwise NULL */
+} link_place_t;
+
+typedef struct link_owners link_owners_t;
+link_owners_t *link_owners_create(size_t max_entries, unsigned int shards, int keep_names);
+int link_owners_offer(link_owners_t *owners, uint64_t dev, uint64_t ino, unsigned long nlink,
+                      const link_place_t *place, const char *name, link_place_t *dropped, link_place_t *owner);
+int link_owners_take(link_owners_t *owners, link_place_t *owner);
+void link_owners_destroy(link_owners_t *owners);
+
+#endif // LINK_OWNERS_H
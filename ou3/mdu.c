@@ -5,98 +5,791 @@
  * This program calculates the disk usage (in 512-byte blocks) of specified
  * files or directories. It supports parallel traversal using multiple threads.
  *
- * Usage: mdu [-j number_of_threads] file ...
+ * Usage: mdu [-j number_of_threads|auto] [-e queue|steal] [-u] [-l] [-x] [-d depth] [-c cache_file [-C verify|ignore]]
+ *            [--exclude=pattern ...] [--stats] [--memory-limit=size] [--top=n] [--deadline=seconds]
+ *            [--progress[=seconds]] [--device-threads=[path=]n ...] [--snapshot=file]
+ *            [--affinity=compact|scatter] file ...
+ *        mdu --estimate[=percent] [--time-budget=seconds] [-l] [-x] [--exclude=pattern ...] file ...
+ *        mdu -w socket [-j number_of_threads|auto] [-e queue|steal] [-u] [--memory-limit=size]
+ *            [--affinity=compact|scatter] directory ...
+ *        mdu -q socket directory ...
  * @date 2025-11-19
  * @author Bran Mjöberg Quanne
  */
 
 #include "dirsize.h"
+#include "estimate.h"
+#include "snapshot.h"
+#include "watchd.h"
+#include <errno.h>
+#include <getopt.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 /* --- INTERNAL --- */
 
+/** Values returned by getopt_long for options that only have a long name. */
+enum { OPT_STATS = 256, OPT_MEMORY_LIMIT, OPT_TOP, OPT_EXCLUDE, OPT_ESTIMATE, OPT_TIME_BUDGET, OPT_DEADLINE,
+       OPT_PROGRESS, OPT_DEVICE_THREADS, OPT_SNAPSHOT, OPT_AFFINITY };
+
+/** Long options; the short ones are listed in the getopt_long call. */
+static const struct option long_options[] = {{"stats", no_argument, NULL, OPT_STATS},
+                                             {"memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT},
+                                             {"top", required_argument, NULL, OPT_TOP},
+                                             {"one-file-system", no_argument, NULL, 'x'},
+                                             {"exclude", required_argument, NULL, OPT_EXCLUDE},
+                                             {"estimate", optional_argument, NULL, OPT_ESTIMATE},
+                                             {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+                                             {"deadline", required_argument, NULL, OPT_DEADLINE},
+                                             {"progress", optional_argument, NULL, OPT_PROGRESS},
+                                             {"device-threads", required_argument, NULL, OPT_DEVICE_THREADS},
+                                             {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+                                             {"affinity", required_argument, NULL, OPT_AFFINITY},
+                                             {NULL, 0, NULL, 0}};
+
+/** Target error of '--estimate' without a value, in percent. */
+#define DEFAULT_ESTIMATE_ERROR 5.0
+
+/** Seconds between the intermediate totals of '--progress' without a value. */
+#define DEFAULT_PROGRESS_INTERVAL 1.0
+
+/** Most hard-linked files '--estimate' remembers, as many as a scan. */
+#define ESTIMATE_LINK_SET_MAX_ENTRIES (1u << 22)
+
+/**
+ * @brief How the scan cache given with '-c' is used.
+ */
+typedef enum {
+    CACHE_USE,    /**< Skip unchanged directories and update the cache */
+    CACHE_VERIFY, /**< Read every directory, report stale entries and update the cache */
+    CACHE_IGNORE  /**< Read every directory and rebuild the cache from scratch */
+} cache_mode_t;
+
+/**
+ * @struct mdu_config_t
+ * @brief Settings parsed from the command line.
+ */
+typedef struct {
+    int num_threads;             /**< Number of threads, 1 for the single-threaded traversal, or SCAN_THREADS_AUTO */
+    int threads_given;           /**< '-j' was given */
+    int engine_given;            /**< '-e' was given */
+    scan_options_t options;      /**< Options passed to the traversal */
+    const char *cache_file;      /**< Scan cache file, or NULL */
+    cache_mode_t cache_mode;     /**< How the cache file is used */
+    int cache_mode_given;        /**< '-C' was given */
+    const char *watch_socket;    /**< Run as a daemon serving queries on this socket, or NULL */
+    const char *query_socket;    /**< Query the daemon listening on this socket, or NULL */
+    int show_stats;              /**< Print per-thread counters after the scan */
+    int top;                     /**< Number of largest files and directories to print, 0 for none */
+    name_filter_t *exclude;      /**< Patterns given with '--exclude', or NULL */
+    int estimate;                /**< Estimate the totals by sampling instead of scanning */
+    estimate_options_t sampling; /**< When to stop refining the estimates */
+    double deadline;             /**< Give up and print partial totals after this many seconds, 0 for no limit */
+    double progress;             /**< Seconds between intermediate totals on stderr, 0 for none */
+    device_limit_t *devices;     /**< Limits given with '--device-threads' for the devices of paths */
+    int num_devices;             /**< Number of devices */
+    const char *snapshot_file;   /**< Write a snapshot of the scanned directories here, or NULL */
+} mdu_config_t;
+
 /**
  * @brief Prints usage information and exits.
  */
 static void print_usage(void) {
-    fprintf(stderr, "Usage: mdu [-j number_of_threads] file ...\n");
+    fprintf(stderr, "Usage: mdu [-j number_of_threads|auto] [-e queue|steal] [-u] [-l] [-x] [-d depth] "
+                    "[-c cache_file [-C verify|ignore]] [--exclude=pattern ...] [--stats] [--memory-limit=size] "
+                    "[--top=n] [--deadline=seconds] [--progress[=seconds]] [--device-threads=[path=]n ...] "
+                    "[--snapshot=file] [--affinity=compact|scatter] file ...\n"
+                    "       mdu --estimate[=percent] [--time-budget=seconds] [-l] [-x] [--exclude=pattern ...] "
+                    "file ...\n"
+                    "       mdu -w socket [-j number_of_threads|auto] [-e queue|steal] [-u] [--memory-limit=size] "
+                    "[--affinity=compact|scatter] directory ...\n"
+                    "       mdu -q socket directory ...\n");
     exit(EXIT_FAILURE);
 }
 
 /**
- * @brief Parses the number of threads from command-line arguments.
+ * @brief Parses the scheduling engine name given to '-e'.
+ */
+static scan_engine_t parse_engine(const char *name) {
+    if (strcmp(name, "queue") == 0) {
+        return ENGINE_QUEUE;
+    }
+    if (strcmp(name, "steal") == 0) {
+        return ENGINE_STEAL;
+    }
+    fprintf(stderr, "Unknown engine: %s\n", name);
+    print_usage();
+    return ENGINE_QUEUE;
+}
+
+/**
+ * @brief Parses the worker placement given to '--affinity'.
+ */
+static affinity_t parse_affinity(const char *name) {
+    if (strcmp(name, "compact") == 0) {
+        return AFFINITY_COMPACT;
+    }
+    if (strcmp(name, "scatter") == 0) {
+        return AFFINITY_SCATTER;
+    }
+    fprintf(stderr, "Unknown affinity: %s\n", name);
+    print_usage();
+    return AFFINITY_NONE;
+}
+
+/**
+ * @brief Parses the size given to '--memory-limit', in bytes with an optional K, M or G suffix.
+ */
+static size_t parse_memory_limit(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    unsigned shift = 0;
+    switch (*end) {
+    case 'G':
+    case 'g':
+        shift += 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        shift += 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        shift += 10;
+        end++;
+        break;
+    }
+    if (end == arg || *end != '\0' || value == 0 || errno == ERANGE || value > SIZE_MAX >> shift) {
+        fprintf(stderr, "Invalid memory limit: %s\n", arg);
+        print_usage();
+    }
+    return (size_t)value << shift;
+}
+
+/**
+ * @brief Parses a positive number given to a long option, such as '--time-budget'.
+ */
+static double parse_positive(const char *arg, const char *what) {
+    char *end;
+    double value = strtod(arg, &end);
+    if (end == arg || *end != '\0' || !(value > 0)) {
+        fprintf(stderr, "Invalid %s: %s\n", what, arg);
+        print_usage();
+    }
+    return value;
+}
+
+/**
+ * @brief Parses a limit given to '--device-threads', n or path=n.
+ * A plain n applies to every device; with a path it applies to the device
+ * the path is on, and overrides the plain one.
+ */
+static void parse_device_threads(const char *arg, mdu_config_t *config) {
+    const char *equals = strrchr(arg, '=');
+    const char *count = equals ? equals + 1 : arg;
+    int max_workers = atoi(count);
+    if (max_workers < 1) {
+        fprintf(stderr, "Number of threads per device must be greater than 0\n");
+        print_usage();
+    }
+    if (!equals) {
+        config->options.device_workers = max_workers;
+        return;
+    }
+
+    char *path = strndup(arg, equals - arg);
+    struct stat path_stat;
+    if (!path || stat(path, &path_stat) == -1) {
+        perror(path ? path : "strndup");
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+    device_limit_t *devices = realloc(config->devices, (config->num_devices + 1) * sizeof(device_limit_t));
+    if (!devices) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    devices[config->num_devices++] = (device_limit_t){.dev = path_stat.st_dev, .max_workers = max_workers};
+    config->devices = devices;
+}
+
+/**
+ * @brief Prints the total of a directory below a scanned path, for '-d'.
+ * Called from the workers as subtrees finish; each line is written with
+ * one call, so lines from different workers do not interleave.
+ */
+static void print_dir_total(const char *path, size_t blocks, void *context) {
+    (void)context;
+    printf("%zu\t%s\n", blocks, path);
+}
+
+/**
+ * @brief Parses the cache mode name given to '-C'.
+ */
+static cache_mode_t parse_cache_mode(const char *name) {
+    if (strcmp(name, "verify") == 0) {
+        return CACHE_VERIFY;
+    }
+    if (strcmp(name, "ignore") == 0) {
+        return CACHE_IGNORE;
+    }
+    fprintf(stderr, "Unknown cache mode: %s\n", name);
+    print_usage();
+    return CACHE_USE;
+}
+
+/**
+ * @brief Parses the command-line options into config.
  *
- * This function scans the command-line arguments for the '-j' option.
- * Returns the number of threads to use (default is 1 if not specified).
+ * This function scans the command-line arguments for the options below and
+ * stores them in config:
+ *   -j  number of threads (default is 1), or auto to tune it while scanning
+ *   -e  scheduling engine (default is the shared queue)
+ *   -u  batch stat calls through io_uring
+ *   -l  count every hard link
+ *   -x  (--one-file-system) skip directories on other file systems than the scanned path
+ *   -d  also print every directory down to this depth, subdirectories first
+ *   -c  scan cache file
+ *   -C  verify or ignore the contents of the scan cache
+ *   -w  keep the totals current and serve queries on a socket
+ *   -q  ask the daemon on a socket instead of scanning
+ *   --stats  print what every thread did and where its time went
+ *   --memory-limit  keep new work local once the queued work would take more memory than this; only the
+ *                   shared queue of '-e queue' with several threads is limited, so other engines are refused
+ *   --top  also print this many of the largest files and directories
+ *   --exclude  skip entries whose names match this shell pattern, may be repeated
+ *   --estimate  estimate the totals by sampling, to within this many percent (default 5)
+ *   --time-budget  stop refining the estimates after this many seconds
+ *   --deadline  stop after this many seconds and print the partial totals, marking incomplete ones
+ *   --progress  print intermediate totals to stderr this often, in seconds (default 1)
+ *   --device-threads  let at most n threads work on each file system, or on the one path is on
+ *   --snapshot  write the scanned directories and their totals to a snapshot file, for mdu_snap
+ *   --affinity  pin the threads to CPUs, filling one NUMA node first (compact) or spread over all (scatter)
  */
-static int get_thread_count(int argc, char **argv) {
-    int num_threads = 1;
+static void parse_options(int argc, char **argv, mdu_config_t *config) {
     int opt;
 
-    while ((opt = getopt(argc, argv, "j:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "j:e:ulxd:c:C:w:q:", long_options, NULL)) != -1) {
         switch (opt) {
         case 'j':
-            num_threads = atoi(optarg);
-            if (num_threads < 1) {
+            config->threads_given = 1;
+            if (strcmp(optarg, "auto") == 0) {
+                config->num_threads = SCAN_THREADS_AUTO;
+                break;
+            }
+            config->num_threads = atoi(optarg);
+            if (config->num_threads < 1) {
                 fprintf(stderr, "Number of threads must be greater than 0\n");
                 print_usage();
             }
             break;
+        case 'e':
+            config->options.engine = parse_engine(optarg);
+            config->engine_given = 1;
+            break;
+        case 'u':
+            config->options.use_uring = 1;
+            break;
+        case 'l':
+            config->options.count_links = 1;
+            break;
+        case 'x':
+            config->options.one_file_system = 1;
+            break;
+        case 'd':
+            config->options.dir_total_depth = atoi(optarg);
+            if (config->options.dir_total_depth < 0) {
+                fprintf(stderr, "Depth must not be negative\n");
+                print_usage();
+            }
+            config->options.dir_total = print_dir_total;
+            break;
+        case 'c':
+            config->cache_file = optarg;
+            break;
+        case 'C':
+            config->cache_mode = parse_cache_mode(optarg);
+            config->cache_mode_given = 1;
+            break;
+        case 'w':
+            config->watch_socket = optarg;
+            break;
+        case 'q':
+            config->query_socket = optarg;
+            break;
+        case OPT_STATS:
+            config->show_stats = 1;
+            break;
+        case OPT_MEMORY_LIMIT:
+            config->options.memory_limit = parse_memory_limit(optarg);
+            break;
+        case OPT_EXCLUDE:
+            if (!config->exclude) {
+                config->exclude = name_filter_create();
+                config->options.exclude = config->exclude;
+            }
+            name_filter_add(config->exclude, optarg);
+            break;
+        case OPT_ESTIMATE:
+            config->estimate = 1;
+            config->sampling.target_error =
+                (optarg ? parse_positive(optarg, "target error") : DEFAULT_ESTIMATE_ERROR) / 100;
+            break;
+        case OPT_TIME_BUDGET:
+            config->sampling.time_budget = parse_positive(optarg, "time budget");
+            break;
+        case OPT_DEADLINE:
+            config->deadline = parse_positive(optarg, "deadline");
+            break;
+        case OPT_SNAPSHOT:
+            config->snapshot_file = optarg;
+            break;
+        case OPT_AFFINITY:
+            config->options.affinity = parse_affinity(optarg);
+            break;
+        case OPT_DEVICE_THREADS:
+            parse_device_threads(optarg, config);
+            break;
+        case OPT_PROGRESS:
+            config->progress = optarg ? parse_positive(optarg, "progress interval") : DEFAULT_PROGRESS_INTERVAL;
+            break;
+        case OPT_TOP:
+            config->top = atoi(optarg);
+            if (config->top < 1) {
+                fprintf(stderr, "Number of entries must be greater than 0\n");
+                print_usage();
+            }
+            break;
         default:
             print_usage();
         }
     }
-    return num_threads;
 }
+
+/**
+ * @brief Exits with a message and the usage if an option was given together with one it does not go with.
+ */
+static void refuse(int conflict, const char *option, const char *other) {
+    if (conflict) {
+        fprintf(stderr, "%s cannot be used with %s\n", option, other);
+        print_usage();
+    }
+}
+
+/**
+ * @brief Checks that the options parsed into config go together, and that some file is given.
+ * '-w', '-q' and '--estimate' each select a mode other than a scan, in
+ * which only some of the options apply; the others are refused by name.
+ */
+static void check_options(const mdu_config_t *config, int num_paths) {
+    if (num_paths < 1) {
+        fprintf(stderr, "No file or directory given\n");
+        print_usage();
+    }
+
+    refuse(config->watch_socket && config->query_socket, "-w", "-q");
+    refuse(config->estimate && config->watch_socket, "--estimate", "-w");
+    refuse(config->estimate && config->query_socket, "--estimate", "-q");
+    const char *mode = config->watch_socket ? "-w" : config->query_socket ? "-q" : "--estimate";
+    int daemon = config->watch_socket || config->query_socket;
+    int other_mode = daemon || config->estimate;
+    int no_scan = config->query_socket || config->estimate;
+
+    refuse(config->show_stats && other_mode, "--stats", mode);
+    refuse(config->top && other_mode, "--top", mode);
+    refuse(config->deadline > 0 && other_mode, "--deadline", mode);
+    refuse(config->progress > 0 && other_mode, "--progress", mode);
+    refuse(config->snapshot_file && other_mode, "--snapshot", mode);
+    refuse(config->exclude && daemon, "--exclude", mode);
+    refuse(config->options.one_file_system && daemon, "-x", mode);
+    refuse((config->options.device_workers || config->devices) && no_scan, "--device-threads", mode);
+    refuse(config->options.affinity != AFFINITY_NONE && no_scan, "--affinity", mode);
+    refuse(config->cache_file && no_scan, "-c", mode);
+    refuse(config->options.dir_total && other_mode, "-d", mode);
+    refuse(config->threads_given && no_scan, "-j", mode);
+    refuse(config->engine_given && no_scan, "-e", mode);
+    refuse(config->options.use_uring && no_scan, "-u", mode);
+    refuse(config->options.count_links && config->query_socket, "-l", mode);
+    refuse(config->cache_mode_given && no_scan, "-C", mode);
+    refuse(config->options.memory_limit && no_scan, "--memory-limit", mode);
+
+    if (config->cache_mode_given && !config->cache_file) {
+        fprintf(stderr, "-C needs -c\n");
+        print_usage();
+    }
+    if (config->sampling.time_budget > 0 && !config->estimate) {
+        fprintf(stderr, "--time-budget needs --estimate\n");
+        print_usage();
+    }
+    if (config->options.memory_limit && (config->num_threads == 1 || config->options.engine != ENGINE_QUEUE)) {
+        fprintf(stderr, "--memory-limit needs -e queue and more than one thread\n");
+        print_usage();
+    }
+}
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Prints the counters of every thread and their sum to stderr, for '--stats'.
+ * Comparing the time spent in stat and readdir, waiting for work and
+ * waiting for the queue lock with the wall time shows whether a run was
+ * bound by I/O, by idle threads or by contention. Threads that never
+ * took work, like workers of a '-j auto' pool that stayed parked, are
+ * left out. The peak resident set size of the process is printed with
+ * the wall time, to check the footprint against '--memory-limit'.
+ */
+static void print_stats(const scan_thread_stats_t *stats, int num_threads, double wall) {
+    scan_thread_stats_t total = {0};
+    fflush(stdout);
+    fprintf(stderr, "%6s %10s %8s %10s %10s %10s %10s %10s\n", "thread", "entries", "dirs", "stat_ms", "readdir_ms",
+            "wait_ms", "lock_ms", "peak_queue");
+    for (int i = 0; i <= num_threads; i++) {
+        const scan_thread_stats_t *row = i < num_threads ? &stats[i] : &total;
+        if (i < num_threads && row->entries == 0 && row->wait_ns == 0) {
+            continue;
+        }
+        if (i < num_threads) {
+            fprintf(stderr, "%6d", i);
+            total.entries += row->entries;
+            total.dirs += row->dirs;
+            total.stat_ns += row->stat_ns;
+            total.readdir_ns += row->readdir_ns;
+            total.wait_ns += row->wait_ns;
+            total.lock_ns += row->lock_ns;
+            total.peak_queue = row->peak_queue > total.peak_queue ? row->peak_queue : total.peak_queue;
+        } else {
+            fprintf(stderr, "%6s", "total");
+        }
+        fprintf(stderr, " %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10llu\n", (unsigned long long)row->entries,
+                (unsigned long long)row->dirs, row->stat_ns / 1e6, row->readdir_ns / 1e6, row->wait_ns / 1e6,
+                row->lock_ns / 1e6, (unsigned long long)row->peak_queue);
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(stderr, "wall %.1f ms, peak rss %.1f MB\n", wall * 1e3, usage.ru_maxrss / 1024.0);
+    } else {
+        fprintf(stderr, "wall %.1f ms\n", wall * 1e3);
+    }
+}
+
+/**
+ * @brief Prints the entries of a top-N collection under a heading, largest first, for '--top'.
+ */
+static void print_top(const char *heading, top_n_t *top) {
+    size_t count;
+    const top_entry_t *entries = top_n_sorted(top, &count);
+    printf("%s:\n", heading);
+    for (size_t i = 0; i < count; i++) {
+        printf("%llu\t%s\n", (unsigned long long)entries[i].blocks, entries[i].path);
+    }
+}
+
+/**
+ * @brief Raises the soft limit on open files to the hard limit.
+ *
+ * The traversal keeps a directory open for as long as entries in it are
+ * still queued, so a breadth-first scan of a wide tree can hold many
+ * directory fds at once. Failure is not fatal; the scan then reports the
+ * directories it could not open.
+ */
+static void raise_open_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * @brief Waits for a scan until it finishes or the deadline passes, for '--deadline' and '--progress'.
+ * Every progress interval, the blocks counted so far, the entries visited
+ * and the directories still pending are printed to stderr. They are read
+ * from the workers' own counters, which costs the workers nothing and
+ * keeps working if they are stuck on a hanging file system. Times are
+ * in seconds since start. Returns 0 if the deadline passed, 1 otherwise.
+ */
+static int wait_with_deadline(scan_t *scan, const mdu_config_t *config, double start) {
+    if (config->deadline == 0 && config->progress == 0) {
+        return 1;
+    }
+    double next_report = config->progress;
+    for (;;) {
+        double elapsed = now() - start;
+        if (config->deadline > 0 && elapsed >= config->deadline) {
+            return 0;
+        }
+        double wait = config->deadline > 0 ? config->deadline - elapsed : next_report - elapsed;
+        if (config->progress > 0 && next_report - elapsed < wait) {
+            wait = next_report - elapsed;
+        }
+        if (wait > 0 && scan_wait_timeout(scan, wait)) {
+            return 1;
+        }
+
+        elapsed = now() - start;
+        if (config->progress > 0 && elapsed >= next_report) {
+            scan_progress_t progress;
+            scan_progress(scan, &progress);
+            fprintf(stderr, "mdu: %.1f s: %llu blocks, %llu entries visited, %llu directories pending\n", elapsed,
+                    (unsigned long long)progress.blocks, (unsigned long long)progress.entries,
+                    (unsigned long long)progress.pending);
+            while (next_report <= elapsed) {
+                next_report += config->progress;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Gives up on a scan once the deadline has passed, and exits.
+ * A line is printed for every argument, in order, as for a complete
+ * scan: the total of an argument that was counted completely along with
+ * all arguments before it, since those can still take hard links from
+ * it, or else the partial total followed by "(incomplete)", which is 0
+ * for an argument not started yet. An argument already known to be
+ * covered by an earlier one gets no line, as in a complete scan. A
+ * summary of the entries visited and the directories still pending
+ * follows on stderr. The scan is cancelled, but the program exits
+ * without waiting for it, since workers stuck in a system call may never
+ * return. The cache is not saved, as the totals are incomplete.
+ */
+static void abandon_scan(scan_t *scan, char *const *paths, int num_paths, double deadline) {
+    size_t *totals = malloc(num_paths * sizeof(size_t));
+    if (!totals) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    scan_progress_t progress;
+    scan_progress(scan, &progress);
+    scan_partial_totals(scan, totals);
+    int final = 1;
+    for (int i = 0; i < num_paths; i++) {
+        final = final && scan_path_done(scan, i);
+        if (!scan_path_covered(scan, i)) {
+            printf("%zu\t%s%s\n", totals[i], paths[i], final ? "" : "\t(incomplete)");
+        }
+    }
+    scan_cancel(scan);
+
+    fflush(stdout);
+    fprintf(stderr, "mdu: deadline of %g s passed, totals are partial: %llu entries visited, %llu directories "
+                    "pending\n",
+            deadline, (unsigned long long)progress.entries, (unsigned long long)progress.pending);
+    exit(EXIT_FAILURE);
+}
+
 /**
  * @brief Calculates and prints disk usage for each specified file or directory.
  *
- * This function iterates over all file arguments provided on the command line.
- * For each file or directory:
- *   - If parallel mode is requested (num_threads > 1), it calls get_size_parallel.
- *   - Otherwise, it calls get_size for single-threaded calculation.
- * It prints the disk usage (in blocks) and the file name for each entry.
+ * All file arguments are scanned at once by one scan, which keeps a
+ * separate total for each, with as many threads as requested, and the
+ * totals are printed once all are done. The disk usage (in blocks) and
+ * the file name are printed in the order the arguments were given. Like
+ * du, everything is counted once over all arguments unless '-l' is
+ * given: a hard link counts for the first argument it is under, and an
+ * argument below or the same as an earlier one is counted with it and
+ * gets no line of its own. The totals are the same for any number of
+ * threads.
+ * With '--progress', intermediate totals are printed to stderr while
+ * waiting, and with '--deadline', the partial totals are printed and the
+ * program exits once the deadline passes.
  * If any access errors occur, it sets the error flag.
  */
-static void get_and_print_disk_usage(int argc, char **argv, int num_threads, int *had_access_error) {
-    for (int i = optind; i < argc; i++) {
-        size_t total_size = 0;
-        int file_had_error = 0;
+static void get_and_print_disk_usage(int argc, char **argv, const mdu_config_t *config, int *had_access_error) {
+    scan_ctx_t *ctx = scan_ctx_create(config->num_threads, config->options.engine, config->options.affinity);
+    if (!ctx) {
+        perror("scan_ctx_create");
+        exit(EXIT_FAILURE);
+    }
 
-        if (num_threads > 1) {
-            get_size_parallel(argv[i], num_threads, &total_size, &file_had_error);
-        } else {
-            get_size(argv[i], &total_size, &file_had_error);
+    int num_paths = argc - optind;
+    size_t *total_sizes = calloc(num_paths, sizeof(size_t));
+    if (!total_sizes) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    scan_t *scan = scan_submit(ctx, argv + optind, num_paths, &config->options, NULL, NULL);
+    if (!scan) {
+        perror("scan_submit");
+        exit(EXIT_FAILURE);
+    }
+    if (!wait_with_deadline(scan, config, now())) {
+        abandon_scan(scan, argv + optind, num_paths, config->deadline);
+    }
+    scan_wait(scan, total_sizes, had_access_error);
+    for (int i = 0; i < num_paths; i++) {
+        if (!scan_path_covered(scan, i)) {
+            printf("%zu\t%s\n", total_sizes[i], argv[optind + i]);
         }
+    }
+    scan_release(scan);
 
-        printf("%zu\t%s\n", total_size, argv[i]);
+    free(total_sizes);
+    scan_ctx_destroy(ctx);
+}
 
-        if (file_had_error) {
-            *had_access_error = 1;
+/**
+ * @brief Estimates and prints the disk usage of each specified file or directory, for '--estimate'.
+ * Each line holds the estimate and the file name like a scanned total,
+ * followed by the half-width of the 95% confidence interval, the number
+ * of random walks taken and the number of directories read. The
+ * estimator is single-threaded. Unless '-l' is given, a hard link counts
+ * for the first argument it is read under, through one set of links for
+ * all arguments, so a tree read completely ("exact") totals like a scan.
+ */
+static void estimate_and_print(int argc, char **argv, const mdu_config_t *config, int *had_access_error) {
+    estimate_options_t sampling = config->sampling;
+    if (!config->options.count_links) {
+        sampling.links = inode_set_create(ESTIMATE_LINK_SET_MAX_ENTRIES, 1);
+    }
+    for (int i = optind; i < argc; i++) {
+        estimate_t estimate;
+        estimate_size(argv[i], &sampling, &estimate, had_access_error);
+        printf("%.0f\t%s\t±%.0f (%s, %llu walks, %llu directories read)\n", estimate.blocks, argv[i],
+               estimate.margin, estimate.exact ? "exact" : "95% confidence", (unsigned long long)estimate.samples,
+               (unsigned long long)estimate.dirs_read);
+        fflush(stdout);
+    }
+    if (sampling.links) {
+        if (inode_set_saturated(sampling.links)) {
+            fprintf(stderr, "mdu: too many hard-linked files to track, some were counted more than once\n");
         }
+        inode_set_destroy(sampling.links);
     }
 }
 
 /**
  * @brief Main entry point.
  *
- * This function processes command-line arguments, determines the number of threads,
- * and validates that at least one file or directory is specified.
- * It then calls get_and_print_disk_usage to calculate and display disk usage for each entry.
+ * This function parses the command-line options with parse_options()
+ * and checks them with check_options().
+ * With '-q' the totals are asked from a running daemon instead of scanned,
+ * and with '--estimate' they are estimated by sampling.
+ * If a cache file is given, it is loaded (unless ignored) before the scan.
+ * It then calls get_and_print_disk_usage to calculate and display disk usage for each entry,
+ * followed by the largest files and directories with '--top' and the per-thread counters with '--stats',
+ * or with '-w' runs the daemon until it is stopped, and finally writes the snapshot and the updated
+ * cache back.
  * The program exits with a failure status if any access errors occurred, otherwise exits successfully.
  */
 int main(int argc, char **argv) {
-    int num_threads = get_thread_count(argc, argv);
+    mdu_config_t config = {.num_threads = 1,
+                           .threads_given = 0,
+                           .engine_given = 0,
+                           .options = {.engine = ENGINE_QUEUE, .use_uring = 0, .count_links = 0, .cache = NULL},
+                           .cache_file = NULL,
+                           .cache_mode = CACHE_USE,
+                           .cache_mode_given = 0,
+                           .watch_socket = NULL,
+                           .query_socket = NULL,
+                           .show_stats = 0,
+                           .top = 0,
+                           .exclude = NULL,
+                           .estimate = 0,
+                           .sampling = {0},
+                           .deadline = 0,
+                           .progress = 0,
+                           .devices = NULL,
+                           .num_devices = 0,
+                           .snapshot_file = NULL};
+    parse_options(argc, argv, &config);
+    config.options.devices = config.devices;
+    config.options.num_devices = config.num_devices;
 
-    if (optind >= argc) {
-        print_usage();
+    check_options(&config, argc - optind);
+
+    if (config.estimate) {
+        int had_access_error = 0;
+        config.sampling.exclude = config.exclude;
+        config.sampling.one_file_system = config.options.one_file_system;
+        estimate_and_print(argc, argv, &config, &had_access_error);
+        if (config.exclude) {
+            name_filter_destroy(config.exclude);
+        }
+        return had_access_error ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (config.query_socket) {
+        return watchd_query(config.query_socket, argv + optind, argc - optind) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    raise_open_file_limit();
+
+    if (config.cache_file) {
+        config.options.cache =
+            config.cache_mode == CACHE_IGNORE ? scan_cache_create() : scan_cache_load(config.cache_file);
+        config.options.verify_cache = config.cache_mode == CACHE_VERIFY;
+    }
+
+    if (config.top) {
+        config.options.top_files = top_n_create(config.top);
+        config.options.top_dirs = top_n_create(config.top);
+    }
+
+    snapshot_builder_t *snapshot = NULL;
+    if (config.snapshot_file) {
+        snapshot = snapshot_builder_create();
+        config.options.visit = snapshot_collect;
+        config.options.visit_context = snapshot;
     }
 
     int had_access_error = 0;
-    get_and_print_disk_usage(argc, argv, num_threads, &had_access_error);
+    if (config.watch_socket) {
+        had_access_error = watchd_run(config.watch_socket, argv + optind, argc - optind, config.num_threads,
+                                      &config.options) == -1;
+    } else if (config.show_stats) {
+        int pool_size = scan_pool_size(config.num_threads);
+        config.options.stats = calloc(pool_size, sizeof(scan_thread_stats_t));
+        if (!config.options.stats) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        double start = now();
+        get_and_print_disk_usage(argc, argv, &config, &had_access_error);
+        print_stats(config.options.stats, pool_size, now() - start);
+        free(config.options.stats);
+    } else {
+        get_and_print_disk_usage(argc, argv, &config, &had_access_error);
+    }
+
+    if (config.top) {
+        print_top("Largest files", config.options.top_files);
+        print_top("Largest directories", config.options.top_dirs);
+        top_n_destroy(config.options.top_files);
+        top_n_destroy(config.options.top_dirs);
+    }
+
+    if (snapshot) {
+        if (snapshot_write(snapshot, config.snapshot_file) == -1) {
+            had_access_error = 1;
+        }
+        snapshot_builder_destroy(snapshot);
+    }
+
+    if (config.options.cache) {
+        scan_cache_save(config.options.cache, config.cache_file);
+        scan_cache_destroy(config.options.cache);
+    }
+    if (config.exclude) {
+        name_filter_destroy(config.exclude);
+    }
+    free(config.devices);
 
     return had_access_error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
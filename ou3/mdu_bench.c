@@ -0,0 +1,522 @@
+/**
+ * @file mdu_bench.c
+ * @brief Benchmark harness that times mdu on synthetic trees across engines and thread counts.
+ *
+ * Generates four synthetic trees below a work directory, unless they are
+ * already there from an earlier run:
+ *   wide  a three-level tree with many small directories
+ *   deep  a single chain of nested directories
+ *   tiny  many directories of tiny files
+ *   huge  one directory holding many empty files
+ * Every combination of tree, engine, thread count and worker placement
+ * (--affinity of mdu, or none) is run once untimed and then a number of
+ * timed times. On a machine with several NUMA nodes, thread counts above
+ * the CPUs of one node show what the placement costs or saves once the
+ * workers cross a socket; the number of nodes is written with the
+ * results. The median and 95th percentile wall
+ * time and the entries scanned per second at the median are printed as a
+ * table and written to a JSON file that can be tracked over releases.
+ * With -c the page cache is dropped before every run (needs root), so the
+ * numbers include reading the directories from disk.
+ *
+ * Usage: mdu_bench [-m mdu] [-d work_dir] [-s scale] [-r repeats] [-j threads,...]
+ *                  [-e engine,...] [-a none|compact|scatter,...] [-o json_file] [-c]
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** Most thread counts or engines accepted in one list. */
+#define MAX_LIST 32
+
+/** Name of the file that marks a tree as completely generated. */
+#define DONE_MARK ".mdu_bench_done"
+
+/**
+ * @struct bench_config_t
+ * @brief Settings parsed from the command line.
+ */
+typedef struct {
+    const char *mdu;               /**< mdu binary under test */
+    const char *work_dir;          /**< Directory holding the generated trees */
+    int scale;                     /**< Multiplier for the size of every tree */
+    int repeats;                   /**< Timed runs per configuration */
+    int threads[MAX_LIST];         /**< Thread counts to run */
+    int num_threads;               /**< Number of thread counts */
+    const char *engines[MAX_LIST]; /**< Engines to run */
+    int num_engines;               /**< Number of engines */
+    const char *places[MAX_LIST];  /**< Worker placements to run, none for no pinning */
+    int num_places;                /**< Number of placements */
+    const char *json_file;         /**< Where the results are written */
+    int cold;                      /**< Drop the page cache before every run */
+} bench_config_t;
+
+/**
+ * @struct tree_shape_t
+ * @brief Shape of one synthetic tree at scale 1.
+ * A tree has levels of directories below its root, fanout directories per
+ * directory, and files_per_dir files of file_size bytes in every directory.
+ */
+typedef struct {
+    const char *name;  /**< Name of the tree below the work directory */
+    int levels;        /**< Levels of directories below the root */
+    int fanout;        /**< Subdirectories per directory */
+    int files_per_dir; /**< Files in every directory, multiplied by the scale */
+    size_t file_size;  /**< Bytes written to every file */
+} tree_shape_t;
+
+static const tree_shape_t shapes[] = {
+    {"wide", 3, 16, 8, 0},
+    {"deep", 500, 1, 8, 0},
+    {"tiny", 1, 200, 250, 64},
+    {"huge", 0, 0, 100000, 0},
+};
+
+/**
+ * @brief Prints usage information and exits.
+ */
+static void print_usage(void) {
+    fprintf(stderr, "Usage: mdu_bench [-m mdu] [-d work_dir] [-s scale] [-r repeats] [-j threads,...] "
+                    "[-e engine,...] [-a none|compact|scatter,...] [-o json_file] [-c]\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Splits a comma-separated list in place.
+ * Returns the number of elements stored in items.
+ */
+static int split_list(char *list, const char **items) {
+    int count = 0;
+    for (char *token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+        if (count == MAX_LIST) {
+            fprintf(stderr, "At most %d list elements are supported\n", MAX_LIST);
+            print_usage();
+        }
+        items[count++] = token;
+    }
+    return count;
+}
+
+/**
+ * @brief Parses the command-line options into config.
+ */
+static void parse_options(int argc, char **argv, bench_config_t *config) {
+    const char *items[MAX_LIST];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:s:r:j:e:a:o:c")) != -1) {
+        switch (opt) {
+        case 'm':
+            config->mdu = optarg;
+            break;
+        case 'd':
+            config->work_dir = optarg;
+            break;
+        case 's':
+            config->scale = atoi(optarg);
+            if (config->scale < 1) {
+                fprintf(stderr, "Scale must be greater than 0\n");
+                print_usage();
+            }
+            break;
+        case 'r':
+            config->repeats = atoi(optarg);
+            if (config->repeats < 1) {
+                fprintf(stderr, "Repeats must be greater than 0\n");
+                print_usage();
+            }
+            break;
+        case 'j':
+            config->num_threads = split_list(optarg, items);
+            for (int i = 0; i < config->num_threads; i++) {
+                config->threads[i] = atoi(items[i]);
+                if (config->threads[i] < 1) {
+                    fprintf(stderr, "Number of threads must be greater than 0\n");
+                    print_usage();
+                }
+            }
+            break;
+        case 'e':
+            config->num_engines = split_list(optarg, config->engines);
+            break;
+        case 'a':
+            config->num_places = split_list(optarg, config->places);
+            break;
+        case 'o':
+            config->json_file = optarg;
+            break;
+        case 'c':
+            config->cold = 1;
+            break;
+        default:
+            print_usage();
+        }
+    }
+    if (optind != argc || config->num_threads == 0 || config->num_engines == 0 || config->num_places == 0) {
+        print_usage();
+    }
+}
+
+/**
+ * @brief Creates a file of size bytes in the directory dirfd.
+ */
+static void create_file(int dirfd, const char *name, size_t size) {
+    static const char fill[64] = {0};
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t written = 0; written < size;) {
+        size_t chunk = size - written < sizeof(fill) ? size - written : sizeof(fill);
+        ssize_t n = write(fd, fill, chunk);
+        if (n == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        written += n;
+    }
+    close(fd);
+}
+
+/**
+ * @brief Creates the directory name in dirfd and returns an fd for it.
+ */
+static int create_dir(int dirfd, const char *name) {
+    if (mkdirat(dirfd, name, 0755) == -1 && errno != EEXIST) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/**
+ * @brief Fills the directory dirfd with files and, above the last level, subdirectories.
+ * Works relative to directory fds, so the deep tree may exceed PATH_MAX.
+ */
+static void fill_dir(int dirfd, const tree_shape_t *shape, int scale, int level) {
+    char name[32];
+    int files = shape->files_per_dir * scale;
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        create_file(dirfd, name, shape->file_size);
+    }
+    if (level == shape->levels) {
+        return;
+    }
+    for (int i = 0; i < shape->fanout; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        int fd = create_dir(dirfd, name);
+        fill_dir(fd, shape, scale, level + 1);
+        close(fd);
+    }
+}
+
+/**
+ * @brief Counts the entries below and including the directory dirfd.
+ * Every directory and file counts as one entry, like the ones mdu visits.
+ */
+static size_t count_entries(int dirfd) {
+    DIR *dir = fdopendir(dirfd);
+    if (!dir) {
+        perror("fdopendir");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_type != DT_DIR) {
+            count++;
+            continue;
+        }
+        int fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(entry->d_name);
+            exit(EXIT_FAILURE);
+        }
+        count += count_entries(fd);
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * @brief Generates a tree unless a complete one is already present.
+ * The tree is marked complete only after it is fully written, so an
+ * interrupted generation is finished on the next run. Returns the number
+ * of entries in the tree, not counting the mark.
+ */
+static size_t prepare_tree(const char *work_dir, const tree_shape_t *shape, int scale) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s-s%d", shape->name, scale);
+
+    int work_fd = create_dir(AT_FDCWD, work_dir);
+    int root_fd = create_dir(work_fd, name);
+    close(work_fd);
+
+    if (faccessat(root_fd, DONE_MARK, F_OK, 0) == -1) {
+        fprintf(stderr, "Generating %s/%s...\n", work_dir, name);
+        fill_dir(root_fd, shape, scale, 0);
+        create_file(root_fd, DONE_MARK, 0);
+    }
+    return count_entries(root_fd) - 1;
+}
+
+/**
+ * @brief Writes back dirty pages and drops the page, dentry and inode caches.
+ */
+static void drop_caches(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "3\n", 2) != 2) {
+        perror("/proc/sys/vm/drop_caches");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/**
+ * @brief Counts the NUMA nodes listed in sysfs, 1 if there are none.
+ */
+static int count_numa_nodes(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) {
+        return 1;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        char rest;
+        count += sscanf(entry->d_name, "node%d%c", &node, &rest) == 1;
+    }
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+/**
+ * @brief Runs mdu once on path and returns the wall time in seconds.
+ * The output of mdu is discarded; a failing run stops the benchmark.
+ */
+static double time_run(const bench_config_t *config, const char *engine, int threads, const char *place,
+                       const char *path) {
+    char thread_arg[16];
+    snprintf(thread_arg, sizeof(thread_arg), "%d", threads);
+    char place_arg[64];
+    snprintf(place_arg, sizeof(place_arg), "--affinity=%s", place);
+    char *args[] = {(char *)config->mdu, "-j", thread_arg, "-e", (char *)engine, place_arg, (char *)path, NULL};
+    if (strcmp(place, "none") == 0) {
+        args[5] = (char *)path;
+        args[6] = NULL;
+    }
+
+    if (config->cold) {
+        drop_caches();
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+            perror("/dev/null");
+            _exit(EXIT_FAILURE);
+        }
+        execv(config->mdu, args);
+        perror(config->mdu);
+        _exit(EXIT_FAILURE);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    double elapsed = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s -j %d -e %s %s %s failed\n", config->mdu, threads, engine, place_arg, path);
+        exit(EXIT_FAILURE);
+    }
+    return elapsed;
+}
+
+/**
+ * @brief Compares two doubles for qsort.
+ */
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns the nearest-rank percentile of sorted values.
+ */
+static double percentile(const double *sorted, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Writes s as a JSON string literal.
+ */
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * @brief Writes the fields that describe the whole benchmark run.
+ */
+static void json_header(FILE *out, const bench_config_t *config) {
+    char stamp[32];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    fprintf(out, "{\n  \"timestamp\": ");
+    json_string(out, stamp);
+    fprintf(out, ",\n  \"host\": ");
+    json_string(out, host);
+    fprintf(out, ",\n  \"cpus\": %ld,\n  \"numa_nodes\": %d,\n  \"mdu\": ", sysconf(_SC_NPROCESSORS_ONLN),
+            count_numa_nodes());
+    json_string(out, config->mdu);
+    fprintf(out, ",\n  \"scale\": %d,\n  \"repeats\": %d,\n  \"cold_cache\": %s,\n  \"results\": [", config->scale,
+            config->repeats, config->cold ? "true" : "false");
+}
+
+/**
+ * @brief Times one configuration, prints its table row and writes its JSON object.
+ */
+static void run(const bench_config_t *config, const char *tree, const char *path, size_t entries, const char *engine,
+                int threads, const char *place, FILE *out, int first) {
+    double *times = malloc(config->repeats * sizeof(double));
+    if (!times) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    time_run(config, engine, threads, place, path);
+    for (int i = 0; i < config->repeats; i++) {
+        times[i] = time_run(config, engine, threads, place, path);
+    }
+
+    fprintf(out, "%s\n    {\"tree\": ", first ? "" : ",");
+    json_string(out, tree);
+    fprintf(out, ", \"entries\": %zu, \"engine\": ", entries);
+    json_string(out, engine);
+    fprintf(out, ", \"threads\": %d, \"affinity\": ", threads);
+    json_string(out, place);
+    fprintf(out, ", \"runs_s\": [");
+    for (int i = 0; i < config->repeats; i++) {
+        fprintf(out, "%s%.6f", i ? ", " : "", times[i]);
+    }
+
+    qsort(times, config->repeats, sizeof(double), compare_double);
+    double median = percentile(times, config->repeats, 50);
+    double p95 = percentile(times, config->repeats, 95);
+    fprintf(out, "], \"median_s\": %.6f, \"p95_s\": %.6f, \"entries_per_s\": %.0f}", median, p95, entries / median);
+
+    printf("%-6s %10zu %-6s %7d %-8s %10.4f %10.4f %12.0f\n", tree, entries, engine, threads, place, median, p95,
+           entries / median);
+    fflush(stdout);
+    free(times);
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Main entry point.
+ * Prepares every tree, then runs every engine, thread count and placement on it.
+ */
+int main(int argc, char **argv) {
+    static char default_threads[] = "1,2,4,8";
+    static char default_engines[] = "queue,steal";
+    static char default_places[] = "none";
+    bench_config_t config = {
+        .mdu = "./mdu", .work_dir = "/tmp/mdu_bench", .scale = 1, .repeats = 5, .json_file = "bench.json", .cold = 0};
+    const char *items[MAX_LIST];
+    config.num_threads = split_list(default_threads, items);
+    for (int i = 0; i < config.num_threads; i++) {
+        config.threads[i] = atoi(items[i]);
+    }
+    config.num_engines = split_list(default_engines, config.engines);
+    config.num_places = split_list(default_places, config.places);
+    parse_options(argc, argv, &config);
+
+    FILE *out = fopen(config.json_file, "w");
+    if (!out) {
+        perror(config.json_file);
+        exit(EXIT_FAILURE);
+    }
+    json_header(out, &config);
+
+    printf("%-6s %10s %-6s %7s %-8s %10s %10s %12s\n", "tree", "entries", "engine", "threads", "affinity", "median_s",
+           "p95_s", "entries/s");
+    int first = 1;
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        size_t entries = prepare_tree(config.work_dir, &shapes[s], config.scale);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s-s%d", config.work_dir, shapes[s].name, config.scale);
+        for (int e = 0; e < config.num_engines; e++) {
+            for (int t = 0; t < config.num_threads; t++) {
+                for (int a = 0; a < config.num_places; a++) {
+                    run(&config, shapes[s].name, path, entries, config.engines[e], config.threads[t], config.places[a],
+                        out, first);
+                    first = 0;
+                }
+            }
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (fclose(out) != 0) {
+        perror(config.json_file);
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
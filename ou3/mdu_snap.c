@@ -0,0 +1,203 @@
+/**
+ * @file mdu_snap.c
+ * @brief Compares snapshots written by mdu --snapshot, and answers queries on them.
+ *
+ * Both snapshots are mapped, not parsed, so a comparison costs one pass
+ * over the directories and a query one lookup per name in its path.
+ * Growth is listed per subtree, largest first. A directory whose growth
+ * all lies in one of its subdirectories is left out, as that
+ * subdirectory already accounts for it; so a file that grew deep in the
+ * tree shows up once, at its directory. Shrinking and removed
+ * directories are not listed.
+ *
+ * Usage: mdu_snap [-n count] old_snapshot new_snapshot
+ *        mdu_snap -q snapshot path ...
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ */
+
+#include "snapshot.h"
+#include "top_n.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** Subtrees listed by default. */
+#define DEFAULT_COUNT 20
+
+/**
+ * @struct node_pair_t
+ * @brief A directory of the new snapshot and the same directory in the old one.
+ */
+typedef struct {
+    uint32_t new_node; /**< Node in the new snapshot */
+    uint32_t old_node; /**< Node in the old snapshot, SNAPSHOT_NONE if the directory is new */
+} node_pair_t;
+
+/**
+ * @brief Prints usage information and exits.
+ */
+static void print_usage(void) {
+    fprintf(stderr, "Usage: mdu_snap [-n count] old_snapshot new_snapshot\n"
+                    "       mdu_snap -q snapshot path ...\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Maps a snapshot, exiting with a message if that fails.
+ */
+static snapshot_t *open_or_exit(const char *file) {
+    snapshot_t *snapshot = snapshot_open(file);
+    if (!snapshot) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "%s: not a snapshot of this version and byte order\n", file);
+        } else {
+            perror(file);
+        }
+        exit(EXIT_FAILURE);
+    }
+    return snapshot;
+}
+
+/**
+ * @brief Returns the growth of a directory from the old snapshot to the new one, in blocks.
+ */
+static int64_t growth(const snapshot_t *old, const snapshot_t *new, node_pair_t pair) {
+    uint64_t before = pair.old_node == SNAPSHOT_NONE ? 0 : old->total[pair.old_node];
+    return (int64_t)(new->total[pair.new_node] - before);
+}
+
+/**
+ * @brief Matches the children of new_parent with those of old_parent by name and pushes the pairs.
+ * Siblings are sorted by name in both snapshots, so this is a merge.
+ * SNAPSHOT_NONE as both parents stands for the scanned paths. Returns
+ * non-zero if the parent grew by parent_growth, which is positive, and
+ * one child grew by as much.
+ */
+static int push_children(const snapshot_t *old, const snapshot_t *new, uint32_t new_parent, uint32_t old_parent,
+                         int64_t parent_growth, node_pair_t *stack, size_t *depth) {
+    uint32_t new_child = new_parent == SNAPSHOT_NONE ? 0 : new_parent + 1;
+    uint32_t new_end = new_parent == SNAPSHOT_NONE ? new->num_nodes : new->end[new_parent];
+    uint32_t old_child = old_parent == SNAPSHOT_NONE ? 0 : old_parent + 1;
+    uint32_t old_end = old_parent == SNAPSHOT_NONE ? old->num_nodes : old->end[old_parent];
+    if (new_parent != SNAPSHOT_NONE && old_parent == SNAPSHOT_NONE) {
+        old_child = old_end;
+    }
+
+    int explained = 0;
+    for (; new_child < new_end; new_child = new->end[new_child]) {
+        const char *name = new->names + new->name[new_child];
+        int order = 1;
+        while (old_child < old_end && (order = strcmp(old->names + old->name[old_child], name)) < 0) {
+            old_child = old->end[old_child];
+        }
+        node_pair_t pair = {.new_node = new_child, .old_node = order == 0 ? old_child : SNAPSHOT_NONE};
+        explained |= parent_growth > 0 && growth(old, new, pair) == parent_growth;
+        stack[(*depth)++] = pair;
+    }
+    return explained;
+}
+
+/**
+ * @brief Prints the subtrees that grew the most from old to new, largest first.
+ */
+static void print_growth(const snapshot_t *old, const snapshot_t *new, size_t count) {
+    node_pair_t *stack = malloc((new->num_nodes + 1) * sizeof(node_pair_t));
+    if (!stack) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    top_n_t *top = top_n_create(count);
+
+    size_t depth = 0;
+    push_children(old, new, SNAPSHOT_NONE, SNAPSHOT_NONE, 0, stack, &depth);
+    while (depth > 0) {
+        node_pair_t pair = stack[--depth];
+        int64_t grown = growth(old, new, pair);
+        int explained = push_children(old, new, pair.new_node, pair.old_node, grown, stack, &depth);
+        if (grown > 0 && !explained && top_n_accepts(top, grown)) {
+            top_n_add(top, grown, snapshot_path(new, pair.new_node));
+        }
+    }
+
+    size_t kept;
+    const top_entry_t *entries = top_n_sorted(top, &kept);
+    for (size_t i = 0; i < kept; i++) {
+        printf("+%llu\t%s\n", (unsigned long long)entries[i].blocks, entries[i].path);
+    }
+    top_n_destroy(top);
+    free(stack);
+}
+
+/**
+ * @brief Prints the total of each path found in a snapshot, like mdu does.
+ * Returns non-zero if some path is not in the snapshot.
+ */
+static int print_totals(const snapshot_t *snapshot, char **paths, int num_paths) {
+    int missing = 0;
+    for (int i = 0; i < num_paths; i++) {
+        uint32_t node = snapshot_find(snapshot, paths[i]);
+        if (node == SNAPSHOT_NONE) {
+            fprintf(stderr, "%s: not in the snapshot\n", paths[i]);
+            missing = 1;
+            continue;
+        }
+        printf("%llu\t%s\n", (unsigned long long)snapshot->total[node], paths[i]);
+    }
+    return missing;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Main entry point.
+ *
+ * With '-q', prints the total of every given path from one snapshot.
+ * Otherwise compares two snapshots and prints the count subtrees that
+ * grew the most, with the blocks they grew by.
+ */
+int main(int argc, char **argv) {
+    const char *query = NULL;
+    size_t count = DEFAULT_COUNT;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+        switch (opt) {
+        case 'n':
+            if (atoi(optarg) < 1) {
+                fprintf(stderr, "Count must be greater than 0\n");
+                print_usage();
+            }
+            count = atoi(optarg);
+            break;
+        case 'q':
+            query = optarg;
+            break;
+        default:
+            print_usage();
+        }
+    }
+
+    if (query) {
+        if (optind >= argc) {
+            print_usage();
+        }
+        snapshot_t *snapshot = open_or_exit(query);
+        int missing = print_totals(snapshot, argv + optind, argc - optind);
+        snapshot_close(snapshot);
+        return missing ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (argc - optind != 2) {
+        print_usage();
+    }
+    snapshot_t *old = open_or_exit(argv[optind]);
+    snapshot_t *new = open_or_exit(argv[optind + 1]);
+    print_growth(old, new, count);
+    snapshot_close(old);
+    snapshot_close(new);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file name_filter.c
+ * @brief Implementation of a set of shell patterns matched against entry names.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Most exclude patterns are plain names (node_modules, .snapshot) or have
+ * a single '*' at one end (*.tmp, cache-*). Plain names are kept sorted
+ * and found by binary search; patterns with a '*' at one end become prefix
+ * and suffix comparisons. Only the remaining patterns go to fnmatch.
+ */
+
+#include "name_filter.h"
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/**
+ * @struct pattern_list_t
+ * @brief Growable list of pattern strings of one kind.
+ */
+typedef struct {
+    char **items;    /**< Patterns, without the '*' for prefixes and suffixes */
+    size_t *lengths; /**< Length of each pattern */
+    size_t count;    /**< Number of patterns */
+    size_t capacity; /**< Allocated entries */
+} pattern_list_t;
+
+/**
+ * @struct name_filter
+ * @brief Internal structure holding the patterns by kind.
+ */
+struct name_filter {
+    pattern_list_t literals; /**< Plain names, sorted */
+    pattern_list_t prefixes; /**< Patterns of the form "text*" */
+    pattern_list_t suffixes; /**< Patterns of the form "*text" */
+    pattern_list_t globs;    /**< Other patterns, matched with fnmatch */
+};
+
+/**
+ * @brief Returns non-zero if c has a special meaning in a pattern.
+ */
+static int is_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+/**
+ * @brief Returns non-zero if the length bytes at text have no special characters.
+ */
+static int is_plain(const char *text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (is_special(text[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Inserts a copy of the length bytes at text into a list at index.
+ */
+static void list_insert(pattern_list_t *list, size_t index, const char *text, size_t length) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 8;
+        char **items = realloc(list->items, new_capacity * sizeof(char *));
+        size_t *lengths = items ? realloc(list->lengths, new_capacity * sizeof(size_t)) : NULL;
+        if (!items || !lengths) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        list->items = items;
+        list->lengths = lengths;
+        list->capacity = new_capacity;
+    }
+
+    char *copy = strndup(text, length);
+    if (!copy) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    memmove(list->items + index + 1, list->items + index, (list->count - index) * sizeof(char *));
+    memmove(list->lengths + index + 1, list->lengths + index, (list->count - index) * sizeof(size_t));
+    list->items[index] = copy;
+    list->lengths[index] = length;
+    list->count++;
+}
+
+/**
+ * @brief Returns the index of the first literal not sorting before name.
+ */
+static size_t literal_position(const pattern_list_t *literals, const char *name) {
+    size_t low = 0;
+    size_t high = literals->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(literals->items[middle], name) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Frees the patterns of a list.
+ */
+static void list_free(pattern_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    free(list->lengths);
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty filter, which matches no name.
+ * Exits the program if allocation fails.
+ */
+name_filter_t *name_filter_create(void) {
+    name_filter_t *filter = calloc(1, sizeof(name_filter_t));
+    if (!filter) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return filter;
+}
+
+/**
+ * @brief Adds a shell pattern, as understood by fnmatch without flags.
+ * The pattern is matched against entry names only, so it cannot contain
+ * a '/' that would ever match.
+ */
+void name_filter_add(name_filter_t *filter, const char *pattern) {
+    size_t length = strlen(pattern);
+    if (is_plain(pattern, length)) {
+        size_t index = literal_position(&filter->literals, pattern);
+        if (index == filter->literals.count || strcmp(filter->literals.items[index], pattern) != 0) {
+            list_insert(&filter->literals, index, pattern, length);
+        }
+    } else if (length > 1 && pattern[length - 1] == '*' && is_plain(pattern, length - 1)) {
+        list_insert(&filter->prefixes, filter->prefixes.count, pattern, length - 1);
+    } else if (length > 1 && pattern[0] == '*' && is_plain(pattern + 1, length - 1)) {
+        list_insert(&filter->suffixes, filter->suffixes.count, pattern + 1, length - 1);
+    } else {
+        list_insert(&filter->globs, filter->globs.count, pattern, length);
+    }
+}
+
+/**
+ * @brief Returns non-zero if name matches any pattern of the filter.
+ */
+int name_filter_match(const name_filter_t *filter, const char *name) {
+    const pattern_list_t *literals = &filter->literals;
+    if (literals->count > 0) {
+        size_t index = literal_position(literals, name);
+        if (index < literals->count && strcmp(literals->items[index], name) == 0) {
+            return 1;
+        }
+    }
+
+    size_t length = strlen(name);
+    for (size_t i = 0; i < filter->prefixes.count; i++) {
+        size_t part = filter->prefixes.lengths[i];
+        if (part <= length && memcmp(name, filter->prefixes.items[i], part) == 0) {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < filter->suffixes.count; i++) {
+        size_t part = filter->suffixes.lengths[i];
+        if (part <= length && memcmp(name + length - part, filter->suffixes.items[i], part) == 0) {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < filter->globs.count; i++) {
+        if (fnmatch(filter->globs.items[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the filter and its patterns.
+ */
+void name_filter_destroy(name_filter_t *filter) {
+    list_free(&filter->literals);
+    list_free(&filter->prefixes);
+    list_free(&filter->suffixes);
+    list_free(&filter->globs);
+    free(filter);
+}
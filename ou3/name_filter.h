@@ -0,0 +1,22 @@
+/**
+ * @file name_filter.h
+ * @brief Set of shell patterns matched against directory entry names.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Patterns are sorted into kinds when they are added, so that matching a
+ * name against many patterns mostly costs a binary search and a few
+ * string comparisons instead of one fnmatch call per pattern. A filter is
+ * filled before a scan and only read while it runs.
+ */
+
+#ifndef NAME_FILTER_H
+#define NAME_FILTER_H
+
+typedef struct name_filter name_filter_t;
+name_filter_t *name_filter_create(void);
+void name_filter_add(name_filter_t *filter, const char *pattern);
+int name_filter_match(const name_filter_t *filter, const char *name);
+void name_filter_destroy(name_filter_t *filter);
+
+#endif // NAME_FILTER_H
@@ -0,0 +1,18 @@
+/**
+ * @file safe_lock.h
+ * @brief Mutex locking that terminates the process on failure.
+ * @author Bran Mjöberg Quanne
+ * @date 2025-11-19
+ */
+#ifndef SAFE_LOCK_H
+#define SAFE_LOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+void safe_lock(pthread_mutex_t *m);
+void safe_lock_timed(pthread_mutex_t *m, uint64_t *wait_ns);
+void safe_unlock(pthread_mutex_t *m);
+uint64_t monotonic_ns(void);
+
+#endif // SAFE_LOCK_H
@@ -0,0 +1,471 @@
+/**
+ * @file scan_cache.c
+ * @brief Implementation of the versioned, binary per-directory scan cache.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * File layout, all integers in host byte order:
+ *   header:  "MDUCACHE", uint32 version, uint32 byte-order mark, uint64 entry count
+ *   entry:   uint64 dev, ino; int64 mtime sec/nsec, ctime sec/nsec;
+ *            uint64 own blocks; uint32 link count, subdir count; uint64 names size;
+ *            link count x (uint64 dev, ino, blocks);
+ *            names, NUL-terminated, padded with zeros to a multiple of 8 bytes
+ *
+ * A loaded cache is read-only and can be looked up without locking. The
+ * entries of the current scan are collected separately in sharded lists,
+ * one mutex per shard, and written out as the next generation on save.
+ */
+
+#include "scan_cache.h"
+#include "safe_lock.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** File magic. */
+#define CACHE_MAGIC "MDUCACHE"
+
+/** Current format version; files with any other version are ignored. */
+#define CACHE_VERSION 1
+
+/** Written as a uint32 to detect files from hosts with another byte order. */
+#define CACHE_BYTE_ORDER 0x01020304u
+
+/** Number of independently locked lists collecting new entries. */
+#define CACHE_SHARDS 64
+
+/** Size of the fixed part of an entry in the file. */
+#define ENTRY_FIXED_SIZE 72
+
+/**
+ * @struct cache_record_t
+ * @brief An entry of the next generation, either kept from the loaded file or copied.
+ */
+typedef struct {
+    const cache_entry_t *entry; /**< The entry */
+    int owned;                  /**< Non-zero if entry was allocated by scan_cache_store */
+} cache_record_t;
+
+/**
+ * @struct cache_shard_t
+ * @brief One independently locked list of next-generation records.
+ */
+typedef struct {
+    pthread_mutex_t mutex;   /**< Protects this shard */
+    cache_record_t *records; /**< Growable array of records */
+    size_t count;            /**< Number of records */
+    size_t capacity;         /**< Allocated records */
+} cache_shard_t;
+
+/**
+ * @struct scan_cache
+ * @brief Internal structure holding the loaded generation and the one being built.
+ */
+struct scan_cache {
+    char *data;                    /**< Contents of the loaded file */
+    cache_entry_t *entries;        /**< Parsed entries pointing into data */
+    size_t num_entries;            /**< Number of parsed entries */
+    const cache_entry_t **index;   /**< Open-addressing index by (dev, ino) */
+    size_t index_capacity;         /**< Slots in index, a power of two */
+    cache_shard_t shards[CACHE_SHARDS]; /**< Next generation */
+};
+
+/**
+ * @brief Hashes a directory's device and inode (splitmix64 finalizer).
+ */
+static uint64_t hash_dir(uint64_t dev, uint64_t ino) {
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief Rounds a size up to a multiple of 8.
+ */
+static uint64_t pad8(uint64_t size) {
+    return (size + 7) & ~(uint64_t)7;
+}
+
+/**
+ * @brief Copies the next n bytes from the file buffer, advancing pos.
+ * Returns -1 if fewer than n bytes remain.
+ */
+static int take(const char *data, size_t size, size_t *pos, void *out, size_t n) {
+    if (size - *pos < n) {
+        return -1;
+    }
+    memcpy(out, data + *pos, n);
+    *pos += n;
+    return 0;
+}
+
+/**
+ * @brief Parses all entries of a loaded file and builds the lookup index.
+ * Returns -1 if the file is truncated or inconsistent.
+ */
+static int parse_entries(scan_cache_t *cache, size_t size, uint64_t count) {
+    size_t pos = 24;
+    if (count > size / ENTRY_FIXED_SIZE) {
+        return -1;
+    }
+
+    cache->entries = calloc(count ? count : 1, sizeof(cache_entry_t));
+    if (!cache->entries) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        cache_entry_t *entry = &cache->entries[i];
+        dir_stamp_t *stamp = &entry->stamp;
+        if (take(cache->data, size, &pos, &stamp->dev, 8) || take(cache->data, size, &pos, &stamp->ino, 8) ||
+            take(cache->data, size, &pos, &stamp->mtime_sec, 8) ||
+            take(cache->data, size, &pos, &stamp->mtime_nsec, 8) ||
+            take(cache->data, size, &pos, &stamp->ctime_sec, 8) ||
+            take(cache->data, size, &pos, &stamp->ctime_nsec, 8) ||
+            take(cache->data, size, &pos, &entry->own_blocks, 8) ||
+            take(cache->data, size, &pos, &entry->num_links, 4) ||
+            take(cache->data, size, &pos, &entry->num_subdirs, 4) ||
+            take(cache->data, size, &pos, &entry->subdirs_size, 8)) {
+            return -1;
+        }
+
+        uint64_t links_size = (uint64_t)entry->num_links * sizeof(cache_link_t);
+        if (size - pos < links_size) {
+            return -1;
+        }
+        entry->links = (const cache_link_t *)(cache->data + pos);
+        pos += links_size;
+
+        uint64_t names_size = pad8(entry->subdirs_size);
+        if (names_size < entry->subdirs_size || size - pos < names_size) {
+            return -1;
+        }
+        entry->subdirs = cache->data + pos;
+        if (entry->subdirs_size > 0 && entry->subdirs[entry->subdirs_size - 1] != '\0') {
+            return -1;
+        }
+        pos += names_size;
+    }
+    cache->num_entries = count;
+
+    cache->index_capacity = 16;
+    while (cache->index_capacity < count * 2) {
+        cache->index_capacity *= 2;
+    }
+    cache->index = calloc(cache->index_capacity, sizeof(cache_entry_t *));
+    if (!cache->index) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t mask = cache->index_capacity - 1;
+    for (size_t i = 0; i < count; i++) {
+        const dir_stamp_t *stamp = &cache->entries[i].stamp;
+        size_t slot = hash_dir(stamp->dev, stamp->ino) & mask;
+        while (cache->index[slot] &&
+               (cache->index[slot]->stamp.dev != stamp->dev || cache->index[slot]->stamp.ino != stamp->ino)) {
+            slot = (slot + 1) & mask;
+        }
+        cache->index[slot] = &cache->entries[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ * Returns the buffer and stores its size, or NULL with errno set.
+ */
+static char *read_file(const char *file, size_t *size) {
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    size_t capacity = 1 << 16;
+    size_t used = 0;
+    char *data = malloc(capacity);
+    while (data) {
+        used += fread(data + used, 1, capacity - used, fp);
+        if (used < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char *bigger = realloc(data, capacity);
+        if (!bigger) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        data = bigger;
+    }
+
+    int failed = !data || ferror(fp);
+    int saved_errno = errno;
+    fclose(fp);
+    if (failed) {
+        free(data);
+        errno = saved_errno ? saved_errno : EIO;
+        return NULL;
+    }
+    *size = used;
+    return data;
+}
+
+/**
+ * @brief Appends a record to the shard of its directory.
+ */
+static void add_record(scan_cache_t *cache, const cache_entry_t *entry, int owned) {
+    cache_shard_t *shard = &cache->shards[hash_dir(entry->stamp.dev, entry->stamp.ino) % CACHE_SHARDS];
+    safe_lock(&shard->mutex);
+    if (shard->count == shard->capacity) {
+        size_t new_capacity = shard->capacity ? shard->capacity * 2 : 256;
+        cache_record_t *records = realloc(shard->records, new_capacity * sizeof(cache_record_t));
+        if (!records) {
+            perror("realloc");
+            safe_unlock(&shard->mutex);
+            exit(EXIT_FAILURE);
+        }
+        shard->records = records;
+        shard->capacity = new_capacity;
+    }
+    shard->records[shard->count++] = (cache_record_t){.entry = entry, .owned = owned};
+    safe_unlock(&shard->mutex);
+}
+
+/**
+ * @brief Writes one entry in file format.
+ * Returns -1 on a write error.
+ */
+static int write_entry(FILE *fp, const cache_entry_t *entry) {
+    static const char zeros[8] = {0};
+    const dir_stamp_t *stamp = &entry->stamp;
+    size_t padding = pad8(entry->subdirs_size) - entry->subdirs_size;
+
+    return fwrite(&stamp->dev, 8, 1, fp) != 1 || fwrite(&stamp->ino, 8, 1, fp) != 1 ||
+                   fwrite(&stamp->mtime_sec, 8, 1, fp) != 1 || fwrite(&stamp->mtime_nsec, 8, 1, fp) != 1 ||
+                   fwrite(&stamp->ctime_sec, 8, 1, fp) != 1 || fwrite(&stamp->ctime_nsec, 8, 1, fp) != 1 ||
+                   fwrite(&entry->own_blocks, 8, 1, fp) != 1 || fwrite(&entry->num_links, 4, 1, fp) != 1 ||
+                   fwrite(&entry->num_subdirs, 4, 1, fp) != 1 || fwrite(&entry->subdirs_size, 8, 1, fp) != 1 ||
+                   fwrite(entry->links, sizeof(cache_link_t), entry->num_links, fp) != entry->num_links ||
+                   fwrite(entry->subdirs, 1, entry->subdirs_size, fp) != entry->subdirs_size ||
+                   fwrite(zeros, 1, padding, fp) != padding
+               ? -1
+               : 0;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty cache, e.g. to rebuild a cache from scratch.
+ */
+scan_cache_t *scan_cache_create(void) {
+    scan_cache_t *cache = calloc(1, sizeof(scan_cache_t));
+    if (!cache) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        int errnum = pthread_mutex_init(&cache->shards[i].mutex, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return cache;
+}
+
+/**
+ * @brief Loads a cache file.
+ *
+ * A missing file gives an empty cache. An unreadable, truncated or
+ * foreign file (other version or byte order) is reported on stderr and
+ * also gives an empty cache, so the scan simply runs in full.
+ */
+scan_cache_t *scan_cache_load(const char *file) {
+    scan_cache_t *cache = scan_cache_create();
+
+    size_t size = 0;
+    cache->data = read_file(file, &size);
+    if (!cache->data) {
+        if (errno != ENOENT) {
+            perror(file);
+        }
+        return cache;
+    }
+
+    uint32_t version = 0;
+    uint32_t byte_order = 0;
+    uint64_t count = 0;
+    int valid = size >= 24 && memcmp(cache->data, CACHE_MAGIC, 8) == 0;
+    if (valid) {
+        memcpy(&version, cache->data + 8, 4);
+        memcpy(&byte_order, cache->data + 12, 4);
+        memcpy(&count, cache->data + 16, 8);
+        valid = version == CACHE_VERSION && byte_order == CACHE_BYTE_ORDER && parse_entries(cache, size, count) == 0;
+    }
+
+    if (!valid) {
+        fprintf(stderr, "%s: not a usable cache file, ignoring it\n", file);
+        free(cache->entries);
+        free(cache->index);
+        free(cache->data);
+        cache->entries = NULL;
+        cache->index = NULL;
+        cache->data = NULL;
+        cache->num_entries = 0;
+        cache->index_capacity = 0;
+    }
+    return cache;
+}
+
+/**
+ * @brief Fills a stamp from a directory's stat data.
+ */
+void dir_stamp_from_stat(dir_stamp_t *stamp, const struct stat *st) {
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+    stamp->ctime_sec = st->st_ctim.tv_sec;
+    stamp->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/**
+ * @brief Looks up a directory in the loaded generation.
+ * Returns the entry only if device, inode and both times match, else NULL.
+ * Safe to call from any number of threads.
+ */
+const cache_entry_t *scan_cache_lookup(scan_cache_t *cache, const dir_stamp_t *stamp) {
+    if (!cache->index) {
+        return NULL;
+    }
+
+    size_t mask = cache->index_capacity - 1;
+    for (size_t slot = hash_dir(stamp->dev, stamp->ino) & mask; cache->index[slot]; slot = (slot + 1) & mask) {
+        const cache_entry_t *entry = cache->index[slot];
+        if (entry->stamp.dev == stamp->dev && entry->stamp.ino == stamp->ino) {
+            return memcmp(&entry->stamp, stamp, sizeof(*stamp)) == 0 ? entry : NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Carries an entry of the loaded generation over to the next one.
+ * The entry is not copied. Safe to call from any number of threads.
+ */
+void scan_cache_keep(scan_cache_t *cache, const cache_entry_t *entry) {
+    add_record(cache, entry, 0);
+}
+
+/**
+ * @brief Copies a freshly scanned entry into the next generation.
+ * The links and subdirectory names are copied as well, so the caller may
+ * reuse its buffers. Safe to call from any number of threads.
+ */
+void scan_cache_store(scan_cache_t *cache, const cache_entry_t *entry) {
+    size_t links_size = entry->num_links * sizeof(cache_link_t);
+    cache_entry_t *copy = malloc(sizeof(cache_entry_t) + links_size + entry->subdirs_size);
+    if (!copy) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    *copy = *entry;
+    char *tail = (char *)(copy + 1);
+    if (links_size > 0) {
+        memcpy(tail, entry->links, links_size);
+    }
+    if (entry->subdirs_size > 0) {
+        memcpy(tail + links_size, entry->subdirs, entry->subdirs_size);
+    }
+    copy->links = (const cache_link_t *)tail;
+    copy->subdirs = tail + links_size;
+    add_record(cache, copy, 1);
+}
+
+/**
+ * @brief Writes the next generation to file.
+ *
+ * The cache is written to a temporary file next to the target and renamed
+ * over it, so readers never see a partial file. Returns 0 on success and
+ * -1 after reporting an error.
+ */
+int scan_cache_save(scan_cache_t *cache, const char *file) {
+    size_t length = strlen(file) + 32;
+    char *tmp = malloc(length);
+    if (!tmp) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tmp, length, "%s.tmp.%ld", file, (long)getpid());
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    uint32_t version = CACHE_VERSION;
+    uint32_t byte_order = CACHE_BYTE_ORDER;
+    uint64_t count = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        count += cache->shards[i].count;
+    }
+
+    int failed = fwrite(CACHE_MAGIC, 1, 8, fp) != 8 || fwrite(&version, 4, 1, fp) != 1 ||
+                 fwrite(&byte_order, 4, 1, fp) != 1 || fwrite(&count, 8, 1, fp) != 1;
+    for (int i = 0; i < CACHE_SHARDS && !failed; i++) {
+        for (size_t j = 0; j < cache->shards[i].count && !failed; j++) {
+            failed = write_entry(fp, cache->shards[i].records[j].entry) == -1;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp, file) == -1) {
+        perror(file);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+/**
+ * @brief Destroys the cache and frees both generations.
+ */
+void scan_cache_destroy(scan_cache_t *cache) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        for (size_t j = 0; j < shard->count; j++) {
+            if (shard->records[j].owned) {
+                free((void *)shard->records[j].entry);
+            }
+        }
+        free(shard->records);
+
+        int errnum = pthread_mutex_destroy(&shard->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(cache->index);
+    free(cache->entries);
+    free(cache->data);
+    free(cache);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file scan_cache.h
+ * @brief On-disk cache of per-directory subtotals for incremental re-scans.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * A directory's entry is keyed by its device and inode and is only valid
+ * while the directory's mtime and ctime are unchanged, i.e. while no entry
+ * has been added, removed or renamed in it. A valid entry lets a scan skip
+ * reading the directory: it replays the blocks of the directory's files and
+ * descends into the recorded subdirectories, which are checked in turn.
+ * Files that grow in place without any directory change are not noticed
+ * until the entry is invalidated or the cache is verified.
+ */
+
+#ifndef SCAN_CACHE_H
+#define SCAN_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * @struct dir_stamp_t
+ * @brief Identity and change times of a directory.
+ */
+typedef struct {
+    uint64_t dev;       /**< Device of the directory */
+    uint64_t ino;       /**< Inode of the directory */
+    int64_t mtime_sec;  /**< Modification time, seconds */
+    int64_t mtime_nsec; /**< Modification time, nanoseconds */
+    int64_t ctime_sec;  /**< Status change time, seconds */
+    int64_t ctime_nsec; /**< Status change time, nanoseconds */
+} dir_stamp_t;
+
+/**
+ * @struct cache_link_t
+ * @brief A hard-linked file recorded in a directory entry.
+ */
+typedef struct {
+    uint64_t dev;    /**< Device of the file */
+    uint64_t ino;    /**< Inode of the file */
+    uint64_t blocks; /**< Blocks the file occupies */
+} cache_link_t;
+
+/**
+ * @struct cache_entry_t
+ * @brief Cached contents of one directory.
+ */
+typedef struct {
+    dir_stamp_t stamp;         /**< Key and validators */
+    uint64_t own_blocks;       /**< Blocks of files with a single link */
+    uint32_t num_links;        /**< Number of hard-linked files */
+    uint32_t num_subdirs;      /**< Number of subdirectories */
+    const cache_link_t *links; /**< Hard-linked files, counted through the link set */
+    const char *subdirs;       /**< Subdirectory names, each terminated by NUL */
+    uint64_t subdirs_size;     /**< Bytes used by subdirs */
+} cache_entry_t;
+
+typedef struct scan_cache scan_cache_t;
+scan_cache_t *scan_cache_create(void);
+scan_cache_t *scan_cache_load(const char *file);
+void dir_stamp_from_stat(dir_stamp_t *stamp, const struct stat *st);
+const cache_entry_t *scan_cache_lookup(scan_cache_t *cache, const dir_stamp_t *stamp);
+void scan_cache_keep(scan_cache_t *cache, const cache_entry_t *entry);
+void scan_cache_store(scan_cache_t *cache, const cache_entry_t *entry);
+int scan_cache_save(scan_cache_t *cache, const char *file);
+void scan_cache_destroy(scan_cache_t *cache);
+
+#endif // SCAN_CACHE_H
@@ -0,0 +1,633 @@
+/**
+ * @file snapshot.c
+ * @brief Implementation of scan snapshots: building them from a scan, writing and mapping them.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * While a scan runs, the builder turns every visited directory's path into
+ * a chain of nodes, interning the names and finding each node by its
+ * parent and name in a hash table, so a path costs one lookup per name.
+ * Directories are visited in any order, so a node may be created by a
+ * descendant before its own summary arrives. Writing sorts the nodes into
+ * pre-order and sums the subtree totals bottom-up.
+ *
+ * File layout, all in native byte order:
+ *   header   magic "MDUSNAP\0", version, byte order mark, node count, size of the names
+ *   columns  parent, end and name as uint32_t, padded to 8 bytes, then
+ *            total, own, dev and ino as uint64_t
+ *   names    the interned NUL-terminated names
+ */
+
+#include "snapshot.h"
+#include "safe_lock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** Identifies a snapshot file. */
+#define SNAPSHOT_MAGIC "MDUSNAP"
+
+/** Version of the file layout. */
+#define SNAPSHOT_VERSION 1
+
+/** Written as is, so a file from a machine of the other byte order is recognized. */
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+/** Bytes of the header: magic, version, byte order, node count and names size. */
+#define HEADER_SIZE 32
+
+/** Initial number of slots in the builder's hash tables, a power of two. */
+#define TABLE_INITIAL_SLOTS 1024
+
+/**
+ * @struct build_node_t
+ * @brief A directory collected by the builder.
+ */
+typedef struct {
+    uint32_t parent;     /**< Index of the parent, SNAPSHOT_NONE for a scanned path */
+    uint32_t name;       /**< Offset of the interned name */
+    uint64_t own_blocks; /**< Blocks of the directory itself and its non-directory entries */
+    uint64_t dev;        /**< Device of the directory */
+    uint64_t ino;        /**< Inode of the directory */
+} build_node_t;
+
+/**
+ * @struct hash_table_t
+ * @brief Open-addressing table of uint32_t values plus one, 0 marking an empty slot.
+ */
+typedef struct {
+    uint32_t *slots; /**< Slots, a power of two of them */
+    size_t capacity; /**< Number of slots */
+    size_t count;    /**< Occupied slots */
+} hash_table_t;
+
+/**
+ * @struct snapshot_builder
+ * @brief Internal structure collecting the nodes of a scan.
+ */
+struct snapshot_builder {
+    pthread_mutex_t mutex;  /**< Serializes collecting, as the workers visit directories at once */
+    build_node_t *nodes;    /**< Collected nodes */
+    size_t num_nodes;       /**< Number of nodes */
+    size_t nodes_capacity;  /**< Allocated nodes */
+    char *names;            /**< Interned names, NUL-terminated */
+    size_t names_size;      /**< Bytes used in names */
+    size_t names_capacity;  /**< Bytes allocated for names */
+    hash_table_t by_name;   /**< Offsets of the interned names, by name */
+    hash_table_t by_parent; /**< Nodes, by parent and name */
+};
+
+/**
+ * @struct sort_key_t
+ * @brief A node with the keys it is ordered by for writing.
+ */
+typedef struct {
+    uint32_t parent;  /**< Parent, SNAPSHOT_NONE sorting the scanned paths last */
+    const char *name; /**< Name */
+    uint32_t node;    /**< Index in the builder */
+} sort_key_t;
+
+/**
+ * @brief FNV-1a hash of length bytes at text.
+ */
+static uint64_t hash_bytes(const char *text, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hash of a node's key, its parent and the offset of its name.
+ */
+static uint64_t hash_child(uint32_t parent, uint32_t name) {
+    uint64_t x = ((uint64_t)parent << 32 | name) * 0x9e3779b97f4a7c15ull;
+    return x ^ (x >> 29);
+}
+
+/**
+ * @brief Allocates the slots of an empty table.
+ */
+static void table_init(hash_table_t *table) {
+    table->slots = calloc(TABLE_INITIAL_SLOTS, sizeof(uint32_t));
+    if (!table->slots) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    table->capacity = TABLE_INITIAL_SLOTS;
+    table->count = 0;
+}
+
+/**
+ * @brief Doubles a table once it is half full, rehashing its values with hash_value.
+ */
+static void table_grow(snapshot_builder_t *builder, hash_table_t *table,
+                       uint64_t (*hash_value)(const snapshot_builder_t *builder, uint32_t value)) {
+    if (2 * (table->count + 1) <= table->capacity) {
+        return;
+    }
+    size_t capacity = table->capacity * 2;
+    uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+    if (!slots) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i]) {
+            size_t slot = hash_value(builder, table->slots[i] - 1) & (capacity - 1);
+            while (slots[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = table->slots[i];
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+/**
+ * @brief Rehash function of the names table.
+ */
+static uint64_t hash_name_value(const snapshot_builder_t *builder, uint32_t name) {
+    const char *text = builder->names + name;
+    return hash_bytes(text, strlen(text));
+}
+
+/**
+ * @brief Rehash function of the nodes table.
+ */
+static uint64_t hash_node_value(const snapshot_builder_t *builder, uint32_t node) {
+    return hash_child(builder->nodes[node].parent, builder->nodes[node].name);
+}
+
+/**
+ * @brief Exits if a count no longer fits the 32-bit indexes of the file format.
+ */
+static void check_limit(size_t count) {
+    if (count >= SNAPSHOT_NONE) {
+        fprintf(stderr, "snapshot: too many directories or names\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Returns the offset of the interned copy of the length bytes at text, adding it if new.
+ */
+static uint32_t intern_name(snapshot_builder_t *builder, const char *text, size_t length) {
+    hash_table_t *table = &builder->by_name;
+    table_grow(builder, table, hash_name_value);
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_bytes(text, length) & mask;
+    for (; table->slots[slot]; slot = (slot + 1) & mask) {
+        const char *name = builder->names + table->slots[slot] - 1;
+        if (strncmp(name, text, length) == 0 && name[length] == '\0') {
+            return table->slots[slot] - 1;
+        }
+    }
+
+    if (builder->names_size + length + 1 > builder->names_capacity) {
+        size_t capacity = builder->names_capacity ? builder->names_capacity : 1 << 16;
+        while (builder->names_size + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *names = realloc(builder->names, capacity);
+        if (!names) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        builder->names = names;
+        builder->names_capacity = capacity;
+    }
+    check_limit(builder->names_size + length + 1);
+    uint32_t name = builder->names_size;
+    memcpy(builder->names + name, text, length);
+    builder->names[name + length] = '\0';
+    builder->names_size += length + 1;
+    table->slots[slot] = name + 1;
+    table->count++;
+    return name;
+}
+
+/**
+ * @brief Returns the node named name below parent, adding an empty one if new.
+ */
+static uint32_t child_node(snapshot_builder_t *builder, uint32_t parent, uint32_t name) {
+    hash_table_t *table = &builder->by_parent;
+    table_grow(builder, table, hash_node_value);
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_child(parent, name) & mask;
+    for (; table->slots[slot]; slot = (slot + 1) & mask) {
+        const build_node_t *node = &builder->nodes[table->slots[slot] - 1];
+        if (node->parent == parent && node->name == name) {
+            return table->slots[slot] - 1;
+        }
+    }
+
+    if (builder->num_nodes == builder->nodes_capacity) {
+        size_t capacity = builder->nodes_capacity ? builder->nodes_capacity * 2 : 1024;
+        build_node_t *nodes = realloc(builder->nodes, capacity * sizeof(build_node_t));
+        if (!nodes) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        builder->nodes = nodes;
+        builder->nodes_capacity = capacity;
+    }
+    check_limit(builder->num_nodes + 1);
+    uint32_t node = builder->num_nodes++;
+    builder->nodes[node] = (build_node_t){.parent = parent, .name = name};
+    table->slots[slot] = node + 1;
+    table->count++;
+    return node;
+}
+
+/**
+ * @brief Orders nodes by parent, then by name.
+ */
+static int compare_keys(const void *a, const void *b) {
+    const sort_key_t *key_a = a;
+    const sort_key_t *key_b = b;
+    if (key_a->parent != key_b->parent) {
+        return key_a->parent < key_b->parent ? -1 : 1;
+    }
+    return strcmp(key_a->name, key_b->name);
+}
+
+/**
+ * @brief Returns the number of bytes of a file with num_nodes nodes and names_size bytes of names.
+ */
+static size_t file_size(size_t num_nodes, size_t names_size) {
+    return HEADER_SIZE + (3 * 4 * num_nodes + 7) / 8 * 8 + 4 * 8 * num_nodes + names_size;
+}
+
+/**
+ * @brief Writes the columns of the nodes, put in pre-order, to fp.
+ * order lists the builder's nodes in pre-order. Returns -1 on a write error.
+ */
+static int write_columns(FILE *fp, const snapshot_builder_t *builder, const uint32_t *order,
+                         const uint32_t *position) {
+    size_t count = builder->num_nodes;
+    uint32_t *parent = malloc(count * sizeof(uint32_t));
+    uint32_t *end = malloc(count * sizeof(uint32_t));
+    uint32_t *name = malloc(count * sizeof(uint32_t));
+    uint64_t *total = malloc(count * sizeof(uint64_t));
+    uint64_t *columns = malloc(3 * count * sizeof(uint64_t));
+    if (!parent || !end || !name || !total || !columns) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const build_node_t *node = &builder->nodes[order[i]];
+        parent[i] = node->parent == SNAPSHOT_NONE ? SNAPSHOT_NONE : position[node->parent];
+        end[i] = i + 1;
+        name[i] = node->name;
+        total[i] = node->own_blocks;
+        columns[i] = node->own_blocks;
+        columns[count + i] = node->dev;
+        columns[2 * count + i] = node->ino;
+    }
+    for (size_t i = count; i-- > 0;) {
+        if (parent[i] != SNAPSHOT_NONE) {
+            total[parent[i]] += total[i];
+            if (end[i] > end[parent[i]]) {
+                end[parent[i]] = end[i];
+            }
+        }
+    }
+
+    static const char zeros[8] = {0};
+    size_t padding = (3 * 4 * count + 7) / 8 * 8 - 3 * 4 * count;
+    int failed = fwrite(parent, 4, count, fp) != count || fwrite(end, 4, count, fp) != count ||
+                 fwrite(name, 4, count, fp) != count || fwrite(zeros, 1, padding, fp) != padding ||
+                 fwrite(total, 8, count, fp) != count || fwrite(columns, 8, 3 * count, fp) != 3 * count;
+    free(parent);
+    free(end);
+    free(name);
+    free(total);
+    free(columns);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Puts the builder's nodes in pre-order, siblings by name.
+ * Returns the order, and stores each node's place in it in *position.
+ */
+static uint32_t *preorder(const snapshot_builder_t *builder, uint32_t **position) {
+    size_t count = builder->num_nodes;
+    sort_key_t *keys = malloc(count * sizeof(sort_key_t));
+    uint32_t *first_child = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc(count * sizeof(uint32_t));
+    uint32_t *places = malloc(count * sizeof(uint32_t));
+    uint32_t *stack = malloc(count * sizeof(uint32_t));
+    if (!keys || !first_child || !order || !places || !stack) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = (sort_key_t){.parent = builder->nodes[i].parent,
+                               .name = builder->names + builder->nodes[i].name,
+                               .node = i};
+    }
+    qsort(keys, count, sizeof(sort_key_t), compare_keys);
+
+    // The children of node p are keys[first_child[p]] up to keys[first_child[p + 1]], and the
+    // scanned paths, sorting last, follow from first_child[count].
+    size_t k = 0;
+    for (size_t p = 0; p <= count; p++) {
+        first_child[p] = k;
+        while (k < count && keys[k].parent == p) {
+            k++;
+        }
+    }
+
+    size_t placed = 0;
+    for (size_t root = first_child[count]; root < count; root++) {
+        size_t depth = 0;
+        stack[depth++] = keys[root].node;
+        while (depth > 0) {
+            uint32_t node = stack[--depth];
+            places[node] = placed;
+            order[placed++] = node;
+            for (size_t child = first_child[node + 1]; child-- > first_child[node];) {
+                stack[depth++] = keys[child].node;
+            }
+        }
+    }
+
+    free(keys);
+    free(first_child);
+    free(stack);
+    *position = places;
+    return order;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty builder, to be set as a scan's visitor with snapshot_collect().
+ * Exits the program if allocation fails.
+ */
+snapshot_builder_t *snapshot_builder_create(void) {
+    snapshot_builder_t *builder = calloc(1, sizeof(snapshot_builder_t));
+    if (!builder) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    int errnum = pthread_mutex_init(&builder->mutex, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    table_init(&builder->by_name);
+    table_init(&builder->by_parent);
+    return builder;
+}
+
+/**
+ * @brief Adds a listed directory to the builder passed as context; a dir_visit_fn.
+ * The last summary.depth names of the path lead from the scanned path,
+ * which is the rest, to the directory. Safe to call from several workers
+ * at once.
+ */
+void snapshot_collect(const dir_summary_t *summary, void *context) {
+    snapshot_builder_t *builder = context;
+    const char *path = summary->path;
+    size_t root_length = strlen(path);
+    for (unsigned int i = 0; i < summary->depth; i++) {
+        while (root_length > 0 && path[--root_length] != '/') {
+        }
+    }
+
+    safe_lock(&builder->mutex);
+    uint32_t node = child_node(builder, SNAPSHOT_NONE, intern_name(builder, path, root_length));
+    for (const char *name = path + root_length; *name;) {
+        name++;
+        size_t length = strcspn(name, "/");
+        node = child_node(builder, node, intern_name(builder, name, length));
+        name += length;
+    }
+    build_node_t *built = &builder->nodes[node];
+    built->own_blocks = summary->dir_blocks + summary->file_blocks;
+    built->dev = summary->dev;
+    built->ino = summary->ino;
+    safe_unlock(&builder->mutex);
+}
+
+/**
+ * @brief Writes the collected nodes to file.
+ * The snapshot is written to a temporary file next to the target and
+ * renamed over it, so readers never map a partial file. Returns 0 on
+ * success and -1 after reporting an error.
+ */
+int snapshot_write(snapshot_builder_t *builder, const char *file) {
+    size_t length = strlen(file) + 32;
+    char *tmp = malloc(length);
+    if (!tmp) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(tmp, length, "%s.tmp.%ld", file, (long)getpid());
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    uint32_t *position;
+    uint32_t *order = preorder(builder, &position);
+    uint32_t version = SNAPSHOT_VERSION;
+    uint32_t byte_order = SNAPSHOT_BYTE_ORDER;
+    uint64_t count = builder->num_nodes;
+    uint64_t names_size = builder->names_size;
+    int failed = fwrite(SNAPSHOT_MAGIC, 1, 8, fp) != 8 || fwrite(&version, 4, 1, fp) != 1 ||
+                 fwrite(&byte_order, 4, 1, fp) != 1 || fwrite(&count, 8, 1, fp) != 1 ||
+                 fwrite(&names_size, 8, 1, fp) != 1 || write_columns(fp, builder, order, position) == -1 ||
+                 fwrite(builder->names, 1, names_size, fp) != names_size;
+    free(order);
+    free(position);
+
+    if (fclose(fp) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp, file) == -1) {
+        perror(file);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+/**
+ * @brief Frees a builder and the nodes it collected.
+ */
+void snapshot_builder_destroy(snapshot_builder_t *builder) {
+    pthread_mutex_destroy(&builder->mutex);
+    free(builder->nodes);
+    free(builder->names);
+    free(builder->by_name.slots);
+    free(builder->by_parent.slots);
+    free(builder);
+}
+
+/**
+ * @brief Maps a snapshot file.
+ * The indexes in it are checked once, so that walking the nodes can never
+ * leave the mapping. Returns NULL with errno set if the file cannot be
+ * read, and with errno set to EINVAL if it is not a snapshot of this
+ * version and byte order.
+ */
+snapshot_t *snapshot_open(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    size_t size = file_stat.st_size;
+    void *map = size >= HEADER_SIZE ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    int saved_errno = map == MAP_FAILED ? errno : EINVAL;
+    close(fd);
+    if (!map || map == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+
+    const char *data = map;
+    uint32_t version, byte_order;
+    uint64_t count, names_size;
+    memcpy(&version, data + 8, 4);
+    memcpy(&byte_order, data + 12, 4);
+    memcpy(&count, data + 16, 8);
+    memcpy(&names_size, data + 24, 8);
+    int valid = memcmp(data, SNAPSHOT_MAGIC, 8) == 0 && version == SNAPSHOT_VERSION &&
+                byte_order == SNAPSHOT_BYTE_ORDER && count < SNAPSHOT_NONE && names_size < SNAPSHOT_NONE &&
+                size == file_size(count, names_size) && (count == 0 || (names_size > 0 && data[size - 1] == '\0'));
+    if (!valid) {
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snapshot_t *snapshot = malloc(sizeof(snapshot_t));
+    if (!snapshot) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->num_nodes = count;
+    snapshot->parent = (const uint32_t *)(data + HEADER_SIZE);
+    snapshot->end = snapshot->parent + count;
+    snapshot->name = snapshot->end + count;
+    snapshot->total = (const uint64_t *)(data + HEADER_SIZE + (3 * 4 * count + 7) / 8 * 8);
+    snapshot->own = snapshot->total + count;
+    snapshot->dev = snapshot->own + count;
+    snapshot->ino = snapshot->dev + count;
+    snapshot->names = (const char *)(snapshot->ino + count);
+    snapshot->map = map;
+    snapshot->map_size = size;
+
+    for (uint32_t i = 0; valid && i < count; i++) {
+        valid = snapshot->end[i] > i && snapshot->end[i] <= count && snapshot->name[i] < names_size &&
+                (snapshot->parent[i] == SNAPSHOT_NONE || snapshot->parent[i] < i);
+    }
+    if (!valid) {
+        snapshot_close(snapshot);
+        errno = EINVAL;
+        return NULL;
+    }
+    return snapshot;
+}
+
+/**
+ * @brief Returns the node of a directory given by path, or SNAPSHOT_NONE.
+ * The path starts with one of the scanned paths as it was given; further
+ * slashes between names are ignored.
+ */
+uint32_t snapshot_find(const snapshot_t *snapshot, const char *path) {
+    for (uint32_t root = 0; root < snapshot->num_nodes; root = snapshot->end[root]) {
+        const char *root_name = snapshot->names + snapshot->name[root];
+        size_t length = strlen(root_name);
+        while (length > 1 && root_name[length - 1] == '/') {
+            length--;
+        }
+        const char *rest = path + length;
+        if (strncmp(path, root_name, length) != 0 || (*rest && *rest != '/' && root_name[length - 1] != '/')) {
+            continue;
+        }
+
+        uint32_t node = root;
+        while (node != SNAPSHOT_NONE) {
+            rest += strspn(rest, "/");
+            if (!*rest) {
+                return node;
+            }
+            size_t part = strcspn(rest, "/");
+            uint32_t parent = node;
+            node = SNAPSHOT_NONE;
+            for (uint32_t child = parent + 1; child < snapshot->end[parent]; child = snapshot->end[child]) {
+                const char *name = snapshot->names + snapshot->name[child];
+                if (strncmp(name, rest, part) == 0 && name[part] == '\0') {
+                    node = child;
+                    break;
+                }
+            }
+            rest += part;
+        }
+    }
+    return SNAPSHOT_NONE;
+}
+
+/**
+ * @brief Returns the path of a node, built like the paths of a scan. The caller frees it.
+ */
+char *snapshot_path(const snapshot_t *snapshot, uint32_t node) {
+    size_t length = 0;
+    for (uint32_t n = node; n != SNAPSHOT_NONE; n = snapshot->parent[n]) {
+        length += strlen(snapshot->names + snapshot->name[n]) + 1;
+    }
+
+    char *path = malloc(length);
+    if (!path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = length - 1;
+    path[pos] = '\0';
+    for (uint32_t n = node; n != SNAPSHOT_NONE; n = snapshot->parent[n]) {
+        const char *name = snapshot->names + snapshot->name[n];
+        size_t part = strlen(name);
+        pos -= part;
+        memcpy(path + pos, name, part);
+        if (pos > 0) {
+            path[--pos] = '/';
+        }
+    }
+    return path;
+}
+
+/**
+ * @brief Unmaps a snapshot.
+ */
+void snapshot_close(snapshot_t *snapshot) {
+    munmap(snapshot->map, snapshot->map_size);
+    free(snapshot);
+}
@@ -0,0 +1,58 @@
+/**
+ * @file snapshot.h
+ * @brief Compact, memory-mappable snapshots of the directory tree a scan found.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * A snapshot holds one node per directory listed, in columns: the parent,
+ * the end of the subtree, the name, the subtree total, the directory's own
+ * blocks (itself plus its non-directory entries) and its device and inode.
+ * Nodes are stored in pre-order with siblings sorted by name, so a subtree
+ * is the range of nodes from its root up to its end, and two snapshots can
+ * be compared by walking them side by side. Names are interned: every
+ * distinct name is stored once, and a node refers to it by offset. A
+ * snapshot is read by mapping the file; nothing is parsed or copied.
+ * Like the scan cache, the file is only valid on machines with the same
+ * byte order.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "dirsize.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/** Parent of a root node, and the index returned for a path not in a snapshot. */
+#define SNAPSHOT_NONE UINT32_MAX
+
+typedef struct snapshot_builder snapshot_builder_t;
+
+/**
+ * @struct snapshot_t
+ * @brief A mapped snapshot; the columns point into the mapping and are indexed by node.
+ */
+typedef struct {
+    uint32_t num_nodes;     /**< Number of nodes */
+    const uint32_t *parent; /**< Index of the parent, SNAPSHOT_NONE for a scanned path */
+    const uint32_t *end;    /**< Index past the last node of the subtree */
+    const uint32_t *name;   /**< Offset of the name in names, the path as given for a scanned path */
+    const uint64_t *total;  /**< Blocks of the subtree, every hard link counted */
+    const uint64_t *own;    /**< Blocks of the directory itself and its non-directory entries */
+    const uint64_t *dev;    /**< Device of the directory */
+    const uint64_t *ino;    /**< Inode of the directory */
+    const char *names;      /**< NUL-terminated names */
+    void *map;              /**< The mapped file */
+    size_t map_size;        /**< Bytes mapped */
+} snapshot_t;
+
+snapshot_builder_t *snapshot_builder_create(void);
+void snapshot_collect(const dir_summary_t *summary, void *context);
+int snapshot_write(snapshot_builder_t *builder, const char *file);
+void snapshot_builder_destroy(snapshot_builder_t *builder);
+snapshot_t *snapshot_open(const char *file);
+uint32_t snapshot_find(const snapshot_t *snapshot, const char *path);
+char *snapshot_path(const snapshot_t *snapshot, uint32_t node);
+void snapshot_close(snapshot_t *snapshot);
+
+#endif // SNAPSHOT_H
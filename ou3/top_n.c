@@ -0,0 +1,177 @@
+/**
+ * @file top_n.c
+ * @brief Implementation of a bounded min-heap of the largest entries.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * The smallest kept entry sits at the root, so deciding whether a new one
+ * gets in takes one comparison and replacing the smallest takes O(log N).
+ * Entries with equal blocks are ordered by path, which makes the kept set
+ * independent of the order entries are offered in, and thus of how the
+ * work was spread over the threads.
+ */
+
+#include "top_n.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* --- INTERNAL --- */
+
+/**
+ * @struct top_n
+ * @brief Internal structure holding the heap.
+ */
+struct top_n {
+    top_entry_t *entries; /**< Min-heap of kept entries, the smallest at index 0 */
+    size_t size;          /**< Number of kept entries */
+    size_t capacity;      /**< Most entries kept */
+};
+
+/**
+ * @brief Compares two entries, largest first: negative if a ranks above b.
+ * Blocks decide; equal blocks are ranked by path in ascending order.
+ */
+static int entry_compare(const top_entry_t *a, const top_entry_t *b) {
+    if (a->blocks != b->blocks) {
+        return a->blocks > b->blocks ? -1 : 1;
+    }
+    return strcmp(a->path, b->path);
+}
+
+/**
+ * @brief qsort adapter for entry_compare.
+ */
+static int entry_compare_qsort(const void *a, const void *b) {
+    return entry_compare(a, b);
+}
+
+/**
+ * @brief Moves the entry at index down until neither child ranks below it.
+ */
+static void sift_down(top_n_t *top, size_t index) {
+    top_entry_t *entries = top->entries;
+    for (;;) {
+        size_t lowest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < top->size && entry_compare(&entries[left], &entries[lowest]) > 0) {
+            lowest = left;
+        }
+        if (right < top->size && entry_compare(&entries[right], &entries[lowest]) > 0) {
+            lowest = right;
+        }
+        if (lowest == index) {
+            return;
+        }
+        top_entry_t swap = entries[index];
+        entries[index] = entries[lowest];
+        entries[lowest] = swap;
+        index = lowest;
+    }
+}
+
+/**
+ * @brief Moves the entry at index up while it ranks below its parent.
+ */
+static void sift_up(top_n_t *top, size_t index) {
+    top_entry_t *entries = top->entries;
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (entry_compare(&entries[index], &entries[parent]) <= 0) {
+            return;
+        }
+        top_entry_t swap = entries[index];
+        entries[index] = entries[parent];
+        entries[parent] = swap;
+        index = parent;
+    }
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates an empty collection keeping at most capacity entries.
+ * capacity must be greater than 0. Exits the program if allocation fails.
+ */
+top_n_t *top_n_create(size_t capacity) {
+    top_n_t *top = malloc(sizeof(top_n_t));
+    top_entry_t *entries = malloc(capacity * sizeof(top_entry_t));
+    if (!top || !entries) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    top->entries = entries;
+    top->size = 0;
+    top->capacity = capacity;
+    return top;
+}
+
+/**
+ * @brief Returns the most entries the collection keeps.
+ */
+size_t top_n_capacity(const top_n_t *top) {
+    return top->capacity;
+}
+
+/**
+ * @brief Returns non-zero if an entry with this many blocks could be kept.
+ * Lets the caller skip building the path of an entry that would be
+ * dropped right away, which is the case for nearly all of them.
+ */
+int top_n_accepts(const top_n_t *top, uint64_t blocks) {
+    return top->size < top->capacity || blocks >= top->entries[0].blocks;
+}
+
+/**
+ * @brief Offers an entry, taking ownership of the malloc'ed path.
+ * Once the collection is full, the entry replaces the smallest kept one
+ * if it ranks above it; the path of whichever entry is dropped is freed.
+ */
+void top_n_add(top_n_t *top, uint64_t blocks, char *path) {
+    top_entry_t entry = {.blocks = blocks, .path = path};
+    if (top->size < top->capacity) {
+        top->entries[top->size++] = entry;
+        sift_up(top, top->size - 1);
+        return;
+    }
+    if (entry_compare(&entry, &top->entries[0]) >= 0) {
+        free(path);
+        return;
+    }
+    free(top->entries[0].path);
+    top->entries[0] = entry;
+    sift_down(top, 0);
+}
+
+/**
+ * @brief Moves all entries of other into top, leaving other empty.
+ */
+void top_n_merge(top_n_t *top, top_n_t *other) {
+    for (size_t i = 0; i < other->size; i++) {
+        top_n_add(top, other->entries[i].blocks, other->entries[i].path);
+    }
+    other->size = 0;
+}
+
+/**
+ * @brief Sorts the kept entries, largest first, and returns them.
+ * The sorted array replaces the heap, so no entries may be added
+ * afterwards. The entries stay owned by the collection.
+ */
+const top_entry_t *top_n_sorted(top_n_t *top, size_t *count) {
+    qsort(top->entries, top->size, sizeof(top_entry_t), entry_compare_qsort);
+    *count = top->size;
+    return top->entries;
+}
+
+/**
+ * @brief Frees the collection and the paths it keeps.
+ */
+void top_n_destroy(top_n_t *top) {
+    for (size_t i = 0; i < top->size; i++) {
+        free(top->entries[i].path);
+    }
+    free(top->entries);
+    free(top);
+}
@@ -0,0 +1,36 @@
+/**
+ * @file top_n.h
+ * @brief Bounded collection of the largest entries of a scan, by blocks.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Keeps the N largest (blocks, path) pairs offered to it in a min-heap, so
+ * memory depends on N and not on the size of the tree. Not thread-safe:
+ * parallel scans keep one per worker and merge them after the join.
+ */
+
+#ifndef TOP_N_H
+#define TOP_N_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @struct top_entry_t
+ * @brief One kept entry.
+ */
+typedef struct {
+    uint64_t blocks; /**< Blocks of the file, or of the whole directory */
+    char *path;      /**< Path of the entry, starting with the scanned path */
+} top_entry_t;
+
+typedef struct top_n top_n_t;
+top_n_t *top_n_create(size_t capacity);
+size_t top_n_capacity(const top_n_t *top);
+int top_n_accepts(const top_n_t *top, uint64_t blocks);
+void top_n_add(top_n_t *top, uint64_t blocks, char *path);
+void top_n_merge(top_n_t *top, top_n_t *other);
+const top_entry_t *top_n_sorted(top_n_t *top, size_t *count);
+void top_n_destroy(top_n_t *top);
+
+#endif // TOP_N_H
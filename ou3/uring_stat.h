@@ -0,0 +1,35 @@
+/**
+ * @file uring_stat.h
+ * @brief Batched statx submission through io_uring.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * A ring belongs to one thread. It stats a whole batch of names relative
+ * to one directory fd while keeping many requests in flight at once.
+ */
+
+#ifndef URING_STAT_H
+#define URING_STAT_H
+
+#include <stddef.h>
+
+/**
+ * @struct uring_stat_result_t
+ * @brief Outcome of one statx request in a batch.
+ */
+typedef struct {
+    int error;                 /**< 0 on success, otherwise an errno value */
+    int is_dir;                /**< Non-zero if the entry is a directory */
+    unsigned long long blocks; /**< Allocated 512-byte blocks */
+    unsigned long long dev;    /**< Device the entry lives on */
+    unsigned long long ino;    /**< Inode number */
+    unsigned int nlink;        /**< Number of hard links */
+} uring_stat_result_t;
+
+typedef struct uring_stat uring_stat_t;
+uring_stat_t *uring_stat_create(unsigned int entries);
+void uring_stat_batch(uring_stat_t *ring, int dirfd, char *const *names, uring_stat_result_t *results,
+                      size_t count);
+void uring_stat_destroy(uring_stat_t *ring);
+
+#endif // URING_STAT_H
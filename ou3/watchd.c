@@ -0,0 +1,1074 @@
+/**
+ * @file watchd.c
+ * @brief Implementation of the live disk-usage daemon and its query client.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Every directory in the tree is a node holding its own blocks (the
+ * directory itself plus the non-directory entries directly in it) and the
+ * total of its subtree. An inotify event in a directory marks it dirty;
+ * once the pending events are drained, each dirty directory is re-read on
+ * its own, the change in its own blocks is added to it and its ancestors,
+ * removed subdirectories are dropped and new ones are scanned with the
+ * engine. If the kernel's event queue overflows, events were lost and every
+ * root is scanned again.
+ *
+ * The tree is only touched by the thread running the event loop, so it
+ * needs no locks; only the collection of nodes during a scan is shared
+ * with the engine's workers.
+ */
+
+#define _GNU_SOURCE
+#include "watchd.h"
+#include "safe_lock.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* --- INTERNAL --- */
+
+/** Events that can change the blocks in a directory or its set of subdirectories. */
+#define WATCH_MASK                                                                                                     \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/** Most clients connected at once; further connections wait in the listen backlog. */
+#define MAX_CLIENTS 64
+
+/** Longest request line, a path plus its newline. */
+#define REQUEST_MAX (PATH_MAX + 1)
+
+/** Bytes of inotify events read at a time. */
+#define EVENT_BUFFER_SIZE 65536
+
+/**
+ * @struct watch_node
+ * @brief One directory in the in-memory tree.
+ */
+typedef struct watch_node {
+    char *path;                      /**< Normalized path of the directory */
+    uint64_t dev;                    /**< Device of the directory */
+    uint64_t ino;                    /**< Inode of the directory */
+    uint64_t own_blocks;             /**< The directory itself plus its non-directory entries */
+    uint64_t total_blocks;           /**< own_blocks plus the totals of all subdirectories */
+    int wd;                          /**< inotify watch descriptor, -1 if not watched */
+    int dirty;                       /**< Set while the node waits to be re-read */
+    unsigned int seen;               /**< Generation in which the parent last listed it */
+    struct watch_node *parent;       /**< Parent directory, NULL for a root */
+    struct watch_node *first_child;  /**< First subdirectory */
+    struct watch_node *prev_sibling; /**< Previous subdirectory of the parent */
+    struct watch_node *next_sibling; /**< Next subdirectory of the parent */
+    struct watch_node *path_next;    /**< Next node in the same path table bucket */
+    struct watch_node *wd_next;      /**< Next node in the same watch table bucket */
+} watch_node_t;
+
+/**
+ * @struct node_table_t
+ * @brief Chained hash table of nodes, keyed either by path or by watch descriptor.
+ */
+typedef struct {
+    watch_node_t **buckets; /**< Bucket heads */
+    size_t num_buckets;     /**< Always a power of two */
+    size_t count;           /**< Nodes in the table */
+} node_table_t;
+
+/**
+ * @struct client_t
+ * @brief A connected query client and its partial request line.
+ */
+typedef struct {
+    int fd;                   /**< Connection, -1 if the slot is free */
+    size_t length;            /**< Bytes buffered */
+    char buffer[REQUEST_MAX]; /**< Start of the current request line */
+} client_t;
+
+/**
+ * @struct watchd_t
+ * @brief State of a running daemon.
+ */
+typedef struct {
+    int inotify_fd;                /**< inotify instance watching every directory */
+    int listen_fd;                 /**< Listening Unix socket */
+    scan_ctx_t *scans;             /**< Context the scans run on, kept between them */
+    scan_options_t options;        /**< Scan options, with the visitor set */
+    node_table_t paths;            /**< Nodes by path */
+    node_table_t watches;          /**< Nodes by watch descriptor */
+    watch_node_t **roots;          /**< Root nodes, NULL where a root could not be scanned */
+    char **root_paths;             /**< Normalized root paths */
+    int num_roots;                 /**< Number of roots */
+    int *dirty;                    /**< Watch descriptors of dirty nodes */
+    size_t num_dirty;              /**< Entries in dirty */
+    size_t dirty_capacity;         /**< Allocated entries in dirty */
+    unsigned int generation;       /**< Bumped for every directory re-read */
+    int overflowed;                /**< Events were lost since the last scan */
+    watch_node_t **scanned;        /**< Nodes created by the running scan */
+    size_t num_scanned;            /**< Entries in scanned */
+    size_t scanned_capacity;       /**< Allocated entries in scanned */
+    size_t unwatched;              /**< Directories of the running scan that could not be watched */
+    pthread_mutex_t scan_mutex;    /**< Protects scanned and unwatched during a scan */
+    client_t clients[MAX_CLIENTS]; /**< Connected clients */
+} watchd_t;
+
+/** Set by the signal handler to stop the event loop. */
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * @brief Signal handler for SIGINT and SIGTERM.
+ */
+static void request_stop(int signum) {
+    (void)signum;
+    stop_requested = 1;
+}
+
+/**
+ * @brief Collapses repeated slashes and drops trailing ones, in place.
+ * "/" stays "/".
+ */
+static void normalize_path(char *path) {
+    char *out = path;
+    for (const char *in = path; *in; in++) {
+        if (*in == '/' && out > path && out[-1] == '/') {
+            continue;
+        }
+        *out++ = *in;
+    }
+    while (out > path + 1 && out[-1] == '/') {
+        out--;
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Returns a newly allocated "<dir>/<name>".
+ */
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_length = strlen(dir);
+    int slash = dir_length > 0 && dir[dir_length - 1] != '/';
+    char *path = malloc(dir_length + slash + strlen(name) + 1);
+    if (!path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, dir, dir_length);
+    if (slash) {
+        path[dir_length] = '/';
+    }
+    strcpy(path + dir_length + slash, name);
+    return path;
+}
+
+/**
+ * @brief Returns the number of components in a normalized path.
+ */
+static size_t path_depth(const char *path) {
+    size_t depth = 0;
+    for (; *path; path++) {
+        depth += *path == '/';
+    }
+    return depth;
+}
+
+/**
+ * @brief FNV-1a hash of a path.
+ */
+static size_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * @brief Returns the bucket of a watch descriptor.
+ */
+static size_t hash_wd(int wd) {
+    return (size_t)wd * 2654435761u;
+}
+
+/**
+ * @brief Allocates a table with the given number of buckets, a power of two.
+ */
+static void table_init(node_table_t *table, size_t num_buckets) {
+    table->buckets = calloc(num_buckets, sizeof(watch_node_t *));
+    if (!table->buckets) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    table->num_buckets = num_buckets;
+    table->count = 0;
+}
+
+/**
+ * @brief Doubles the path table and rehashes its nodes.
+ */
+static void path_table_grow(node_table_t *table) {
+    node_table_t grown;
+    table_init(&grown, table->num_buckets * 2);
+    for (size_t i = 0; i < table->num_buckets; i++) {
+        watch_node_t *node = table->buckets[i];
+        while (node) {
+            watch_node_t *next = node->path_next;
+            size_t bucket = hash_path(node->path) & (grown.num_buckets - 1);
+            node->path_next = grown.buckets[bucket];
+            grown.buckets[bucket] = node;
+            node = next;
+        }
+    }
+    grown.count = table->count;
+    free(table->buckets);
+    *table = grown;
+}
+
+/**
+ * @brief Returns the node with the given path, or NULL.
+ */
+static watch_node_t *path_table_find(const node_table_t *table, const char *path) {
+    watch_node_t *node = table->buckets[hash_path(path) & (table->num_buckets - 1)];
+    while (node && strcmp(node->path, path) != 0) {
+        node = node->path_next;
+    }
+    return node;
+}
+
+/**
+ * @brief Adds a node to the path table.
+ */
+static void path_table_insert(node_table_t *table, watch_node_t *node) {
+    if (table->count >= table->num_buckets) {
+        path_table_grow(table);
+    }
+    size_t bucket = hash_path(node->path) & (table->num_buckets - 1);
+    node->path_next = table->buckets[bucket];
+    table->buckets[bucket] = node;
+    table->count++;
+}
+
+/**
+ * @brief Removes a node from the path table.
+ */
+static void path_table_remove(node_table_t *table, watch_node_t *node) {
+    watch_node_t **link = &table->buckets[hash_path(node->path) & (table->num_buckets - 1)];
+    while (*link && *link != node) {
+        link = &(*link)->path_next;
+    }
+    if (*link) {
+        *link = node->path_next;
+        table->count--;
+    }
+}
+
+/**
+ * @brief Doubles the watch table and rehashes its nodes.
+ */
+static void wd_table_grow(node_table_t *table) {
+    node_table_t grown;
+    table_init(&grown, table->num_buckets * 2);
+    for (size_t i = 0; i < table->num_buckets; i++) {
+        watch_node_t *node = table->buckets[i];
+        while (node) {
+            watch_node_t *next = node->wd_next;
+            size_t bucket = hash_wd(node->wd) & (grown.num_buckets - 1);
+            node->wd_next = grown.buckets[bucket];
+            grown.buckets[bucket] = node;
+            node = next;
+        }
+    }
+    grown.count = table->count;
+    free(table->buckets);
+    *table = grown;
+}
+
+/**
+ * @brief Returns the node owning a watch descriptor, or NULL.
+ */
+static watch_node_t *wd_table_find(const node_table_t *table, int wd) {
+    watch_node_t *node = table->buckets[hash_wd(wd) & (table->num_buckets - 1)];
+    while (node && node->wd != wd) {
+        node = node->wd_next;
+    }
+    return node;
+}
+
+/**
+ * @brief Removes a node from the watch table.
+ */
+static void wd_table_remove(node_table_t *table, watch_node_t *node) {
+    watch_node_t **link = &table->buckets[hash_wd(node->wd) & (table->num_buckets - 1)];
+    while (*link && *link != node) {
+        link = &(*link)->wd_next;
+    }
+    if (*link) {
+        *link = node->wd_next;
+        table->count--;
+    }
+}
+
+/**
+ * @brief Makes a node the owner of its watch descriptor.
+ * inotify returns the existing descriptor when a directory that is already
+ * watched is added again, e.g. after a rename within the tree, so a
+ * previous owner loses the descriptor to the new node.
+ */
+static void wd_table_insert(node_table_t *table, watch_node_t *node) {
+    watch_node_t *previous = wd_table_find(table, node->wd);
+    if (previous) {
+        wd_table_remove(table, previous);
+        previous->wd = -1;
+    }
+    if (table->count >= table->num_buckets) {
+        wd_table_grow(table);
+    }
+    size_t bucket = hash_wd(node->wd) & (table->num_buckets - 1);
+    node->wd_next = table->buckets[bucket];
+    table->buckets[bucket] = node;
+    table->count++;
+}
+
+/**
+ * @brief Adds delta to the totals of a node and all its ancestors.
+ */
+static void adjust_totals(watch_node_t *node, int64_t delta) {
+    for (; node; node = node->parent) {
+        node->total_blocks += (uint64_t)delta;
+    }
+}
+
+/**
+ * @brief Appends a child to a node's list of subdirectories.
+ */
+static void attach_child(watch_node_t *parent, watch_node_t *child) {
+    child->parent = parent;
+    child->prev_sibling = NULL;
+    child->next_sibling = parent->first_child;
+    if (parent->first_child) {
+        parent->first_child->prev_sibling = child;
+    }
+    parent->first_child = child;
+}
+
+/**
+ * @brief Unlinks a node from its parent and subtracts its total from the ancestors.
+ */
+static void detach_node(watch_node_t *node) {
+    watch_node_t *parent = node->parent;
+    if (!parent) {
+        return;
+    }
+    adjust_totals(parent, -(int64_t)node->total_blocks);
+    if (node->prev_sibling) {
+        node->prev_sibling->next_sibling = node->next_sibling;
+    } else {
+        parent->first_child = node->next_sibling;
+    }
+    if (node->next_sibling) {
+        node->next_sibling->prev_sibling = node->prev_sibling;
+    }
+    node->parent = NULL;
+    node->prev_sibling = NULL;
+    node->next_sibling = NULL;
+}
+
+/**
+ * @brief Frees one node after removing it from the tables.
+ * The inotify watch is removed as well unless keep_watch is set.
+ */
+static void destroy_node(watchd_t *daemon, watch_node_t *node, int keep_watch) {
+    path_table_remove(&daemon->paths, node);
+    if (node->wd != -1 && wd_table_find(&daemon->watches, node->wd) == node) {
+        wd_table_remove(&daemon->watches, node);
+        if (!keep_watch) {
+            inotify_rm_watch(daemon->inotify_fd, node->wd);
+        }
+    }
+    free(node->path);
+    free(node);
+}
+
+/**
+ * @brief Detaches a node and frees its whole subtree.
+ * Iterative so that deep trees do not use the stack: the walk always
+ * descends into the first child and frees a node once it has none left.
+ * With keep_watches, the directories stay watched so that a rescan can
+ * take the watches over without the kernel queueing an event for each.
+ */
+static void remove_subtree(watchd_t *daemon, watch_node_t *node, int keep_watches) {
+    detach_node(node);
+    watch_node_t *current = node;
+    while (current) {
+        if (current->first_child) {
+            current = current->first_child;
+            continue;
+        }
+        watch_node_t *parent = current->parent;
+        if (parent) {
+            parent->first_child = current->next_sibling;
+            if (current->next_sibling) {
+                current->next_sibling->prev_sibling = NULL;
+            }
+        }
+        destroy_node(daemon, current, keep_watches);
+        current = parent;
+    }
+}
+
+/**
+ * @brief Visitor collecting one node per directory listed by a scan.
+ * Runs on the engine's workers. The directory is watched as soon as it
+ * has been listed, which keeps the window in which a change can go
+ * unnoticed short.
+ */
+static void collect_directory(const dir_summary_t *summary, void *context) {
+    watchd_t *daemon = context;
+    watch_node_t *node = calloc(1, sizeof(watch_node_t));
+    char *path = strdup(summary->path);
+    if (!node || !path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    normalize_path(path);
+    node->path = path;
+    node->dev = summary->dev;
+    node->ino = summary->ino;
+    node->own_blocks = summary->dir_blocks + summary->file_blocks;
+    node->total_blocks = node->own_blocks;
+    node->wd = inotify_add_watch(daemon->inotify_fd, path, WATCH_MASK);
+
+    safe_lock(&daemon->scan_mutex);
+    if (node->wd == -1) {
+        daemon->unwatched++;
+    }
+    if (daemon->num_scanned == daemon->scanned_capacity) {
+        size_t new_capacity = daemon->scanned_capacity ? daemon->scanned_capacity * 2 : 1024;
+        watch_node_t **scanned = realloc(daemon->scanned, new_capacity * sizeof(watch_node_t *));
+        if (!scanned) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        daemon->scanned = scanned;
+        daemon->scanned_capacity = new_capacity;
+    }
+    daemon->scanned[daemon->num_scanned++] = node;
+    safe_unlock(&daemon->scan_mutex);
+}
+
+/**
+ * @brief Orders nodes deepest first, so that children are summed before their parents.
+ */
+static int compare_depth_descending(const void *a, const void *b) {
+    size_t depth_a = path_depth((*(watch_node_t *const *)a)->path);
+    size_t depth_b = path_depth((*(watch_node_t *const *)b)->path);
+    return (depth_a < depth_b) - (depth_a > depth_b);
+}
+
+/**
+ * @brief Scans a directory on the daemon's scan context and hangs the result below parent.
+ *
+ * The nodes collected during the scan are linked to their parents by path
+ * and summed bottom-up; the subtree's total is then added to parent and
+ * its ancestors. Returns the new subtree's root, or NULL if path could
+ * not be listed.
+ */
+static watch_node_t *scan_subtree(watchd_t *daemon, const char *path, watch_node_t *parent) {
+    size_t ignored_total = 0;
+    int had_access_error = 0;
+    daemon->num_scanned = 0;
+    daemon->unwatched = 0;
+    char *paths[] = {(char *)path};
+    scan_t *scan = scan_submit(daemon->scans, paths, 1, &daemon->options, NULL, NULL);
+    if (!scan) {
+        perror(path);
+        return NULL;
+    }
+    scan_wait(scan, &ignored_total, &had_access_error);
+    scan_release(scan);
+    if (daemon->unwatched > 0) {
+        fprintf(stderr, "%s: %zu directories could not be watched and will not be kept current\n", path,
+                daemon->unwatched);
+    }
+
+    qsort(daemon->scanned, daemon->num_scanned, sizeof(watch_node_t *), compare_depth_descending);
+    for (size_t i = 0; i < daemon->num_scanned; i++) {
+        path_table_insert(&daemon->paths, daemon->scanned[i]);
+        if (daemon->scanned[i]->wd != -1) {
+            wd_table_insert(&daemon->watches, daemon->scanned[i]);
+        }
+    }
+
+    watch_node_t *root = path_table_find(&daemon->paths, path);
+    for (size_t i = 0; i < daemon->num_scanned; i++) {
+        watch_node_t *node = daemon->scanned[i];
+        if (node == root) {
+            continue;
+        }
+        char *slash = strrchr(node->path, '/');
+        *slash = '\0';
+        watch_node_t *up = path_table_find(&daemon->paths, slash == node->path ? "/" : node->path);
+        *slash = '/';
+        if (up) {
+            attach_child(up, node);
+            up->total_blocks += node->total_blocks;
+        }
+    }
+
+    if (root && parent) {
+        attach_child(parent, root);
+        adjust_totals(parent, (int64_t)root->total_blocks);
+    }
+    daemon->num_scanned = 0;
+    return root;
+}
+
+/**
+ * @brief Queues a node to be re-read once the pending events are drained.
+ */
+static void mark_dirty(watchd_t *daemon, watch_node_t *node) {
+    if (node->dirty) {
+        return;
+    }
+    if (daemon->num_dirty == daemon->dirty_capacity) {
+        size_t new_capacity = daemon->dirty_capacity ? daemon->dirty_capacity * 2 : 256;
+        int *dirty = realloc(daemon->dirty, new_capacity * sizeof(int));
+        if (!dirty) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        daemon->dirty = dirty;
+        daemon->dirty_capacity = new_capacity;
+    }
+    node->dirty = 1;
+    daemon->dirty[daemon->num_dirty++] = node->wd;
+}
+
+/**
+ * @brief Appends a copy of name to a growable list of names.
+ */
+static void add_name(char ***names, size_t *count, size_t *capacity, const char *name) {
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        char **grown = realloc(*names, new_capacity * sizeof(char *));
+        if (!grown) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *names = grown;
+        *capacity = new_capacity;
+    }
+    (*names)[*count] = strdup(name);
+    if (!(*names)[*count]) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    (*count)++;
+}
+
+/**
+ * @brief Re-reads one directory after a change in it.
+ *
+ * The directory's own blocks are recomputed and the difference is added to
+ * it and its ancestors. Subdirectories that are gone, or were replaced by
+ * another directory of the same name, are dropped; new ones are scanned.
+ * A directory that cannot be opened any more is left to its parent, which
+ * receives the event for its removal.
+ */
+static void reread_directory(watchd_t *daemon, watch_node_t *node) {
+    int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat dir_stat;
+    DIR *dir = fd == -1 || fstat(fd, &dir_stat) == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    unsigned int generation = ++daemon->generation;
+    uint64_t own_blocks = dir_stat.st_blocks;
+    char **new_names = NULL;
+    size_t num_new = 0, new_capacity = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (fstatat(fd, entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (!S_ISDIR(entry_stat.st_mode)) {
+            own_blocks += entry_stat.st_blocks;
+            continue;
+        }
+
+        char *path = join_path(node->path, entry->d_name);
+        watch_node_t *child = path_table_find(&daemon->paths, path);
+        free(path);
+        if (child && child->parent == node && child->dev == (uint64_t)entry_stat.st_dev &&
+            child->ino == (uint64_t)entry_stat.st_ino) {
+            child->seen = generation;
+        } else {
+            add_name(&new_names, &num_new, &new_capacity, entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    watch_node_t *child = node->first_child;
+    while (child) {
+        watch_node_t *next = child->next_sibling;
+        if (child->seen != generation) {
+            remove_subtree(daemon, child, 0);
+        }
+        child = next;
+    }
+
+    adjust_totals(node, (int64_t)(own_blocks - node->own_blocks));
+    node->own_blocks = own_blocks;
+
+    for (size_t i = 0; i < num_new; i++) {
+        char *path = join_path(node->path, new_names[i]);
+        watch_node_t *stale = path_table_find(&daemon->paths, path);
+        if (stale) {
+            remove_subtree(daemon, stale, 0);
+        }
+        scan_subtree(daemon, path, node);
+        free(path);
+        free(new_names[i]);
+    }
+    free(new_names);
+}
+
+/**
+ * @brief Drops every root's tree and scans it again.
+ * Used after the kernel's event queue overflowed, when it is unknown
+ * which directories changed. The watches are kept: removing them would
+ * queue an IN_IGNORED event each and overflow the queue again, while
+ * watching the same directories again returns the same descriptors.
+ */
+static void rescan_roots(watchd_t *daemon) {
+    fprintf(stderr, "inotify event queue overflowed, rescanning\n");
+    daemon->num_dirty = 0;
+    for (int i = 0; i < daemon->num_roots; i++) {
+        if (daemon->roots[i]) {
+            remove_subtree(daemon, daemon->roots[i], 1);
+        }
+        daemon->roots[i] = scan_subtree(daemon, daemon->root_paths[i], NULL);
+    }
+    daemon->overflowed = 0;
+}
+
+/**
+ * @brief Reads all pending inotify events and marks the affected directories dirty.
+ */
+static void drain_events(watchd_t *daemon) {
+    char buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t length = read(daemon->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length == -1 && errno != EAGAIN && errno != EINTR) {
+                perror("inotify read");
+            }
+            return;
+        }
+
+        for (char *pos = buffer; pos < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                daemon->overflowed = 1;
+                continue;
+            }
+            watch_node_t *node = wd_table_find(&daemon->watches, event->wd);
+            if (!node) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                wd_table_remove(&daemon->watches, node);
+                node->wd = -1;
+                continue;
+            }
+            mark_dirty(daemon, node);
+        }
+    }
+}
+
+/**
+ * @brief Re-reads the dirty directories, or everything after an overflow.
+ * Nodes removed while earlier directories were re-read no longer own
+ * their watch descriptor and are skipped.
+ */
+static void apply_changes(watchd_t *daemon) {
+    if (daemon->overflowed) {
+        rescan_roots(daemon);
+        return;
+    }
+    for (size_t i = 0; i < daemon->num_dirty; i++) {
+        watch_node_t *node = wd_table_find(&daemon->watches, daemon->dirty[i]);
+        if (node && node->dirty) {
+            node->dirty = 0;
+            reread_directory(daemon, node);
+        }
+    }
+    daemon->num_dirty = 0;
+}
+
+/**
+ * @brief Writes all of buffer to a socket. Returns -1 if the peer is gone.
+ */
+static int send_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answers one request line with the total of the named directory.
+ */
+static int answer_request(watchd_t *daemon, int fd, char *request) {
+    char reply[REQUEST_MAX + 64];
+    char path[REQUEST_MAX];
+    strcpy(path, request);
+    normalize_path(path);
+
+    watch_node_t *node = path_table_find(&daemon->paths, path);
+    int length;
+    if (node) {
+        length = snprintf(reply, sizeof(reply), "%llu\t%s\n", (unsigned long long)node->total_blocks, request);
+    } else {
+        length = snprintf(reply, sizeof(reply), "error\t%s\tnot a watched directory\n", request);
+    }
+    return send_all(fd, reply, length < (int)sizeof(reply) ? (size_t)length : sizeof(reply) - 1);
+}
+
+/**
+ * @brief Closes a client connection and frees its slot.
+ */
+static void close_client(client_t *client) {
+    close(client->fd);
+    client->fd = -1;
+    client->length = 0;
+}
+
+/**
+ * @brief Reads from a client and answers every complete request line.
+ */
+static void serve_client(watchd_t *daemon, client_t *client) {
+    ssize_t received = recv(client->fd, client->buffer + client->length, sizeof(client->buffer) - client->length, 0);
+    if (received <= 0) {
+        if (received == 0 || (errno != EINTR && errno != EAGAIN)) {
+            close_client(client);
+        }
+        return;
+    }
+    client->length += received;
+
+    char *start = client->buffer;
+    char *newline;
+    while ((newline = memchr(start, '\n', client->buffer + client->length - start)) != NULL) {
+        *newline = '\0';
+        if (answer_request(daemon, client->fd, start) == -1) {
+            close_client(client);
+            return;
+        }
+        start = newline + 1;
+    }
+
+    client->length -= start - client->buffer;
+    memmove(client->buffer, start, client->length);
+    if (client->length == sizeof(client->buffer)) {
+        static const char too_long[] = "error\t\trequest too long\n";
+        send_all(client->fd, too_long, sizeof(too_long) - 1);
+        close_client(client);
+    }
+}
+
+/**
+ * @brief Accepts a new client into a free slot, or turns it away if all are taken.
+ */
+static void accept_client(watchd_t *daemon) {
+    int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1) {
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (daemon->clients[i].fd == -1) {
+            daemon->clients[i].fd = fd;
+            daemon->clients[i].length = 0;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Creates the listening socket, replacing a stale socket file at path.
+ * Returns the socket, or -1 after reporting an error.
+ */
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s: exists and is not a socket\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Runs the event loop until SIGINT or SIGTERM.
+ * Events are drained before queries are answered, so a query sees every
+ * change the kernel reported before it arrived.
+ */
+static void event_loop(watchd_t *daemon) {
+    struct pollfd fds[2 + MAX_CLIENTS];
+    while (!stop_requested) {
+        fds[0] = (struct pollfd){.fd = daemon->inotify_fd, .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = daemon->listen_fd, .events = POLLIN};
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            fds[2 + i] = (struct pollfd){.fd = daemon->clients[i].fd, .events = POLLIN};
+        }
+
+        if (poll(fds, 2 + MAX_CLIENTS, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                return;
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            drain_events(daemon);
+            apply_changes(daemon);
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_client(daemon);
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (fds[2 + i].revents && daemon->clients[i].fd != -1) {
+                serve_client(daemon, &daemon->clients[i]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Frees the tree, closes all descriptors and removes the socket file.
+ */
+static void watchd_destroy(watchd_t *daemon, const char *socket_path) {
+    scan_ctx_destroy(daemon->scans);
+    for (int i = 0; i < daemon->num_roots; i++) {
+        if (daemon->roots[i]) {
+            remove_subtree(daemon, daemon->roots[i], 1);
+        }
+        free(daemon->root_paths[i]);
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (daemon->clients[i].fd != -1) {
+            close(daemon->clients[i].fd);
+        }
+    }
+    if (daemon->listen_fd != -1) {
+        close(daemon->listen_fd);
+        unlink(socket_path);
+    }
+    close(daemon->inotify_fd);
+    free(daemon->roots);
+    free(daemon->root_paths);
+    free(daemon->paths.buckets);
+    free(daemon->watches.buckets);
+    free(daemon->dirty);
+    free(daemon->scanned);
+    pthread_mutex_destroy(&daemon->scan_mutex);
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Scans the roots, prints their totals and serves queries until stopped.
+ *
+ * Each root must be a directory. The initial scan and the scans of new
+ * subdirectories run on one scan context of num_threads threads, which
+ * stays up for the life of the daemon, with options, the visitor replaced
+ * by the daemon's and every hard link counted. Returns 0 after a clean
+ * shutdown on SIGINT or SIGTERM, or -1 if the daemon could not start.
+ */
+int watchd_run(const char *socket_path, char **roots, int num_roots, int num_threads, const scan_options_t *options) {
+    watchd_t *daemon = calloc(1, sizeof(watchd_t));
+    if (!daemon) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        daemon->clients[i].fd = -1;
+    }
+    daemon->scans = scan_ctx_create(num_threads, options->engine, options->affinity);
+    if (!daemon->scans) {
+        perror("scan_ctx_create");
+        exit(EXIT_FAILURE);
+    }
+    daemon->options = *options;
+    daemon->options.count_links = 1;
+    daemon->options.visit = collect_directory;
+    daemon->options.visit_context = daemon;
+    table_init(&daemon->paths, 1024);
+    table_init(&daemon->watches, 1024);
+
+    int errnum = pthread_mutex_init(&daemon->scan_mutex, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+
+    daemon->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (daemon->inotify_fd == -1) {
+        perror("inotify_init1");
+        exit(EXIT_FAILURE);
+    }
+    daemon->listen_fd = listen_on(socket_path);
+
+    daemon->roots = calloc(num_roots, sizeof(watch_node_t *));
+    daemon->root_paths = calloc(num_roots, sizeof(char *));
+    if (!daemon->roots || !daemon->root_paths) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    daemon->num_roots = num_roots;
+
+    int failed = daemon->listen_fd == -1;
+    for (int i = 0; i < num_roots && !failed; i++) {
+        daemon->root_paths[i] = realpath(roots[i], NULL);
+        if (!daemon->root_paths[i]) {
+            perror(roots[i]);
+            failed = 1;
+            break;
+        }
+        daemon->roots[i] = scan_subtree(daemon, daemon->root_paths[i], NULL);
+        if (!daemon->roots[i]) {
+            fprintf(stderr, "%s: not a readable directory\n", roots[i]);
+            failed = 1;
+            break;
+        }
+        printf("%llu\t%s\n", (unsigned long long)daemon->roots[i]->total_blocks, roots[i]);
+    }
+    fflush(stdout);
+
+    if (!failed) {
+        struct sigaction action = {.sa_handler = request_stop};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        event_loop(daemon);
+    }
+
+    watchd_destroy(daemon, socket_path);
+    free(daemon);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Asks a running daemon for the totals of paths and prints them like mdu.
+ * Paths are resolved with realpath() first, so relative paths and symbolic
+ * links name the same directory as in the daemon. Returns 0 if every path
+ * was answered, -1 otherwise.
+ */
+int watchd_query(const char *socket_path, char **paths, int num_paths) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror(socket_path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    FILE *replies = fdopen(fd, "r");
+    if (!replies) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+
+    int result = 0;
+    char reply[REQUEST_MAX + 64];
+    for (int i = 0; i < num_paths; i++) {
+        char *resolved = realpath(paths[i], NULL);
+        const char *path = resolved ? resolved : paths[i];
+        size_t length = strlen(path);
+        char *request = malloc(length + 2);
+        if (!request) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(request, path, length);
+        request[length] = '\n';
+
+        int sent = send_all(fd, request, length + 1);
+        free(request);
+        free(resolved);
+        if (sent == -1 || !fgets(reply, sizeof(reply), replies)) {
+            fprintf(stderr, "%s: connection to daemon lost\n", socket_path);
+            result = -1;
+            break;
+        }
+
+        if (strncmp(reply, "error\t", 6) == 0) {
+            char *reason = strrchr(reply, '\t') + 1;
+            reason[strcspn(reason, "\n")] = '\0';
+            fprintf(stderr, "%s: %s\n", paths[i], reason);
+            result = -1;
+        } else {
+            printf("%llu\t%s\n", strtoull(reply, NULL, 10), paths[i]);
+        }
+    }
+
+    fclose(replies);
+    return result;
+}
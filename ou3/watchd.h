@@ -0,0 +1,23 @@
+/**
+ * @file watchd.h
+ * @brief Long-running mode that keeps directory totals current and answers queries.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * The daemon scans its roots once with the dirsize.c engine into an
+ * in-memory tree of directories, then follows inotify events to keep every
+ * directory's total current. Clients connect to a Unix stream socket and
+ * send one path per line; each is answered with one line, either
+ * "<blocks>\t<path>" or "error\t<path>\t<reason>". Hard links are counted
+ * once per link, like mdu -l, because a directory can be re-read on its own.
+ */
+
+#ifndef WATCHD_H
+#define WATCHD_H
+
+#include "dirsize.h"
+
+int watchd_run(const char *socket_path, char **roots, int num_roots, int num_threads, const scan_options_t *options);
+int watchd_query(const char *socket_path, char **paths, int num_paths);
+
+#endif // WATCHD_H
@@ -1,88 +1,219 @@
 /**
  * @file work_queue.c
- * @brief Implementation of a thread-safe work queue for string paths.
+ * @brief Implementation of a thread-safe work queue for opaque work items.
  * @date 2025-11-19
  * @author Bran Mjöberg Quanne
  */
 
 #include "work_queue.h"
-#include <errno.h>
+#include "safe_lock.h"
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* The lock-free ring in work_queue_ring.c replaces this queue when built with make QUEUE=ring. */
+#ifndef WORK_QUEUE_RING
+
 /* --- INTERNAL --- */
 
+/**
+ * @struct sub_queue_t
+ * @brief The items queued by the workers of one NUMA node.
+ * Each sub-queue has its own lock on its own cache line, so that workers
+ * on different nodes do not contend for one lock.
+ */
+typedef struct {
+    alignas(64) pthread_mutex_t mutex; /**< Protects the fields below */
+    void **items;                      /**< Circular buffer of work items */
+    int front;                         /**< Index of first element */
+    int rear;                          /**< Index of next free slot */
+    int capacity;                      /**< Buffer capacity */
+    atomic_int size;                   /**< Current number of elements, also read without the mutex */
+} sub_queue_t;
+
 /**
  * @struct work_queue
  * @brief Internal structure representing the work queue.
+ * The task count lives on a cache line of its own, since every finished
+ * item updates it. The mutex and condition variable are only used to put
+ * consumers that found no items to sleep, and to wake them.
  */
 struct work_queue {
-    char **paths;          /**< Circular buffer of path strings */
-    int front;             /**< Index of first element */
-    int rear;              /**< Index of next free slot */
-    int size;              /**< Current number of elements */
-    int capacity;          /**< Buffer capacity */
-    int outstanding;       /**< Number of unfinished tasks */
-    pthread_mutex_t mutex; /**< Protects all queue fields */
-    pthread_cond_t cond;   /**< Signals queue state changes */
+    sub_queue_t *nodes;                  /**< One sub-queue per NUMA node */
+    int num_nodes;                       /**< Number of sub-queues */
+    alignas(64) atomic_long outstanding; /**< Number of unfinished tasks */
+    atomic_int sleepers;                 /**< Consumers waiting on cond */
+    pthread_mutex_t mutex;               /**< Guards sleeping */
+    pthread_cond_t cond;                 /**< Signals new items or completion */
 };
 
 /**
- * @brief Frees remaining paths in the queue.
+ * @brief Grows the buffer of a sub-queue so that it holds at least needed items.
+ * Must be called with the sub-queue's mutex held. The items are unwrapped
+ * to the start of the new buffer.
  */
-static void free_remaining_paths(work_queue_t *queue) {
-    for (int i = 0; i < queue->size; i++) {
-        free(queue->paths[(queue->front + i) % queue->capacity]);
+static void queue_reserve(sub_queue_t *sub, int needed) {
+    if (needed <= sub->capacity) {
+        return;
+    }
+
+    int new_capacity = sub->capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void **new_items = malloc(sizeof(void *) * new_capacity);
+    if (!new_items) {
+        perror("malloc");
+        safe_unlock(&sub->mutex);
+        exit(EXIT_FAILURE);
+    }
+
+    int size = atomic_load_explicit(&sub->size, memory_order_relaxed);
+    for (int i = 0; i < size; i++) {
+        new_items[i] = sub->items[(sub->front + i) % sub->capacity];
     }
-    free(queue->paths);
+
+    free(sub->items);
+    sub->items = new_items;
+    sub->capacity = new_capacity;
+    sub->front = 0;
+    sub->rear = size;
 }
 
-/* --- EXTERNAL --- */
+/**
+ * @brief Takes the oldest items of a sub-queue, at most max and at most half of them (rounded up).
+ * An empty sub-queue is skipped without taking its lock. With stats,
+ * the wait for the lock is recorded. Returns the number of items taken.
+ */
+static size_t sub_queue_take(sub_queue_t *sub, void **items, size_t max, queue_stats_t *stats) {
+    if (atomic_load(&sub->size) == 0) {
+        return 0;
+    }
+    safe_lock_timed(&sub->mutex, stats ? &stats->lock_ns : NULL);
+    int size = atomic_load_explicit(&sub->size, memory_order_relaxed);
+    size_t count = (size_t)(size + 1) / 2;
+    if (count > max) {
+        count = max;
+    }
+    for (size_t i = 0; i < count; i++) {
+        items[i] = sub->items[sub->front];
+        sub->front = (sub->front + 1) % sub->capacity;
+    }
+    atomic_store_explicit(&sub->size, size - (int)count, memory_order_relaxed);
+    safe_unlock(&sub->mutex);
+    return count;
+}
 
 /**
- * @brief Creates a new work queue.
- *
- * Allocates and initializes a thread-safe work queue for managing path strings.
- * Sets up the circular buffer, mutex, and condition variable.
- * If any allocation or initialization fails, the program exits with an error.
- * Returns a pointer to the newly created queue.
- */
-work_queue_t *queue_create(void) {
-    work_queue_t *queue = malloc(sizeof(work_queue_t));
-    if (!queue) {
-        perror("malloc");
+ * @brief Takes items from the sub-queue of node, or else from the others in turn.
+ * Returns the number of items taken.
+ */
+static size_t take_nearest(work_queue_t *queue, int node, void **items, size_t max, queue_stats_t *stats) {
+    for (int i = 0; i < queue->num_nodes; i++) {
+        size_t count = sub_queue_take(&queue->nodes[(node + i) % queue->num_nodes], items, max, stats);
+        if (count > 0) {
+            return count;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Wakes sleeping consumers after items were added.
+ * The producer stores the new size and then reads the sleepers, and a
+ * sleeper in wait_for_items() counts itself and then reads the sizes,
+ * all sequentially consistent: either the sleeper sees the new items
+ * before it waits, or the producer sees the sleeper and signals it under
+ * the mutex.
+ */
+static void wake_sleepers(work_queue_t *queue, size_t count, queue_stats_t *stats) {
+    if (atomic_load(&queue->sleepers) == 0) {
+        return;
+    }
+    safe_lock_timed(&queue->mutex, stats ? &stats->lock_ns : NULL);
+    int errnum = count == 1 ? pthread_cond_signal(&queue->cond) : pthread_cond_broadcast(&queue->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "%s: %s\n", count == 1 ? "pthread_cond_signal" : "pthread_cond_broadcast", strerror(errnum));
         exit(EXIT_FAILURE);
     }
+    safe_unlock(&queue->mutex);
+}
 
-    queue->capacity = 1024;
-    queue->paths = malloc(sizeof(char *) * queue->capacity);
-    if (!queue->paths) {
-        perror("malloc");
-        free(queue);
+/**
+ * @brief Sleeps until some sub-queue holds items or all tasks are done, then takes items like take_nearest().
+ * Returns 0 once all tasks are done. The time spent waiting is added to
+ * stats if given.
+ */
+static size_t wait_for_items(work_queue_t *queue, int node, void **items, size_t max, queue_stats_t *stats) {
+    uint64_t start = stats ? monotonic_ns() : 0;
+    safe_lock(&queue->mutex);
+    atomic_fetch_add(&queue->sleepers, 1);
+    size_t count;
+    while ((count = take_nearest(queue, node, items, max, NULL)) == 0 && atomic_load(&queue->outstanding) > 0) {
+        int errnum = pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_fetch_sub(&queue->sleepers, 1);
+    safe_unlock(&queue->mutex);
+    if (stats) {
+        stats->wait_ns += monotonic_ns() - start;
+    }
+    return count;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates a new work queue with one sub-queue per NUMA node.
+ *
+ * Allocates and initializes a thread-safe work queue for managing work
+ * items, with a circular buffer and mutex for each of num_nodes
+ * sub-queues, and the mutex and condition variable used for sleeping
+ * consumers. If any allocation or initialization fails, the program
+ * exits with an error. Returns a pointer to the newly created queue.
+ */
+work_queue_t *queue_create(int num_nodes) {
+    work_queue_t *queue = aligned_alloc(alignof(work_queue_t), sizeof(work_queue_t));
+    sub_queue_t *nodes = aligned_alloc(alignof(sub_queue_t), num_nodes * sizeof(sub_queue_t));
+    if (!queue || !nodes) {
+        perror("aligned_alloc");
         exit(EXIT_FAILURE);
     }
 
-    queue->front = queue->rear = queue->size = 0;
-    queue->outstanding = 0;
+    queue->nodes = nodes;
+    queue->num_nodes = num_nodes;
+    atomic_init(&queue->outstanding, 0);
+    atomic_init(&queue->sleepers, 0);
+    for (int i = 0; i < num_nodes; i++) {
+        sub_queue_t *sub = &nodes[i];
+        sub->capacity = 1024;
+        sub->items = malloc(sizeof(void *) * sub->capacity);
+        if (!sub->items) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        sub->front = sub->rear = 0;
+        atomic_init(&sub->size, 0);
+        int errnum = pthread_mutex_init(&sub->mutex, NULL);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
 
     int errnum = pthread_mutex_init(&queue->mutex, NULL);
     if (errnum != 0) {
         fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
-        free(queue->paths);
-        free(queue);
         exit(EXIT_FAILURE);
     }
 
     errnum = pthread_cond_init(&queue->cond, NULL);
     if (errnum != 0) {
         fprintf(stderr, "pthread_cond_init: %s\n", strerror(errnum));
-        errnum = pthread_mutex_destroy(&queue->mutex);
-        if (errnum != 0) {
-            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
-            exit(EXIT_FAILURE);
-        }
-        free(queue->paths);
-        free(queue);
         exit(EXIT_FAILURE);
     }
 
@@ -90,86 +221,103 @@ work_queue_t *queue_create(void) {
 }
 
 /**
- * @brief Adds a path to the work queue.
+ * @brief Adds a work item to the sub-queue of node 0.
  *
- * Copies the given path string and adds it to the queue.
- * If the queue is full, it dynamically expands the buffer to accommodate more paths.
+ * The queue takes the item pointer as is; ownership passes to whoever pops it.
+ * If the queue is full, it dynamically expands the buffer to accommodate more items.
  * Signals waiting threads that new work is available.
  */
-void queue_push(work_queue_t *queue, const char *path) {
-    safe_lock(&queue->mutex);
-
-    if (queue->size == queue->capacity) {
-        int new_capacity = queue->capacity * 2;
-        char **new_paths = malloc(sizeof(char *) * new_capacity);
-        if (!new_paths) {
-            perror("malloc");
-            safe_unlock(&queue->mutex);
-            exit(EXIT_FAILURE);
-        }
-
-        for (int i = 0; i < queue->size; i++) {
-            new_paths[i] = queue->paths[(queue->front + i) % queue->capacity];
-        }
+void queue_push(work_queue_t *queue, void *item) {
+    queue_push_batch(queue, 0, &item, 1, NULL);
+}
 
-        free(queue->paths);
-        queue->paths = new_paths;
-        queue->capacity = new_capacity;
-        queue->front = 0;
-        queue->rear = queue->size;
+/**
+ * @brief Adds several work items to the sub-queue of a node under one lock.
+ *
+ * Like queue_push for each item, but the buffer grows at most once and
+ * sleeping threads are woken with one broadcast (one signal for a single
+ * item) instead of one signal per item. The task count is raised before
+ * any item becomes visible, so a consumer can never finish an item and
+ * see the count drop to zero while others of the batch are still being
+ * added. With stats, the wait for the mutex and the queue depth after
+ * the push are recorded.
+ */
+void queue_push_batch(work_queue_t *queue, int node, void *const *items, size_t count, queue_stats_t *stats) {
+    if (count == 0) {
+        return;
     }
+    atomic_fetch_add(&queue->outstanding, (long)count);
 
-    queue->paths[queue->rear] = strdup(path);
-    if (!queue->paths[queue->rear]) {
-        perror("strdup");
-        safe_unlock(&queue->mutex);
-        exit(EXIT_FAILURE);
+    sub_queue_t *sub = &queue->nodes[node];
+    safe_lock_timed(&sub->mutex, stats ? &stats->lock_ns : NULL);
+    int size = atomic_load_explicit(&sub->size, memory_order_relaxed);
+    queue_reserve(sub, size + (int)count);
+    for (size_t i = 0; i < count; i++) {
+        sub->items[sub->rear] = items[i];
+        sub->rear = (sub->rear + 1) % sub->capacity;
     }
+    atomic_store(&sub->size, size + (int)count);
+    safe_unlock(&sub->mutex);
 
-    queue->rear = (queue->rear + 1) % queue->capacity;
-    queue->size++;
-    queue->outstanding++;
-
-    int errnum = pthread_cond_signal(&queue->cond);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_cond_signal: %s\n", strerror(errnum));
-        exit(EXIT_FAILURE);
+    if (stats) {
+        size_t depth = queue_size(queue);
+        stats->peak_size = depth > stats->peak_size ? depth : stats->peak_size;
     }
-    safe_unlock(&queue->mutex);
+    wake_sleepers(queue, count, stats);
 }
 
 /**
- * @brief Retrieves a path from the work queue.
+ * @brief Retrieves a work item from the queue, for a consumer on node 0.
  *
  * Waits if the queue is empty but there are outstanding tasks.
- * Returns a dynamically allocated path string for processing, or NULL if all tasks are done.
+ * Returns an item for processing, or NULL if all tasks are done.
  */
-char *queue_pop(work_queue_t *queue) {
-    safe_lock(&queue->mutex);
+void *queue_pop(work_queue_t *queue) {
+    void *item;
+    return queue_pop_batch(queue, 0, &item, 1, NULL) ? item : NULL;
+}
 
-    while (queue->size == 0) {
-        if (queue->outstanding == 0) {
-            int errnum = pthread_cond_broadcast(&queue->cond);
-            if (errnum != 0) {
-                fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
-                exit(EXIT_FAILURE);
-            }
-            safe_unlock(&queue->mutex);
-            return NULL;
-        }
-        int errnum = pthread_cond_wait(&queue->cond, &queue->mutex);
-        if (errnum != 0) {
-            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
-            exit(EXIT_FAILURE);
-        }
+/**
+ * @brief Retrieves several work items from the queue, for a consumer on a node.
+ *
+ * Takes the oldest items of the node's own sub-queue, and only if that is
+ * empty those of the other nodes, trying them in turn. At most max items
+ * and at most half of the sub-queue (rounded up) are taken, so that other
+ * consumers still find work. If all sub-queues are empty but tasks are
+ * outstanding, waits for items to be pushed. Each item still needs its
+ * own call to queue_task_done. Returns the number of items taken, or 0
+ * if all tasks are done. With stats, the waits for the mutexes and for
+ * items are recorded.
+ */
+size_t queue_pop_batch(work_queue_t *queue, int node, void **items, size_t max, queue_stats_t *stats) {
+    if (max == 0) {
+        return 0;
     }
+    size_t count = take_nearest(queue, node, items, max, stats);
+    return count > 0 ? count : wait_for_items(queue, node, items, max, stats);
+}
 
-    char *path = queue->paths[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
-    queue->size--;
+/**
+ * @brief Returns about how many items wait in all sub-queues.
+ * The sub-queues are read one after the other without locking, so
+ * concurrent pushes and pops can make the count briefly off.
+ */
+size_t queue_size(work_queue_t *queue) {
+    size_t size = 0;
+    for (int i = 0; i < queue->num_nodes; i++) {
+        size += atomic_load_explicit(&queue->nodes[i].size, memory_order_relaxed);
+    }
+    return size;
+}
 
-    safe_unlock(&queue->mutex);
-    return path;
+/**
+ * @brief Registers a task that is not in the queue.
+ * Consumers keep waiting for work until it is marked done with
+ * queue_task_done, like for a task that was pushed and popped.
+ */
+void queue_task_add(work_queue_t *queue, queue_stats_t *stats) {
+    (void)stats;
+    atomic_fetch_add(&queue->outstanding, 1);
 }
 
 /**
@@ -177,26 +325,36 @@ char *queue_pop(work_queue_t *queue) {
  *
  * Decrements the count of outstanding tasks in the queue.
  * If all tasks are completed, it wakes up any threads waiting for work.
+ * With stats, the wait for the mutex is recorded.
  */
-void queue_task_done(work_queue_t *queue) {
-    safe_lock(&queue->mutex);
-    queue->outstanding--;
-
-    if (queue->outstanding == 0) {
-        int errnum = pthread_cond_broadcast(&queue->cond);
-        if (errnum != 0) {
-            fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
-            exit(EXIT_FAILURE);
-        }
+void queue_task_done(work_queue_t *queue, queue_stats_t *stats) {
+    if (atomic_fetch_sub(&queue->outstanding, 1) != 1) {
+        return;
     }
 
+    safe_lock_timed(&queue->mutex, stats ? &stats->lock_ns : NULL);
+    int errnum = pthread_cond_broadcast(&queue->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
     safe_unlock(&queue->mutex);
 }
 
 /**
  * @brief Destroys the work queue and frees resources.
+ * Items still in the queue are not freed; the caller owns them.
  */
 void queue_destroy(work_queue_t *queue) {
+    for (int i = 0; i < queue->num_nodes; i++) {
+        int errnum = pthread_mutex_destroy(&queue->nodes[i].mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        free(queue->nodes[i].items);
+    }
+
     int errnum = pthread_mutex_destroy(&queue->mutex);
     if (errnum != 0) {
         fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
@@ -208,34 +366,8 @@ void queue_destroy(work_queue_t *queue) {
         fprintf(stderr, "pthread_cond_destroy: %s\n", strerror(errnum));
         exit(EXIT_FAILURE);
     }
-    free_remaining_paths(queue);
+    free(queue->nodes);
     free(queue);
 }
 
-/**
- * @brief Safely lock a pthread mutex.
- *
- * This helper wraps pthread_mutex_lock and checks the return value.
- * On failure it prints the error number and terminates the process.
- */
-void safe_lock(pthread_mutex_t *m) {
-    int errnum = pthread_mutex_lock(m);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(errnum));
-        exit(EXIT_FAILURE);
-    }
-}
-
-/**
- * @brief Safely unlock a pthread mutex.
- *
- * This helper wraps pthread_mutex_unlock and checks the return value.
- * On failure it prints the errornumber and terminates the process.
- */
-void safe_unlock(pthread_mutex_t *m) {
-    int errnum = pthread_mutex_unlock(m);
-    if (errnum != 0) {
-        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(errnum));
-        exit(EXIT_FAILURE);
-    }
-}
+#endif // WORK_QUEUE_RING
@@ -1,6 +1,6 @@
 /**
  * @file work_queue.h
- * @brief Thread-safe work queue interface for enqueuing path strings.
+ * @brief Thread-safe work queue interface for enqueuing work items.
  * @author Bran Mjöberg Quanne
  * @date 2025-11-19
  */
@@ -8,17 +8,33 @@
 #define WORK_QUEUE_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct work_queue work_queue_t;
-work_queue_t *queue_create(void);
-void queue_push(work_queue_t *queue, const char *path);
-char *queue_pop(work_queue_t *queue);
-void queue_task_done(work_queue_t *queue);
+
+/**
+ * @struct queue_stats_t
+ * @brief Time one thread lost to a queue and the deepest queue it saw.
+ * Passed to the calls that take it to have them measured; with NULL
+ * nothing is measured and no clock is read.
+ */
+typedef struct {
+    uint64_t lock_ns; /**< Time spent waiting for the queue's mutexes */
+    uint64_t wait_ns; /**< Time spent blocked waiting for items */
+    size_t peak_size; /**< Most items queued right after one of this thread's pushes */
+} queue_stats_t;
+
+work_queue_t *queue_create(int num_nodes);
+void queue_push(work_queue_t *queue, void *item);
+void queue_push_batch(work_queue_t *queue, int node, void *const *items, size_t count, queue_stats_t *stats);
+void *queue_pop(work_queue_t *queue);
+size_t queue_pop_batch(work_queue_t *queue, int node, void **items, size_t max, queue_stats_t *stats);
+size_t queue_size(work_queue_t *queue);
+void queue_task_add(work_queue_t *queue, queue_stats_t *stats);
+void queue_task_done(work_queue_t *queue, queue_stats_t *stats);
 void queue_destroy(work_queue_t *queue);
-void safe_lock(pthread_mutex_t *m);
-void safe_unlock(pthread_mutex_t *m);
 
 #endif // WORK_QUEUE_H
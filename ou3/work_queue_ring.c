@@ -0,0 +1,427 @@
+/**
+ * @file work_queue_ring.c
+ * @brief Lock-free bounded MPMC ring implementation of the work queue.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Built instead of the mutex-protected queue in work_queue.c with
+ * `make QUEUE=ring`. Items pass through a fixed ring of cells that each
+ * carry a sequence number (D. Vyukov's bounded MPMC queue), so producers
+ * and consumers only contend on the index they advance and the cell they
+ * claim. When the ring is full, items spill into a mutex-protected
+ * overflow stack, which consumers drain when the ring is empty. The mutex
+ * and condition variable are otherwise only used to put idle consumers to
+ * sleep after a short spin, and to wake them. All NUMA nodes share the
+ * one ring; the node passed to the calls is ignored.
+ */
+
+#include "work_queue.h"
+#include "safe_lock.h"
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* --- INTERNAL --- */
+
+/** Cells in the ring, a power of two. */
+#ifndef RING_SIZE
+#define RING_SIZE 16384
+#endif
+
+/** Times an idle consumer yields and retries before it goes to sleep. */
+#define SPIN_ROUNDS 64
+
+/**
+ * @struct ring_cell_t
+ * @brief One slot of the ring.
+ * A producer may fill the cell at position pos once its sequence equals
+ * pos; a consumer may empty it once its sequence equals pos + 1.
+ */
+typedef struct {
+    atomic_size_t sequence; /**< Position the cell is ready for */
+    void *item;             /**< Item stored in the cell */
+} ring_cell_t;
+
+/**
+ * @struct work_queue
+ * @brief Internal structure representing the work queue.
+ * The indices and the task count live on separate cache lines, since
+ * producers, consumers and finishing workers update them independently.
+ */
+struct work_queue {
+    alignas(64) atomic_size_t enqueue_pos; /**< Next position producers claim */
+    alignas(64) atomic_size_t dequeue_pos; /**< Next position consumers claim */
+    alignas(64) atomic_long outstanding;   /**< Number of unfinished tasks */
+    atomic_int sleepers;                   /**< Consumers waiting on cond */
+    atomic_size_t num_overflow;            /**< Items in the overflow stack */
+    void **overflow;                       /**< Items that did not fit in the ring */
+    size_t overflow_capacity;              /**< Allocated overflow slots */
+    pthread_mutex_t mutex;                 /**< Protects the overflow stack, guards sleeping */
+    pthread_cond_t cond;                   /**< Signals new items or completion */
+    ring_cell_t cells[RING_SIZE];          /**< The ring */
+};
+
+/**
+ * @brief Tries to put an item into the ring. Returns 0 if the ring is full.
+ */
+static int ring_try_push(work_queue_t *queue, void *item) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        ring_cell_t *cell = &queue->cells[pos & (RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Tries to take the oldest item from the ring. Returns NULL if the ring is empty.
+ */
+static void *ring_try_pop(work_queue_t *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        ring_cell_t *cell = &queue->cells[pos & (RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                void *item = cell->item;
+                atomic_store_explicit(&cell->sequence, pos + RING_SIZE, memory_order_release);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Locks the mutex, adding the time spent waiting for it to stats if given.
+ */
+static void queue_lock(work_queue_t *queue, queue_stats_t *stats) {
+    safe_lock_timed(&queue->mutex, stats ? &stats->lock_ns : NULL);
+}
+
+/**
+ * @brief Puts an item on the overflow stack when the ring is full.
+ */
+static void overflow_push(work_queue_t *queue, void *item, queue_stats_t *stats) {
+    queue_lock(queue, stats);
+    size_t count = atomic_load_explicit(&queue->num_overflow, memory_order_relaxed);
+    if (count == queue->overflow_capacity) {
+        size_t new_capacity = queue->overflow_capacity ? queue->overflow_capacity * 2 : 1024;
+        void **overflow = realloc(queue->overflow, new_capacity * sizeof(void *));
+        if (!overflow) {
+            perror("realloc");
+            safe_unlock(&queue->mutex);
+            exit(EXIT_FAILURE);
+        }
+        queue->overflow = overflow;
+        queue->overflow_capacity = new_capacity;
+    }
+    queue->overflow[count] = item;
+    atomic_store(&queue->num_overflow, count + 1);
+    safe_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Returns about how many items the ring and the overflow stack hold.
+ * The indices are read separately, so concurrent pushes and pops can make
+ * the count briefly off.
+ */
+static size_t queue_depth(work_queue_t *queue) {
+    size_t queued = atomic_load(&queue->enqueue_pos) - atomic_load(&queue->dequeue_pos);
+    queued = queued > RING_SIZE ? 0 : queued;
+    return queued + atomic_load(&queue->num_overflow);
+}
+
+/**
+ * @brief Takes an item from the overflow stack. Must be called with the mutex held.
+ */
+static void *overflow_pop_locked(work_queue_t *queue) {
+    size_t count = atomic_load_explicit(&queue->num_overflow, memory_order_relaxed);
+    if (count == 0) {
+        return NULL;
+    }
+    atomic_store(&queue->num_overflow, count - 1);
+    return queue->overflow[count - 1];
+}
+
+/**
+ * @brief Takes an item from the ring, or from the overflow stack if the ring is empty.
+ * locked tells whether the caller already holds the mutex; otherwise
+ * the wait for it is added to stats if given.
+ */
+static void *try_take(work_queue_t *queue, int locked, queue_stats_t *stats) {
+    void *item = ring_try_pop(queue);
+    if (item || atomic_load(&queue->num_overflow) == 0) {
+        return item;
+    }
+    if (locked) {
+        return overflow_pop_locked(queue);
+    }
+    queue_lock(queue, stats);
+    item = overflow_pop_locked(queue);
+    safe_unlock(&queue->mutex);
+    return item;
+}
+
+/**
+ * @brief Wakes sleeping consumers after items were added.
+ * The fence pairs with the one in wait_for_item(): either the sleeper sees
+ * the new items before it waits, or the producer sees the sleeper and
+ * signals it under the mutex.
+ */
+static void wake_sleepers(work_queue_t *queue, size_t count, queue_stats_t *stats) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->sleepers) == 0) {
+        return;
+    }
+    queue_lock(queue, stats);
+    int errnum = count == 1 ? pthread_cond_signal(&queue->cond) : pthread_cond_broadcast(&queue->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "%s: %s\n", count == 1 ? "pthread_cond_signal" : "pthread_cond_broadcast", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    safe_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Waits for an item while tasks are outstanding.
+ * Spins with sched_yield for a few rounds, then sleeps on the condition
+ * variable. Returns NULL once all tasks are done.
+ */
+static void *wait_for_item(work_queue_t *queue) {
+    for (int round = 0; round < SPIN_ROUNDS; round++) {
+        if (atomic_load(&queue->outstanding) == 0) {
+            return NULL;
+        }
+        sched_yield();
+        void *item = try_take(queue, 0, NULL);
+        if (item) {
+            return item;
+        }
+    }
+
+    safe_lock(&queue->mutex);
+    atomic_fetch_add(&queue->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    void *item;
+    while (!(item = try_take(queue, 1, NULL)) && atomic_load(&queue->outstanding) > 0) {
+        int errnum = pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (errnum != 0) {
+            fprintf(stderr, "pthread_cond_wait: %s\n", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_fetch_sub(&queue->sleepers, 1);
+    safe_unlock(&queue->mutex);
+    return item;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates a new work queue; num_nodes is ignored, as all nodes share the ring.
+ *
+ * Allocates the ring, marks every cell ready for its first position and
+ * sets up the mutex and condition variable used for sleeping consumers.
+ * If any allocation or initialization fails, the program exits with an error.
+ */
+work_queue_t *queue_create(int num_nodes) {
+    (void)num_nodes;
+    work_queue_t *queue = aligned_alloc(alignof(work_queue_t), sizeof(work_queue_t));
+    if (!queue) {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < RING_SIZE; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].item = NULL;
+    }
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->outstanding, 0);
+    atomic_init(&queue->sleepers, 0);
+    atomic_init(&queue->num_overflow, 0);
+    queue->overflow = NULL;
+    queue->overflow_capacity = 0;
+
+    int errnum = pthread_mutex_init(&queue->mutex, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(errnum));
+        free(queue);
+        exit(EXIT_FAILURE);
+    }
+
+    errnum = pthread_cond_init(&queue->cond, NULL);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_init: %s\n", strerror(errnum));
+        pthread_mutex_destroy(&queue->mutex);
+        free(queue);
+        exit(EXIT_FAILURE);
+    }
+
+    return queue;
+}
+
+/**
+ * @brief Adds a work item to the queue.
+ * Falls back to the overflow stack if the ring is full.
+ */
+void queue_push(work_queue_t *queue, void *item) {
+    queue_push_batch(queue, 0, &item, 1, NULL);
+}
+
+/**
+ * @brief Adds several work items to the queue.
+ *
+ * The task count is raised before any item becomes visible, so a consumer
+ * can never finish an item and see the count drop to zero while other
+ * items of the batch are still being added. Sleeping consumers are woken
+ * once for the whole batch. With stats, waits for the mutex and the queue
+ * depth after the push are recorded.
+ */
+void queue_push_batch(work_queue_t *queue, int node, void *const *items, size_t count, queue_stats_t *stats) {
+    (void)node;
+    if (count == 0) {
+        return;
+    }
+    atomic_fetch_add(&queue->outstanding, (long)count);
+    for (size_t i = 0; i < count; i++) {
+        if (!ring_try_push(queue, items[i])) {
+            overflow_push(queue, items[i], stats);
+        }
+    }
+    if (stats) {
+        size_t depth = queue_depth(queue);
+        stats->peak_size = depth > stats->peak_size ? depth : stats->peak_size;
+    }
+    wake_sleepers(queue, count, stats);
+}
+
+/**
+ * @brief Retrieves a work item from the queue.
+ *
+ * Waits if the queue is empty but there are outstanding tasks.
+ * Returns an item for processing, or NULL if all tasks are done.
+ */
+void *queue_pop(work_queue_t *queue) {
+    void *item;
+    return queue_pop_batch(queue, 0, &item, 1, NULL) ? item : NULL;
+}
+
+/**
+ * @brief Retrieves several work items from the queue.
+ *
+ * Waits like queue_pop for the first item, then takes more while they are
+ * available, at most max in total and at most about half of what the
+ * queue held, so that other consumers still find work. Each item still
+ * needs its own call to queue_task_done. Returns the number of items
+ * taken, or 0 if all tasks are done. With stats, the time spent spinning
+ * or sleeping for the first item and waits for the mutex are recorded.
+ */
+size_t queue_pop_batch(work_queue_t *queue, int node, void **items, size_t max, queue_stats_t *stats) {
+    (void)node;
+    if (max == 0) {
+        return 0;
+    }
+
+    void *item = try_take(queue, 0, stats);
+    if (!item) {
+        uint64_t start = stats ? monotonic_ns() : 0;
+        item = wait_for_item(queue);
+        if (stats) {
+            stats->wait_ns += monotonic_ns() - start;
+        }
+        if (!item) {
+            return 0;
+        }
+    }
+    items[0] = item;
+
+    size_t limit = (queue_depth(queue) + 2) / 2;
+    if (limit > max) {
+        limit = max;
+    }
+
+    size_t count = 1;
+    while (count < limit && (item = try_take(queue, 0, stats)) != NULL) {
+        items[count++] = item;
+    }
+    return count;
+}
+
+/**
+ * @brief Returns about how many items wait in the ring and the overflow stack.
+ */
+size_t queue_size(work_queue_t *queue) {
+    return queue_depth(queue);
+}
+
+/**
+ * @brief Registers a task that is not in the queue.
+ * Consumers keep waiting for work until it is marked done with
+ * queue_task_done, like for a task that was pushed and popped.
+ */
+void queue_task_add(work_queue_t *queue, queue_stats_t *stats) {
+    (void)stats;
+    atomic_fetch_add(&queue->outstanding, 1);
+}
+
+/**
+ * @brief Signals completion of a task.
+ *
+ * Decrements the count of outstanding tasks in the queue.
+ * If all tasks are completed, it wakes up any threads waiting for work.
+ * With stats, the wait for the mutex is recorded.
+ */
+void queue_task_done(work_queue_t *queue, queue_stats_t *stats) {
+    if (atomic_fetch_sub(&queue->outstanding, 1) != 1) {
+        return;
+    }
+
+    queue_lock(queue, stats);
+    int errnum = pthread_cond_broadcast(&queue->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    safe_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Destroys the work queue and frees resources.
+ * Items still in the queue are not freed; the caller owns them.
+ */
+void queue_destroy(work_queue_t *queue) {
+    int errnum = pthread_mutex_destroy(&queue->mutex);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+
+    errnum = pthread_cond_destroy(&queue->cond);
+    if (errnum != 0) {
+        fprintf(stderr, "pthread_cond_destroy: %s\n", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    free(queue->overflow);
+    free(queue);
+}
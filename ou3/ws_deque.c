@@ -0,0 +1,183 @@
+/**
+ * @file ws_deque.c
+ * @brief Implementation of a Chase-Lev work-stealing deque using C11 atomics.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Lê, Pop, Cohen, Zappa Nardelli, PPoPP 2013). Buffers that are replaced
+ * when the deque grows are kept on a retired list until the deque is
+ * destroyed, since a concurrent thief may still be reading from them.
+ */
+
+#include "ws_deque.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* --- INTERNAL --- */
+
+/**
+ * @struct deque_buffer
+ * @brief Circular buffer of item slots, sized to a power of two.
+ */
+typedef struct deque_buffer {
+    int64_t capacity;             /**< Number of slots */
+    struct deque_buffer *retired; /**< Next buffer on the retired list */
+    _Atomic(void *) slots[];      /**< Item slots */
+} deque_buffer_t;
+
+/**
+ * @struct ws_deque
+ * @brief Internal structure representing a work-stealing deque.
+ */
+struct ws_deque {
+    _Atomic int64_t top;              /**< Index thieves steal from */
+    _Atomic int64_t bottom;           /**< Index the owner pushes to */
+    _Atomic(deque_buffer_t *) buffer; /**< Current buffer */
+    deque_buffer_t *retired;          /**< Buffers replaced by growth */
+};
+
+/**
+ * @brief Allocates a buffer with the given capacity.
+ */
+static deque_buffer_t *buffer_create(int64_t capacity) {
+    deque_buffer_t *buffer = malloc(sizeof(deque_buffer_t) + capacity * sizeof(_Atomic(void *)));
+    if (!buffer) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    buffer->capacity = capacity;
+    buffer->retired = NULL;
+    return buffer;
+}
+
+/**
+ * @brief Doubles the buffer, copying the live range [top, bottom).
+ * Only called by the owner. The old buffer is retired, not freed.
+ */
+static deque_buffer_t *grow(ws_deque_t *deque, deque_buffer_t *old, int64_t top, int64_t bottom) {
+    deque_buffer_t *buffer = buffer_create(old->capacity * 2);
+    for (int64_t i = top; i < bottom; i++) {
+        void *item = atomic_load_explicit(&old->slots[i & (old->capacity - 1)], memory_order_relaxed);
+        atomic_store_explicit(&buffer->slots[i & (buffer->capacity - 1)], item, memory_order_relaxed);
+    }
+
+    old->retired = deque->retired;
+    deque->retired = old;
+    atomic_store_explicit(&deque->buffer, buffer, memory_order_release);
+    return buffer;
+}
+
+/* --- EXTERNAL --- */
+
+/**
+ * @brief Creates a new, empty work-stealing deque.
+ */
+ws_deque_t *deque_create(void) {
+    ws_deque_t *deque = malloc(sizeof(ws_deque_t));
+    if (!deque) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->buffer, buffer_create(256));
+    deque->retired = NULL;
+    return deque;
+}
+
+/**
+ * @brief Pushes an item at the bottom of the deque.
+ * Must only be called by the owning thread. Grows the buffer when full.
+ */
+void deque_push(ws_deque_t *deque, void *item) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top > buffer->capacity - 1) {
+        buffer = grow(deque, buffer, top, bottom);
+    }
+
+    atomic_store_explicit(&buffer->slots[bottom & (buffer->capacity - 1)], item, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+/**
+ * @brief Pops the most recently pushed item from the bottom of the deque.
+ * Must only be called by the owning thread.
+ * Returns NULL if the deque is empty or the last item was lost to a thief.
+ */
+void *deque_pop(ws_deque_t *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *item = atomic_load_explicit(&buffer->slots[bottom & (buffer->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            item = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/**
+ * @brief Steals the oldest item from the top of the deque.
+ * May be called by any thread. Returns NULL if the deque is empty or
+ * another thread won the race for the item.
+ */
+void *deque_steal(ws_deque_t *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    void *item = atomic_load_explicit(&buffer->slots[top & (buffer->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return item;
+}
+
+/**
+ * @brief Returns an estimate of the number of items in the deque.
+ * The value may be stale by the time the caller inspects it.
+ */
+size_t deque_size(ws_deque_t *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    return bottom > top ? (size_t)(bottom - top) : 0;
+}
+
+/**
+ * @brief Destroys the deque and frees all buffers.
+ * Remaining items are not freed; the caller owns them.
+ */
+void deque_destroy(ws_deque_t *deque) {
+    deque_buffer_t *retired = deque->retired;
+    while (retired) {
+        deque_buffer_t *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+    free(atomic_load_explicit(&deque->buffer, memory_order_relaxed));
+    free(deque);
+}
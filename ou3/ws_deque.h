@@ -0,0 +1,24 @@
+/**
+ * @file ws_deque.h
+ * @brief Lock-free work-stealing deque (Chase-Lev) holding opaque items.
+ * @date 2025-11-19
+ * @author Bran Mjöberg Quanne
+ *
+ * Each deque has a single owner thread that pushes and pops at the bottom
+ * (LIFO), while any other thread may steal from the top (FIFO).
+ */
+
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stddef.h>
+
+typedef struct ws_deque ws_deque_t;
+ws_deque_t *deque_create(void);
+void deque_push(ws_deque_t *deque, void *item);
+void *deque_pop(ws_deque_t *deque);
+void *deque_steal(ws_deque_t *deque);
+size_t deque_size(ws_deque_t *deque);
+void deque_destroy(ws_deque_t *deque);
+
+#endif // WS_DEQUE_H